@@ -62,6 +62,8 @@ int fs_type = 0;
 int fs_type_a = 0;
 int fs_type_b = 0;
 bool fs_draw = false;
+// cleared by the frontend for frames it won't show, on top of the frameskip
+static bool fs_render = true;
 
 void SetFrameskip(int code)
 {
@@ -69,6 +71,11 @@ void SetFrameskip(int code)
 	fs_type_a = (0xF0 & fs_type) >> 4;
 	fs_type_b = 0xF & fs_type;
 }
+
+void SetFrameRendering(bool render)
+{
+	fs_render = render;
+}
 #endif
 
 typedef void (*renderfunc_t)(void);
@@ -641,6 +648,11 @@ static memoryMap map[256];
 static int clockTicks;
 
 static int romSize = 0x2000000;
+/* rom is only as large as the image rounded up to a power of two; the
+ * open bus pattern and mirrors past it are generated by CPUReadROM* */
+static uint32_t romBufferSize = 0;
+static uint32_t romMirrorSize = 0;
+static bool romAGBPrintHook = false;
 static uint32_t line[6][240];
 static bool gfxInWin[2][240];
 static int lineOBJpixleft[128];
@@ -789,8 +801,699 @@ static int timer3Ticks = 0;
 static int timer3Reload = 0;
 static int timer3ClockReload  = 0;
 
+/* The timerNTicks countdowns are only brought up to date when a timer
+ * overflows (or before something needs their exact value): timerElapsed
+ * holds the ticks that have passed since then, and timerNextSync the
+ * elapsed count at which the next free-running timer overflows. Counter
+ * reads in between are computed from these. */
+#define TIMER_NO_OVERFLOW 0x7FFFFFFF
+static int timerElapsed = 0;
+static int timerNextSync = TIMER_NO_OVERFLOW;
+
+/* Timers whose overflows nothing but the direct sound FIFOs sees are left
+ * out of timerNextSync (one bit each in timerBatched). Their overflows pile
+ * up until the next sync, which plays them out in one loop, telling the
+ * sound core how late each one is. Sound and DMA register writes sync first
+ * so the pending overflows still see the old settings. */
+static int timerBatched = 0;
+static bool timerSyncing = false;
+
+static void CPUSyncTimers (void);
+
+static INLINE void CPUSyncBatchedTimers (void)
+{
+	if(timerBatched && !timerSyncing)
+		CPUSyncTimers();
+}
+
+/* After a write that can make a batched timer unbatchable, rebuild the
+ * schedule and have the CPU loop pick it up. */
+static INLINE void CPURescheduleBatchedTimers (void)
+{
+	if(timerBatched && !timerSyncing)
+	{
+		CPUSyncTimers();
+		cpuNextEvent = cpuTotalTicks;
+	}
+}
+
+#define TIMER_COUNTER(n) \
+	(0xFFFF - ((timer##n##Ticks - timerElapsed - cpuTotalTicks) >> timer##n##ClockReload))
+
 static const uint32_t  objTilesAddress [3] = {0x010000, 0x014000, 0x014000};
 
+/*============================================================
+	CODE PAGE TRACKING
+============================================================ */
+
+/* One bit per 256-byte page of IWRAM/EWRAM that holds translated or
+ * cached guest code. RAM stores test the bit for the page they hit and
+ * invalidate it; DMA and the BIOS copy SWIs store through the same
+ * CPUWrite* paths so they are covered as well. */
+
+#define CODE_PAGE_SHIFT 8
+
+static uint32_t iwramCodePages[0x8000 >> (CODE_PAGE_SHIFT + 5)];
+static uint32_t ewramCodePages[0x40000 >> (CODE_PAGE_SHIFT + 5)];
+
+code_page_stats_t codePageStats;
+void (*cpuCodeInvalidateFunc)(uint32_t address, uint32_t size) = NULL;
+
+#define CODE_PAGE_MARKED(pages, offset) \
+	((pages)[(offset) >> (CODE_PAGE_SHIFT + 5)] & (1U << (((offset) >> CODE_PAGE_SHIFT) & 31)))
+
+static void CPUIdleLoopInvalidate(uint32_t address, uint32_t size);
+
+#define CHECK_IWRAM_CODE(offset) \
+	if (CODE_PAGE_MARKED(iwramCodePages, offset)) \
+		CPUInvalidateCodePage(iwramCodePages, 0x03000000, (offset));
+#define CHECK_EWRAM_CODE(offset) \
+	if (CODE_PAGE_MARKED(ewramCodePages, offset)) \
+		CPUInvalidateCodePage(ewramCodePages, 0x02000000, (offset));
+
+static void CPUInvalidateCodePage(uint32_t *pages, uint32_t base, uint32_t offset)
+{
+	pages[offset >> (CODE_PAGE_SHIFT + 5)] &= ~(1U << ((offset >> CODE_PAGE_SHIFT) & 31));
+	codePageStats.pagesMarked--;
+	codePageStats.invalidations++;
+	uint32_t address = base | (offset & ~((1U << CODE_PAGE_SHIFT) - 1));
+	CPUIdleLoopInvalidate(address, 1U << CODE_PAGE_SHIFT);
+	if(cpuCodeInvalidateFunc)
+		cpuCodeInvalidateFunc(address, 1U << CODE_PAGE_SHIFT);
+}
+
+static uint32_t * CPUCodePagesFor(uint32_t address, uint32_t *mask)
+{
+	switch(address >> 24)
+	{
+		case 0x02:
+			*mask = 0x3FFFF;
+			return ewramCodePages;
+		case 0x03:
+			*mask = 0x7FFF;
+			return iwramCodePages;
+		default:
+			return NULL;
+	}
+}
+
+void CPUMarkCodePage(uint32_t address)
+{
+	uint32_t mask;
+	uint32_t *pages = CPUCodePagesFor(address, &mask);
+	if(!pages)
+		return;
+
+	uint32_t offset = address & mask;
+	if(CODE_PAGE_MARKED(pages, offset))
+		return;
+	pages[offset >> (CODE_PAGE_SHIFT + 5)] |= 1U << ((offset >> CODE_PAGE_SHIFT) & 31);
+	codePageStats.pagesMarked++;
+}
+
+/* Bulk writes that bypass CPUWrite* (block transfer fast path, BIOS RAM
+ * clears, state loads) check their whole range here. The range must not
+ * cross a mirror boundary. */
+void CPUInvalidateCodeRange(uint32_t address, uint32_t size)
+{
+	uint32_t mask;
+	uint32_t *pages = CPUCodePagesFor(address, &mask);
+	if(!pages || !size || !codePageStats.pagesMarked)
+		return;
+
+	codePageStats.rangeChecks++;
+	uint32_t base = address & 0xFF000000;
+	uint32_t first = (address & mask) >> CODE_PAGE_SHIFT;
+	uint32_t last = ((address & mask) + size - 1) >> CODE_PAGE_SHIFT;
+	for(uint32_t page = first; page <= last; page++)
+	{
+		uint32_t offset = page << CODE_PAGE_SHIFT;
+		if(CODE_PAGE_MARKED(pages, offset))
+			CPUInvalidateCodePage(pages, base, offset);
+	}
+}
+
+void CPUClearCodePages(void)
+{
+	memset(iwramCodePages, 0, sizeof(iwramCodePages));
+	memset(ewramCodePages, 0, sizeof(ewramCodePages));
+	memset(&codePageStats, 0, sizeof(codePageStats));
+	CPUIdleLoopInvalidate(0, 0xFFFFFFFF);
+}
+
+/*============================================================
+	STATE PAGE TRACKING
+============================================================ */
+
+/* Every 1 KB page of IWRAM, EWRAM and VRAM remembers the state epoch of
+ * its last write. A checkpoint taken at epoch E only has to copy pages
+ * stamped E or later, so CPUWriteStateIncremental/CPUReadStateIncremental
+ * touch a few KB on a typical frame instead of 416 KB. Writes are stamped
+ * in the CPUWrite* paths (which DMA, the BIOS SWIs and cheats go through)
+ * and next to the bulk writes that call CPUInvalidateCodeRange. */
+
+#define STATE_PAGE_SHIFT 10
+#define STATE_PAGE_SIZE (1U << STATE_PAGE_SHIFT)
+#define STATE_PAGE_IWRAM 0
+#define STATE_PAGE_EWRAM (STATE_PAGE_IWRAM + (0x8000 >> STATE_PAGE_SHIFT))
+#define STATE_PAGE_VRAM (STATE_PAGE_EWRAM + (0x40000 >> STATE_PAGE_SHIFT))
+#define STATE_PAGE_COUNT (STATE_PAGE_VRAM + (0x20000 >> STATE_PAGE_SHIFT))
+
+static uint32_t statePageEpoch[STATE_PAGE_COUNT];
+static uint32_t stateEpoch = 1;
+
+#define STATE_PAGE_DIRTY(first, offset) \
+	statePageEpoch[(first) + ((offset) >> STATE_PAGE_SHIFT)] = stateEpoch;
+
+static void CPUMarkStateRange(int first, uint32_t offset, uint32_t size)
+{
+	uint32_t last = (offset + size - 1) >> STATE_PAGE_SHIFT;
+	for(uint32_t page = offset >> STATE_PAGE_SHIFT; page <= last; page++)
+		statePageEpoch[first + page] = stateEpoch;
+}
+
+static void CPUMarkStateAll(void)
+{
+	for(int page = 0; page < STATE_PAGE_COUNT; page++)
+		statePageEpoch[page] = stateEpoch;
+}
+
+/*============================================================
+	IDLE LOOP DETECTION
+============================================================ */
+
+/* Games spend a large part of each frame spinning in short loops that
+ * poll a RAM flag or I/O register until an interrupt changes it. When a
+ * taken backward branch closes such a loop, the loop is analysed once:
+ * if it only loads, compares and branches, and every register or flag it
+ * reads is either loop-invariant or written earlier in the same
+ * iteration, the next iteration would repeat this one exactly until the
+ * next scheduled event. The CPU then jumps straight to that event, like
+ * it does for halt. */
+
+#define IDLE_LOOP_ENTRIES	64
+#define IDLE_LOOP_HINTS		8
+#define IDLE_LOOP_MAX_INSNS	16
+#define IDLE_LOOP_MAX_LOADS	4
+
+#define IDLE_FLAG_NZ		(1U << 16)
+#define IDLE_FLAG_C		(1U << 17)
+#define IDLE_FLAG_V		(1U << 18)
+#define IDLE_FLAGS_ALL		(IDLE_FLAG_NZ | IDLE_FLAG_C | IDLE_FLAG_V)
+
+#define IDLE_LOAD_ABSOLUTE	0xFF
+
+enum {
+	IDLE_LOOP_UNKNOWN = 0,
+	IDLE_LOOP_YES,
+	IDLE_LOOP_NO
+};
+
+typedef struct {
+	uint32_t branch;
+	uint32_t target;
+	uint8_t state;
+	uint8_t thumb;
+	uint8_t loads;
+	uint8_t loadBase[IDLE_LOOP_MAX_LOADS];
+	uint32_t loadOffset[IDLE_LOOP_MAX_LOADS];
+} idle_loop_t;
+
+static bool idleLoopSkip = false;
+static idle_loop_t idleLoops[IDLE_LOOP_ENTRIES];
+
+/* Branches closing loops known to be idle that the analysis can't prove,
+ * e.g. because they poll through a helper call. Set per game. */
+static uint32_t idleLoopHints[IDLE_LOOP_HINTS];
+static int idleLoopHintCount = 0;
+
+void SetIdleLoopSkip(bool enable)
+{
+	idleLoopSkip = enable;
+}
+
+void SetIdleLoopHints(const uint32_t *branches, int count)
+{
+	if(count > IDLE_LOOP_HINTS)
+		count = IDLE_LOOP_HINTS;
+
+	memcpy(idleLoopHints, branches, count * sizeof(uint32_t));
+	idleLoopHintCount = count;
+
+	/* loops rejected before have to be looked at again */
+	memset(idleLoops, 0, sizeof(idleLoops));
+}
+
+static bool CPUIdleLoopHinted(uint32_t branch)
+{
+	for(int i = 0; i < idleLoopHintCount; i++)
+		if(idleLoopHints[i] == branch)
+			return true;
+	return false;
+}
+
+static void CPUIdleLoopInvalidate(uint32_t address, uint32_t size)
+{
+	for(int i = 0; i < IDLE_LOOP_ENTRIES; i++)
+	{
+		idle_loop_t *loop = &idleLoops[i];
+		if(loop->branch >= address && loop->target <= address + (size - 1))
+			loop->state = IDLE_LOOP_UNKNOWN;
+	}
+}
+
+static uint32_t idleCondFlags(int cond)
+{
+	switch(cond)
+	{
+		case 0x0: case 0x1:	// EQ NE
+		case 0x4: case 0x5:	// MI PL
+			return IDLE_FLAG_NZ;
+		case 0x2: case 0x3:	// CS CC
+			return IDLE_FLAG_C;
+		case 0x6: case 0x7:	// VS VC
+			return IDLE_FLAG_V;
+		case 0x8: case 0x9:	// HI LS
+			return IDLE_FLAG_NZ | IDLE_FLAG_C;
+		case 0xE:		// AL
+			return 0;
+		default:		// GE LT GT LE
+			return IDLE_FLAG_NZ | IDLE_FLAG_V;
+	}
+}
+
+/* Register/flag usage of one instruction inside a candidate loop. Returns
+ * false for anything that is not allowed in an idle loop (stores, calls,
+ * mode changes, multiplies, branches back into the body...). */
+static bool idleDecodeThumb(idle_loop_t *loop, u32 pc, u32 opcode, u32 *uses, u32 *defs)
+{
+	int rd = opcode & 7;
+	int rs = (opcode >> 3) & 7;
+	int loadBase = -1;
+	u32 loadOffset = 0;
+
+	*uses = 0;
+	*defs = 0;
+
+	switch(opcode >> 11)
+	{
+		case 0x00: case 0x01: case 0x02:	// LSL LSR ASR #imm
+			*uses = 1 << rs;
+			*defs = (1 << rd) | IDLE_FLAG_NZ;
+			if((opcode >> 6) & 31 || (opcode >> 11))
+				*defs |= IDLE_FLAG_C;
+			break;
+		case 0x03:				// ADD/SUB reg/imm3
+			*uses = 1 << rs;
+			if(!(opcode & 0x0400))
+				*uses |= 1 << ((opcode >> 6) & 7);
+			*defs = (1 << rd) | IDLE_FLAGS_ALL;
+			break;
+		case 0x04:				// MOV #imm
+			*defs = (1 << ((opcode >> 8) & 7)) | IDLE_FLAG_NZ;
+			break;
+		case 0x05:				// CMP #imm
+			*uses = 1 << ((opcode >> 8) & 7);
+			*defs = IDLE_FLAGS_ALL;
+			break;
+		case 0x06: case 0x07:			// ADD/SUB #imm
+			*uses = 1 << ((opcode >> 8) & 7);
+			*defs = *uses | IDLE_FLAGS_ALL;
+			break;
+		case 0x08:
+			if(opcode & 0x0400)		// hi register ops, BX
+				return false;
+			switch((opcode >> 6) & 15)
+			{
+				case 0x0: case 0x1: case 0xC: case 0xE:	// AND EOR ORR BIC
+					*uses = (1 << rd) | (1 << rs);
+					*defs = (1 << rd) | IDLE_FLAG_NZ;
+					break;
+				case 0x2: case 0x3: case 0x4: case 0x7:	// LSL LSR ASR ROR
+					*uses = (1 << rd) | (1 << rs) | IDLE_FLAG_C;
+					*defs = (1 << rd) | IDLE_FLAG_NZ | IDLE_FLAG_C;
+					break;
+				case 0x5: case 0x6:			// ADC SBC
+					*uses = (1 << rd) | (1 << rs) | IDLE_FLAG_C;
+					*defs = (1 << rd) | IDLE_FLAGS_ALL;
+					break;
+				case 0x8:				// TST
+					*uses = (1 << rd) | (1 << rs);
+					*defs = IDLE_FLAG_NZ;
+					break;
+				case 0x9:				// NEG
+					*uses = 1 << rs;
+					*defs = (1 << rd) | IDLE_FLAGS_ALL;
+					break;
+				case 0xA: case 0xB:			// CMP CMN
+					*uses = (1 << rd) | (1 << rs);
+					*defs = IDLE_FLAGS_ALL;
+					break;
+				case 0xF:				// MVN
+					*uses = 1 << rs;
+					*defs = (1 << rd) | IDLE_FLAG_NZ;
+					break;
+				default:				// MUL
+					return false;
+			}
+			break;
+		case 0x09:				// LDR Rd, [PC, #imm]
+			*defs = 1 << ((opcode >> 8) & 7);
+			loadBase = IDLE_LOAD_ABSOLUTE;
+			loadOffset = ((pc + 4) & ~2) + ((opcode & 0xFF) << 2);
+			break;
+		case 0x0D:				// LDR Rd, [Rb, #imm]
+			*uses = 1 << rs;
+			*defs = 1 << rd;
+			loadBase = rs;
+			loadOffset = ((opcode >> 6) & 31) << 2;
+			break;
+		case 0x0F:				// LDRB Rd, [Rb, #imm]
+			*uses = 1 << rs;
+			*defs = 1 << rd;
+			loadBase = rs;
+			loadOffset = (opcode >> 6) & 31;
+			break;
+		case 0x11:				// LDRH Rd, [Rb, #imm]
+			*uses = 1 << rs;
+			*defs = 1 << rd;
+			loadBase = rs;
+			loadOffset = ((opcode >> 6) & 31) << 1;
+			break;
+		case 0x13:				// LDR Rd, [SP, #imm]
+			*uses = 1 << 13;
+			*defs = 1 << ((opcode >> 8) & 7);
+			loadBase = 13;
+			loadOffset = (opcode & 0xFF) << 2;
+			break;
+		case 0x1A: case 0x1B:			// Bcc
+		{
+			int cond = (opcode >> 8) & 15;
+			if(cond >= 0xE)
+				return false;
+			u32 target = pc + 4 + (((s8)(opcode & 0xFF)) << 1);
+			if(pc != loop->branch && target - loop->target <= loop->branch - loop->target)
+				return false;
+			*uses = idleCondFlags(cond);
+			break;
+		}
+		case 0x1C:				// B
+			if(pc != loop->branch)
+				return false;
+			break;
+		default:
+			return false;
+	}
+
+	if(loadBase >= 0)
+	{
+		if(loop->loads == IDLE_LOOP_MAX_LOADS)
+			return false;
+		loop->loadBase[loop->loads] = loadBase;
+		loop->loadOffset[loop->loads] = loadOffset;
+		loop->loads++;
+	}
+	return true;
+}
+
+static bool idleDecodeArm(idle_loop_t *loop, u32 pc, u32 opcode, u32 *uses, u32 *defs)
+{
+	int cond = opcode >> 28;
+	int rn = (opcode >> 16) & 15;
+	int rd = (opcode >> 12) & 15;
+	int loadBase = -1;
+	u32 loadOffset = 0;
+
+	*uses = 0;
+	*defs = 0;
+
+	if(cond == 0xF)
+		return false;
+
+	if((opcode & 0x0F000000) == 0x0A000000)
+	{
+		// B
+		int offset = opcode & 0x00FFFFFF;
+		if(offset & 0x00800000)
+			offset |= 0xFF000000;
+		u32 target = pc + 8 + (offset << 2);
+		if(pc != loop->branch && target - loop->target <= loop->branch - loop->target)
+			return false;
+		*uses = idleCondFlags(cond);
+		return true;
+	}
+	else if((opcode & 0x0E000000) == 0 && (opcode & 0x90) == 0x90)
+	{
+		// LDRH/LDRSB/LDRSH Rd, [Rn, #imm] without writeback
+		if((opcode & 0x01700000) != 0x01500000 || !(opcode & 0x60) || rd == 15)
+			return false;
+		loadOffset = ((opcode >> 4) & 0xF0) | (opcode & 0x0F);
+		if(!(opcode & (1 << 23)))
+			loadOffset = -loadOffset;
+		if(rn == 15)
+		{
+			loadBase = IDLE_LOAD_ABSOLUTE;
+			loadOffset += pc + 8;
+		}
+		else
+		{
+			loadBase = rn;
+			*uses = 1 << rn;
+		}
+		*defs = 1 << rd;
+	}
+	else if((opcode & 0x0C000000) == 0)
+	{
+		// data processing, immediate or register shifted by immediate
+		int op = (opcode >> 21) & 15;
+		bool setFlags = (opcode >> 20) & 1;
+		bool test = op >= 0x8 && op <= 0xB;
+
+		if(!(opcode & 0x02000000) && (opcode & 0x10))
+			return false;
+		if((test && !setFlags) || rd == 15)
+			return false;
+		if(op != 0xD && op != 0xF)
+		{
+			if(rn == 15)
+				return false;
+			*uses |= 1 << rn;
+		}
+		if(!(opcode & 0x02000000))
+		{
+			int rm = opcode & 15;
+			if(rm == 15)
+				return false;
+			*uses |= 1 << rm;
+			if(((opcode >> 5) & 3) == 3 && !((opcode >> 7) & 31))
+				*uses |= IDLE_FLAG_C;	// RRX
+		}
+		if(op >= 0x5 && op <= 0x7)
+			*uses |= IDLE_FLAG_C;		// ADC SBC RSC
+		if(!test)
+			*defs |= 1 << rd;
+		if(setFlags)
+		{
+			switch(op)
+			{
+				case 0x2: case 0x3: case 0x4: case 0x5:
+				case 0x6: case 0x7: case 0xA: case 0xB:
+					*defs |= IDLE_FLAGS_ALL;
+					break;
+				default:
+					// shifter carry may leave C untouched
+					*uses |= IDLE_FLAG_C;
+					*defs |= IDLE_FLAG_NZ | IDLE_FLAG_C;
+					break;
+			}
+		}
+	}
+	else if((opcode & 0x0E000000) == 0x04000000)
+	{
+		// LDR/LDRB Rd, [Rn, #imm] without writeback
+		if((opcode & 0x01300000) != 0x01100000 || rd == 15)
+			return false;
+		loadOffset = opcode & 0xFFF;
+		if(!(opcode & (1 << 23)))
+			loadOffset = -loadOffset;
+		if(rn == 15)
+		{
+			loadBase = IDLE_LOAD_ABSOLUTE;
+			loadOffset += pc + 8;
+		}
+		else
+		{
+			loadBase = rn;
+			*uses = 1 << rn;
+		}
+		*defs = 1 << rd;
+	}
+	else
+		return false;
+
+	// a skipped conditional write leaves the old value in place
+	if(cond != 0xE)
+		*uses |= idleCondFlags(cond) | *defs;
+
+	if(loadBase >= 0)
+	{
+		if(loop->loads == IDLE_LOOP_MAX_LOADS)
+			return false;
+		loop->loadBase[loop->loads] = loadBase;
+		loop->loadOffset[loop->loads] = loadOffset;
+		loop->loads++;
+	}
+	return true;
+}
+
+static bool CPUIdleLoopAnalyse(idle_loop_t *loop)
+{
+	u32 uses[IDLE_LOOP_MAX_INSNS];
+	u32 defs[IDLE_LOOP_MAX_INSNS];
+	u32 size = loop->thumb ? 2 : 4;
+	u32 region = loop->target >> 24;
+	int count = ((loop->branch - loop->target) / size) + 1;
+	u32 allDefs = 0;
+	u32 defined = 0;
+
+	if(count > IDLE_LOOP_MAX_INSNS || (loop->branch >> 24) != region)
+		return false;
+	if(region != 0x02 && region != 0x03 && (region < 0x08 || region > 0x0C))
+		return false;
+
+	for(int i = 0; i < count; i++)
+	{
+		u32 pc = loop->target + i * size;
+		bool ok = loop->thumb ?
+			idleDecodeThumb(loop, pc, CPUReadHalfWordQuick(pc), &uses[i], &defs[i]) :
+			idleDecodeArm(loop, pc, CPUReadMemoryQuick(pc), &uses[i], &defs[i]);
+		if(!ok)
+			return false;
+		allDefs |= defs[i];
+	}
+
+	// nothing read may carry over from the previous iteration
+	for(int i = 0; i < count; i++)
+	{
+		if(uses[i] & ~defined & allDefs)
+			return false;
+		defined |= defs[i];
+	}
+
+	// load addresses have to be loop-invariant
+	for(int i = 0; i < loop->loads; i++)
+		if(loop->loadBase[i] != IDLE_LOAD_ABSOLUTE && (allDefs & (1U << loop->loadBase[i])))
+			return false;
+
+	if(region == 0x02 || region == 0x03)
+	{
+		for(u32 page = loop->target; page <= loop->branch; page += 1U << CODE_PAGE_SHIFT)
+			CPUMarkCodePage(page);
+		CPUMarkCodePage(loop->branch);
+	}
+
+	return true;
+}
+
+/* Timer counters advance between events and the save chips change state
+ * on read, so polling them cannot be skipped. */
+static bool idleLoadIsVolatile(u32 address)
+{
+	switch(address >> 24)
+	{
+		case 0x04:
+			return address < 0x4000400 && (address & 0x3F0) == 0x100;
+		case 0x0D:
+		case 0x0E:
+		case 0x0F:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static void CPUIdleLoopCheck(u32 branch, u32 target)
+{
+	idle_loop_t *loop = &idleLoops[(branch >> 1) & (IDLE_LOOP_ENTRIES - 1)];
+	bool thumb = !armState;
+
+	if(loop->state == IDLE_LOOP_UNKNOWN || loop->branch != branch ||
+	   loop->target != target || loop->thumb != thumb)
+	{
+		loop->branch = branch;
+		loop->target = target;
+		loop->thumb = thumb;
+		loop->loads = 0;
+		loop->state = CPUIdleLoopAnalyse(loop) ? IDLE_LOOP_YES : IDLE_LOOP_NO;
+
+		if(loop->state == IDLE_LOOP_NO && CPUIdleLoopHinted(branch))
+		{
+			loop->loads = 0;
+			loop->state = IDLE_LOOP_YES;
+		}
+	}
+
+	if(loop->state != IDLE_LOOP_YES)
+		return;
+
+	for(int i = 0; i < loop->loads; i++)
+	{
+		u32 address = loop->loadOffset[i];
+		if(loop->loadBase[i] != IDLE_LOAD_ABSOLUTE)
+			address += bus.reg[loop->loadBase[i]].I;
+		if(idleLoadIsVolatile(address))
+			return;
+	}
+
+	int remaining = cpuNextEvent - cpuTotalTicks;
+	if(remaining > clockTicks)
+		clockTicks = remaining;
+}
+
+#define IDLE_LOOP_CHECK(branch, target) \
+	if (idleLoopSkip && (target) <= (branch)) \
+		CPUIdleLoopCheck((branch), (target));
+
+/* Unbacked cartridge space reads back the halfword index of the address,
+ * except for the AGBPrint hook CPUReset places near the top of the bus. */
+static INLINE uint16_t CPUReadROMOpenBus(uint32_t offset)
+{
+	if(romAGBPrintHook && (offset & ~3) == 0x1fe209c)
+		return (offset & 2) ? 0x4770 : 0xdffa; /* SWI 0xFA; BX LR */
+	return (offset >> 1) & 0xFFFF;
+}
+
+static INLINE uint32_t CPUMirrorROM(uint32_t offset)
+{
+	if(offset >= romBufferSize && romMirrorSize && offset < 0x1000000)
+		return offset % romMirrorSize;
+	return offset;
+}
+
+static INLINE uint32_t CPUReadROM32(uint32_t offset)
+{
+	offset = CPUMirrorROM(offset);
+	if(offset < romBufferSize)
+		return READ32LE(rom + offset);
+	return CPUReadROMOpenBus(offset) | (CPUReadROMOpenBus(offset + 2) << 16);
+}
+
+static INLINE uint16_t CPUReadROM16(uint32_t offset)
+{
+	offset = CPUMirrorROM(offset);
+	if(offset < romBufferSize)
+		return READ16LE(rom + offset);
+	return CPUReadROMOpenBus(offset);
+}
+
+static INLINE uint8_t CPUReadROM8(uint32_t offset)
+{
+	offset = CPUMirrorROM(offset);
+	if(offset < romBufferSize)
+		return rom[offset];
+	return CPUReadROMOpenBus(offset & ~1) >> ((offset & 1) << 3);
+}
+
 static uint8_t* CPUDecodeAddress(uint32_t address) {
 
 	switch(address >> 24) {
@@ -840,6 +1543,8 @@ static uint8_t* CPUDecodeAddress(uint32_t address) {
 		case 0x0B: 
 		case 0x0C: 
 			/* gamepak ROM */
+			if((address & 0x1FFFFFC) >= romBufferSize)
+				goto unreadable;
 			return rom + (address & 0x1FFFFFC);
 		case 0x0D:
         	//value = eepromRead();
@@ -862,6 +1567,33 @@ unreadable:
 	return NULL;
 }
 
+static INLINE u16 CPUReadTimerCounter(u32 address)
+{
+	if(timerBatched & (1 << ((address >> 2) & 3)))
+		CPUSyncBatchedTimers();
+
+	switch(address)
+	{
+		case 0x100:
+			if(timer0On)
+				return TIMER_COUNTER(0);
+			break;
+		case 0x104:
+			if(timer1On && !(io_registers[REG_TM1CNT] & 4))
+				return TIMER_COUNTER(1);
+			break;
+		case 0x108:
+			if(timer2On && !(io_registers[REG_TM2CNT] & 4))
+				return TIMER_COUNTER(2);
+			break;
+		case 0x10C:
+			if(timer3On && !(io_registers[REG_TM3CNT] & 4))
+				return TIMER_COUNTER(3);
+			break;
+	}
+	return READ16LE(ioMem + address);
+}
+
 static INLINE u32 CPUReadMemory(u32 address)
 {
 	u32 value;
@@ -894,6 +1626,8 @@ static INLINE u32 CPUReadMemory(u32 address)
 					value = READ32LE(ioMem + (address & 0x3fC));
 				else
 					value = READ16LE(ioMem + (address & 0x3fc));
+				if((address & 0x3f0) == 0x100)
+					value = (value & 0xFFFF0000) | CPUReadTimerCounter(address & 0x3fc);
 			}
 			else
 				goto unreadable;
@@ -924,7 +1658,7 @@ static INLINE u32 CPUReadMemory(u32 address)
 		case 0x0B: 
 		case 0x0C: 
 			/* gamepak ROM */
-			value = READ32LE(rom + (address&0x1FFFFFC));
+			value = CPUReadROM32(address & 0x1FFFFFC);
 			break;
 		case 0x0D:
          value = eepromRead();
@@ -974,21 +1708,10 @@ static INLINE u32 CPUReadHalfWord(u32 address)
 		case 4:
 			if((address < 0x4000400) && ioReadable[address & 0x3fe])
 			{
-				value =  READ16LE(ioMem + (address & 0x3fe));
-				if (((address & 0x3fe)>0xFF) && ((address & 0x3fe)<0x10E))
-				{
-					if (((address & 0x3fe) == 0x100) && timer0On)
-						value = 0xFFFF - ((timer0Ticks-cpuTotalTicks) >> timer0ClockReload);
-					else
-						if (((address & 0x3fe) == 0x104) && timer1On && !(io_registers[REG_TM1CNT] & 4))
-							value = 0xFFFF - ((timer1Ticks-cpuTotalTicks) >> timer1ClockReload);
-						else
-							if (((address & 0x3fe) == 0x108) && timer2On && !(io_registers[REG_TM2CNT] & 4))
-								value = 0xFFFF - ((timer2Ticks-cpuTotalTicks) >> timer2ClockReload);
-							else
-								if (((address & 0x3fe) == 0x10C) && timer3On && !(io_registers[REG_TM3CNT] & 4))
-									value = 0xFFFF - ((timer3Ticks-cpuTotalTicks) >> timer3ClockReload);
-				}
+				if ((address & 0x3f0) == 0x100)
+					value = CPUReadTimerCounter(address & 0x3fe);
+				else
+					value =  READ16LE(ioMem + (address & 0x3fe));
 			}
 			else goto unreadable;
 			break;
@@ -1021,7 +1744,7 @@ static INLINE u32 CPUReadHalfWord(u32 address)
 				return rtcRead(address);
 				break;
 			default:
-				value = READ16LE(rom + (address & 0x1FFFFFE)); break;
+				value = CPUReadROM16(address & 0x1FFFFFE); break;
 			}
 			break;
 		case 13:
@@ -1074,7 +1797,11 @@ static INLINE u8 CPUReadByte(u32 address)
 			return internalRAM[address & 0x7fff];
 		case 4:
 			if((address < 0x4000400) && ioReadable[address & 0x3ff])
+			{
+				if((address & 0x3f0) == 0x100)
+					return CPUReadTimerCounter(address & 0x3fe) >> ((address & 1) << 3);
 				return ioMem[address & 0x3ff];
+			}
 			else goto unreadable;
 		case 5:
 			return paletteRAM[address & 0x3ff];
@@ -1092,7 +1819,7 @@ static INLINE u8 CPUReadByte(u32 address)
 		case 10:
 		case 11:
 		case 12:
-			return rom[address & 0x1FFFFFF];
+			return CPUReadROM8(address & 0x1FFFFFF);
 		case 13:
          	return eepromRead();
 		case 14:
@@ -1128,9 +1855,13 @@ static INLINE void CPUWriteMemory(u32 address, u32 value)
 	{
 		case 0x02:
 			WRITE32LE(workRAM + (address & 0x3FFFC), value);
+			CHECK_EWRAM_CODE(address & 0x3FFFC);
+			STATE_PAGE_DIRTY(STATE_PAGE_EWRAM, address & 0x3FFFC);
 			break;
 		case 0x03:
 			WRITE32LE(internalRAM + (address & 0x7ffC), value);
+			CHECK_IWRAM_CODE(address & 0x7ffC);
+			STATE_PAGE_DIRTY(STATE_PAGE_IWRAM, address & 0x7ffC);
 			break;
 		case 0x04:
 			if(address < 0x4000400)
@@ -1151,6 +1882,7 @@ static INLINE void CPUWriteMemory(u32 address, u32 value)
 
 
 			WRITE32LE(vram + address, value);
+			STATE_PAGE_DIRTY(STATE_PAGE_VRAM, address);
 			break;
 		case 0x07:
 			WRITE32LE(oam + (address & 0x3fc), value);
@@ -1176,9 +1908,13 @@ static INLINE void CPUWriteHalfWord(u32 address, u16 value)
 	{
 		case 2:
 			WRITE16LE(workRAM + (address & 0x3FFFE),value);
+			CHECK_EWRAM_CODE(address & 0x3FFFE);
+			STATE_PAGE_DIRTY(STATE_PAGE_EWRAM, address & 0x3FFFE);
 			break;
 		case 3:
 			WRITE16LE(internalRAM + (address & 0x7ffe), value);
+			CHECK_IWRAM_CODE(address & 0x7ffe);
+			STATE_PAGE_DIRTY(STATE_PAGE_IWRAM, address & 0x7ffe);
 			break;
 		case 4:
 			if(address < 0x4000400)
@@ -1194,6 +1930,7 @@ static INLINE void CPUWriteHalfWord(u32 address, u16 value)
 			if ((address & 0x18000) == 0x18000)
 				address &= 0x17fff;
 			WRITE16LE(vram + address, value);
+			STATE_PAGE_DIRTY(STATE_PAGE_VRAM, address);
 			break;
 		case 7:
 			WRITE16LE(oam + (address & 0x3fe), value);
@@ -1227,9 +1964,13 @@ static INLINE void CPUWriteByte(u32 address, u8 b)
 	{
 		case 2:
 			workRAM[address & 0x3FFFF] = b;
+			CHECK_EWRAM_CODE(address & 0x3FFFF);
+			STATE_PAGE_DIRTY(STATE_PAGE_EWRAM, address & 0x3FFFF);
 			break;
 		case 3:
 			internalRAM[address & 0x7fff] = b;
+			CHECK_IWRAM_CODE(address & 0x7fff);
+			STATE_PAGE_DIRTY(STATE_PAGE_IWRAM, address & 0x7fff);
 			break;
 		case 4:
 			if(address < 0x4000400)
@@ -1278,6 +2019,7 @@ static INLINE void CPUWriteByte(u32 address, u8 b)
 					case 0x9f:
 						{
 							int gb_addr = table[(address & 0xFF) - 0x60];
+							CPUSyncBatchedTimers();
 							soundEvent_u8(gb_addr, address&0xFF, b);
 						}
 						break;
@@ -1316,7 +2058,10 @@ static INLINE void CPUWriteByte(u32 address, u8 b)
 			// no need to switch
 			// byte writes to OBJ VRAM are ignored
 			if ((address) < objTilesAddress[(R_DISPCNT_Video_Mode+1)>>2])
+			{
 				*(u16 *)(vram + address) = (b << 8) | b;
+				STATE_PAGE_DIRTY(STATE_PAGE_VRAM, address);
+			}
 			break;
 		case 7:
 			// no need to switch
@@ -2072,17 +2817,25 @@ static void BIOS_RegisterRamReset(u32 flags)
 
 	if(flags)
 	{
-		if(flags & 0x01)
+		if(flags & 0x01) {
 			memset(workRAM, 0, 0x40000);		// clear work RAM
+			CPUInvalidateCodeRange(0x02000000, 0x40000);
+			CPUMarkStateRange(STATE_PAGE_EWRAM, 0, 0x40000);
+		}
 
-		if(flags & 0x02)
+		if(flags & 0x02) {
 			memset(internalRAM, 0, 0x7e00);		// don't clear 0x7e00-0x7fff, clear internal RAM
+			CPUInvalidateCodeRange(0x03000000, 0x7e00);
+			CPUMarkStateRange(STATE_PAGE_IWRAM, 0, 0x7e00);
+		}
 
 		if(flags & 0x04)
 			memset(paletteRAM, 0, 0x400);	// clear palette RAM
 
-		if(flags & 0x08)
+		if(flags & 0x08) {
 			memset(vram, 0, 0x18000);		// clear VRAM
+			CPUMarkStateRange(STATE_PAGE_VRAM, 0, 0x18000);
+		}
 
 		if(flags & 0x10)
 			memset(oam, 0, 0x400);			// clean OAM
@@ -2251,6 +3004,8 @@ static void BIOS_SoftReset (void)
 	u8 b = internalRAM[0x7ffa];
 
 	memset(&internalRAM[0x7e00], 0, 0x200);
+	CPUInvalidateCodeRange(0x03007e00, 0x200);
+	CPUMarkStateRange(STATE_PAGE_IWRAM, 0x7e00, 0x200);
 
 	if(b) {
 		bus.armNextPC = 0x02000000;
@@ -3839,6 +4594,108 @@ static  void arm7F6(u32 opcode) { LDR_PREINC_WB(OFFSET_ROR, OP_LDRB, 16); }
 
 // STM/LDM ////////////////////////////////////////////////////////////////
 
+/* Block transfers that stay inside one work RAM mirror (the common
+ * stack/struct copy case) resolve the host pointer once and move the
+ * registers directly instead of going through CPUReadMemory/CPUWriteMemory
+ * per register. Anything else (I/O, VRAM, ROM, mirror wrap) returns NULL
+ * and takes the per-register path. */
+static INLINE u8 * CPUBlockTransferPtr(u32 address, int count)
+{
+	u32 offset;
+
+	switch(address >> 24)
+	{
+		case 0x02:
+			offset = address & 0x3FFFC;
+			if(offset + (count << 2) > 0x40000)
+				return NULL;
+			return workRAM + offset;
+		case 0x03:
+			offset = address & 0x7FFC;
+			if(offset + (count << 2) > 0x8000)
+				return NULL;
+			return internalRAM + offset;
+		default:
+			return NULL;
+	}
+}
+
+/* Same timing as count accesses through the STM_REG/LDM_REG macros: one
+ * non-sequential access followed by count-1 sequential ones. */
+static INLINE void CPUBlockTransferTicks(u32 address, int count)
+{
+	int addr = (address >> 24) & 15;
+	int waitNonSeq = memoryWait32[addr];
+	int waitSeq = memoryWaitSeq32[addr];
+
+	clockTicks += count + waitNonSeq + (count - 1) * waitSeq;
+
+	if (bus.busPrefetch)
+	{
+		int waitState = (1 & ~waitNonSeq) | waitNonSeq;
+		bus.busPrefetchCount = ((bus.busPrefetchCount+1)<<waitState) - 1;
+		waitState = (1 & ~waitSeq) | waitSeq;
+		for(int i = 1; i < count; i++)
+			bus.busPrefetchCount = ((bus.busPrefetchCount+1)<<waitState) - 1;
+	}
+}
+
+/* rlist is a 16-bit register mask, bit 15 stores PC+4 like STM_PC.
+ * wbBase >= 0 writes temp back to that register after the first store,
+ * matching STMW_REG. */
+static INLINE bool CPUBlockStore(u32 rlist, u32 address, int wbBase, u32 temp)
+{
+	int count = cpuBitsSet[rlist & 255] + cpuBitsSet[(rlist >> 8) & 255];
+	if(!count)
+		return false;
+
+	u8 *dest = CPUBlockTransferPtr(address, count);
+	if(!dest)
+		return false;
+
+	for(int i = 0; rlist; i++, rlist >>= 1)
+	{
+		if(!(rlist & 1))
+			continue;
+		WRITE32LE(dest, i == 15 ? bus.reg[15].I + 4 : bus.reg[i].I);
+		dest += 4;
+		if(wbBase >= 0)
+			bus.reg[wbBase].I = temp;
+	}
+
+	if(codePageStats.pagesMarked)
+		CPUInvalidateCodeRange(address, count << 2);
+	if((address >> 24) == 0x02)
+		CPUMarkStateRange(STATE_PAGE_EWRAM, address & 0x3FFFC, count << 2);
+	else
+		CPUMarkStateRange(STATE_PAGE_IWRAM, address & 0x7FFC, count << 2);
+
+	CPUBlockTransferTicks(address, count);
+	return true;
+}
+
+static INLINE bool CPUBlockLoad(u32 rlist, u32 address)
+{
+	int count = cpuBitsSet[rlist & 255] + cpuBitsSet[(rlist >> 8) & 255];
+	if(!count)
+		return false;
+
+	u8 *src = CPUBlockTransferPtr(address, count);
+	if(!src)
+		return false;
+
+	for(int i = 0; rlist; i++, rlist >>= 1)
+	{
+		if(!(rlist & 1))
+			continue;
+		bus.reg[i].I = READ32LE(src);
+		src += 4;
+	}
+
+	CPUBlockTransferTicks(address, count);
+	return true;
+}
+
 #define STM_REG(bit,num) \
     if (opcode & (1U<<(bit))) {                         \
         CPUWriteMemory(address, bus.reg[(num)].I);          \
@@ -3962,22 +4819,28 @@ static  void arm7F6(u32 opcode) { LDR_PREINC_WB(OFFSET_ROR, OP_LDRB, 16); }
         LDM_REG(14, 14);                                \
     }
 #define STM_ALL \
-    STM_LOW(STM_REG);                                   \
-    STM_HIGH(STM_REG);                                  \
-    STM_PC;
+    if (!CPUBlockStore(opcode & 0xFFFF, address, -1, 0)) { \
+        STM_LOW(STM_REG);                               \
+        STM_HIGH(STM_REG);                              \
+        STM_PC;                                         \
+    }
 #define STMW_ALL \
-    STM_LOW(STMW_REG);                                  \
-    STM_HIGH(STMW_REG);                                 \
-    STMW_PC;
+    if (!CPUBlockStore(opcode & 0xFFFF, address, base, temp)) { \
+        STM_LOW(STMW_REG);                              \
+        STM_HIGH(STMW_REG);                             \
+        STMW_PC;                                        \
+    }
 #define LDM_ALL \
-    LDM_LOW;                                            \
-    LDM_HIGH;                                           \
-    if (opcode & (1U<<15)) {                            \
-        bus.reg[15].I = CPUReadMemory(address);             \
-	int dataticks_value = count ? DATATICKS_ACCESS_32BIT_SEQ(address) : DATATICKS_ACCESS_32BIT(address); \
-	DATATICKS_ACCESS_BUS_PREFETCH(address, dataticks_value); \
-	clockTicks += 1 + dataticks_value; \
-        count++;                                        \
+    if (!CPUBlockLoad(opcode & 0xFFFF, address)) {      \
+        LDM_LOW;                                        \
+        LDM_HIGH;                                       \
+        if (opcode & (1U<<15)) {                        \
+            bus.reg[15].I = CPUReadMemory(address);         \
+	    int dataticks_value = count ? DATATICKS_ACCESS_32BIT_SEQ(address) : DATATICKS_ACCESS_32BIT(address); \
+	    DATATICKS_ACCESS_BUS_PREFETCH(address, dataticks_value); \
+	    clockTicks += 1 + dataticks_value; \
+            count++;                                    \
+        }                                               \
     }                                                   \
     if (opcode & (1U<<15)) {                            \
         bus.armNextPC = bus.reg[15].I;                          \
@@ -4493,6 +5356,7 @@ static  void armA00(u32 opcode)
 
 	clockTicks = CLOCKTICKS_UPDATE_TYPE32P + 2;
 	bus.busPrefetchCount = 0;
+	IDLE_LOOP_CHECK(bus.armNextPC - 8 - (offset << 2), bus.armNextPC);
 }
 
 // BL <offset>
@@ -5909,14 +6773,16 @@ static  void thumbB4(u32 opcode)
   int count = 0;
   u32 temp = bus.reg[13].I - 4 * cpuBitsSet[opcode & 0xff];
   u32 address = temp & 0xFFFFFFFC;
-  PUSH_REG(1, 0);
-  PUSH_REG(2, 1);
-  PUSH_REG(4, 2);
-  PUSH_REG(8, 3);
-  PUSH_REG(16, 4);
-  PUSH_REG(32, 5);
-  PUSH_REG(64, 6);
-  PUSH_REG(128, 7);
+  if (!CPUBlockStore(opcode & 0xff, address, -1, 0)) {
+    PUSH_REG(1, 0);
+    PUSH_REG(2, 1);
+    PUSH_REG(4, 2);
+    PUSH_REG(8, 3);
+    PUSH_REG(16, 4);
+    PUSH_REG(32, 5);
+    PUSH_REG(64, 6);
+    PUSH_REG(128, 7);
+  }
   clockTicks += 1 + codeTicksAccess(bus.armNextPC, BITS_16);
   bus.reg[13].I = temp;
 }
@@ -5929,15 +6795,17 @@ static  void thumbB5(u32 opcode)
   int count = 0;
   u32 temp = bus.reg[13].I - 4 - 4 * cpuBitsSet[opcode & 0xff];
   u32 address = temp & 0xFFFFFFFC;
-  PUSH_REG(1, 0);
-  PUSH_REG(2, 1);
-  PUSH_REG(4, 2);
-  PUSH_REG(8, 3);
-  PUSH_REG(16, 4);
-  PUSH_REG(32, 5);
-  PUSH_REG(64, 6);
-  PUSH_REG(128, 7);
-  PUSH_REG(256, 14);
+  if (!CPUBlockStore((opcode & 0xff) | ((opcode & 0x100) << 6), address, -1, 0)) {
+    PUSH_REG(1, 0);
+    PUSH_REG(2, 1);
+    PUSH_REG(4, 2);
+    PUSH_REG(8, 3);
+    PUSH_REG(16, 4);
+    PUSH_REG(32, 5);
+    PUSH_REG(64, 6);
+    PUSH_REG(128, 7);
+    PUSH_REG(256, 14);
+  }
   clockTicks += 1 + codeTicksAccess(bus.armNextPC, BITS_16);
   bus.reg[13].I = temp;
 }
@@ -5950,14 +6818,16 @@ static  void thumbBC(u32 opcode)
   int count = 0;
   u32 address = bus.reg[13].I & 0xFFFFFFFC;
   u32 temp = bus.reg[13].I + 4*cpuBitsSet[opcode & 0xFF];
-  POP_REG(1, 0);
-  POP_REG(2, 1);
-  POP_REG(4, 2);
-  POP_REG(8, 3);
-  POP_REG(16, 4);
-  POP_REG(32, 5);
-  POP_REG(64, 6);
-  POP_REG(128, 7);
+  if (!CPUBlockLoad(opcode & 0xff, address)) {
+    POP_REG(1, 0);
+    POP_REG(2, 1);
+    POP_REG(4, 2);
+    POP_REG(8, 3);
+    POP_REG(16, 4);
+    POP_REG(32, 5);
+    POP_REG(64, 6);
+    POP_REG(128, 7);
+  }
   bus.reg[13].I = temp;
   clockTicks = 2 + codeTicksAccess(bus.armNextPC, BITS_16);
 }
@@ -5970,19 +6840,31 @@ static  void thumbBD(u32 opcode)
   int count = 0;
   u32 address = bus.reg[13].I & 0xFFFFFFFC;
   u32 temp = bus.reg[13].I + 4 + 4*cpuBitsSet[opcode & 0xFF];
-  POP_REG(1, 0);
-  POP_REG(2, 1);
-  POP_REG(4, 2);
-  POP_REG(8, 3);
-  POP_REG(16, 4);
-  POP_REG(32, 5);
-  POP_REG(64, 6);
-  POP_REG(128, 7);
-  bus.reg[15].I = (CPUReadMemory(address) & 0xFFFFFFFE);
-  int dataticks_value = count ? DATATICKS_ACCESS_32BIT_SEQ(address) : DATATICKS_ACCESS_32BIT(address);
-  DATATICKS_ACCESS_BUS_PREFETCH(address, dataticks_value);
-  clockTicks += 1 + dataticks_value;
-  count++;
+  u8 *src = CPUBlockTransferPtr(address, cpuBitsSet[opcode & 0xFF] + 1);
+  if (src) {
+    for (int i = 0; i < 8; i++) {
+      if (opcode & (1 << i)) {
+        bus.reg[i].I = READ32LE(src);
+        src += 4;
+      }
+    }
+    bus.reg[15].I = READ32LE(src) & 0xFFFFFFFE;
+    CPUBlockTransferTicks(address, cpuBitsSet[opcode & 0xFF] + 1);
+  } else {
+    POP_REG(1, 0);
+    POP_REG(2, 1);
+    POP_REG(4, 2);
+    POP_REG(8, 3);
+    POP_REG(16, 4);
+    POP_REG(32, 5);
+    POP_REG(64, 6);
+    POP_REG(128, 7);
+    bus.reg[15].I = (CPUReadMemory(address) & 0xFFFFFFFE);
+    int dataticks_value = count ? DATATICKS_ACCESS_32BIT_SEQ(address) : DATATICKS_ACCESS_32BIT(address);
+    DATATICKS_ACCESS_BUS_PREFETCH(address, dataticks_value);
+    clockTicks += 1 + dataticks_value;
+    count++;
+  }
   bus.armNextPC = bus.reg[15].I;
   bus.reg[15].I += 2;
   bus.reg[13].I = temp;
@@ -6024,14 +6906,16 @@ static  void thumbC0(u32 opcode)
   u32 temp = bus.reg[regist].I + 4*cpuBitsSet[opcode & 0xff];
   int count = 0;
   // store
-  THUMB_STM_REG(1, 0, regist);
-  THUMB_STM_REG(2, 1, regist);
-  THUMB_STM_REG(4, 2, regist);
-  THUMB_STM_REG(8, 3, regist);
-  THUMB_STM_REG(16, 4, regist);
-  THUMB_STM_REG(32, 5, regist);
-  THUMB_STM_REG(64, 6, regist);
-  THUMB_STM_REG(128, 7, regist);
+  if (!CPUBlockStore(opcode & 0xff, address, regist, temp)) {
+    THUMB_STM_REG(1, 0, regist);
+    THUMB_STM_REG(2, 1, regist);
+    THUMB_STM_REG(4, 2, regist);
+    THUMB_STM_REG(8, 3, regist);
+    THUMB_STM_REG(16, 4, regist);
+    THUMB_STM_REG(32, 5, regist);
+    THUMB_STM_REG(64, 6, regist);
+    THUMB_STM_REG(128, 7, regist);
+  }
   clockTicks = 1 + codeTicksAccess(bus.armNextPC, BITS_16);
 }
 
@@ -6045,14 +6929,16 @@ static  void thumbC8(u32 opcode)
   u32 temp = bus.reg[regist].I + 4*cpuBitsSet[opcode & 0xFF];
   int count = 0;
   // load
-  THUMB_LDM_REG(1, 0);
-  THUMB_LDM_REG(2, 1);
-  THUMB_LDM_REG(4, 2);
-  THUMB_LDM_REG(8, 3);
-  THUMB_LDM_REG(16, 4);
-  THUMB_LDM_REG(32, 5);
-  THUMB_LDM_REG(64, 6);
-  THUMB_LDM_REG(128, 7);
+  if (!CPUBlockLoad(opcode & 0xff, address)) {
+    THUMB_LDM_REG(1, 0);
+    THUMB_LDM_REG(2, 1);
+    THUMB_LDM_REG(4, 2);
+    THUMB_LDM_REG(8, 3);
+    THUMB_LDM_REG(16, 4);
+    THUMB_LDM_REG(32, 5);
+    THUMB_LDM_REG(64, 6);
+    THUMB_LDM_REG(128, 7);
+  }
   clockTicks = 2 + codeTicksAccess(bus.armNextPC, BITS_16);
   if(!(opcode & (1<<regist)))
     bus.reg[regist].I = temp;
@@ -6060,6 +6946,9 @@ static  void thumbC8(u32 opcode)
 
 // Conditional branches ///////////////////////////////////////////////////
 
+#define THUMB_IDLE_LOOP_CHECK(offset) \
+	IDLE_LOOP_CHECK(bus.armNextPC - 4 - (offset), bus.armNextPC)
+
 // BEQ offset
 static  void thumbD0(u32 opcode)
 {
@@ -6075,6 +6964,7 @@ static  void thumbD0(u32 opcode)
 		clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
 #endif		
 		bus.busPrefetchCount=0;
+		THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
 	}
 }
 
@@ -6088,6 +6978,7 @@ static  void thumbD1(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6101,6 +6992,7 @@ static  void thumbD2(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6114,6 +7006,7 @@ static  void thumbD3(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6127,6 +7020,7 @@ static  void thumbD4(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6140,6 +7034,7 @@ static  void thumbD5(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6153,6 +7048,7 @@ static  void thumbD6(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6166,6 +7062,7 @@ static  void thumbD7(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6179,6 +7076,7 @@ static  void thumbD8(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6192,6 +7090,7 @@ static  void thumbD9(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6205,6 +7104,7 @@ static  void thumbDA(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6218,6 +7118,7 @@ static  void thumbDB(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6231,6 +7132,7 @@ static  void thumbDC(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6244,6 +7146,7 @@ static  void thumbDD(u32 opcode)
     THUMB_PREFETCH;
 	clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
     bus.busPrefetchCount=0;
+    THUMB_IDLE_LOOP_CHECK(((s8)(opcode & 0xFF)) << 1);
   }
 }
 
@@ -6269,6 +7172,7 @@ static  void thumbE0(u32 opcode)
   THUMB_PREFETCH;
   clockTicks = CLOCKTICKS_UPDATE_TYPE16P;
   bus.busPrefetchCount=0;
+  THUMB_IDLE_LOOP_CHECK(offset);
 }
 
 // BLL #offset (forward)
@@ -6439,6 +7343,119 @@ static insnfunc_t thumbInsnTable[1024] = {
 
 // Wrapper routine (execution loop) ///////////////////////////////////////
 
+#if THUMB_COMPUTED_GOTO
+
+/* Threaded variant of the loop below: every handler gets its own label
+ * that calls it directly (so it can be inlined) and then fetches and
+ * dispatches the next opcode with its own indirect jump, instead of
+ * returning to one shared call site. The loop state lives in locals. */
+
+#define THUMB_HANDLERS(OP) \
+  OP(thumb00_00) OP(thumb00_01) OP(thumb00_02) OP(thumb00_03) OP(thumb00_04) OP(thumb00_05) \
+  OP(thumb00_06) OP(thumb00_07) OP(thumb00_08) OP(thumb00_09) OP(thumb00_0A) OP(thumb00_0B) \
+  OP(thumb00_0C) OP(thumb00_0D) OP(thumb00_0E) OP(thumb00_0F) OP(thumb00_10) OP(thumb00_11) \
+  OP(thumb00_12) OP(thumb00_13) OP(thumb00_14) OP(thumb00_15) OP(thumb00_16) OP(thumb00_17) \
+  OP(thumb00_18) OP(thumb00_19) OP(thumb00_1A) OP(thumb00_1B) OP(thumb00_1C) OP(thumb00_1D) \
+  OP(thumb00_1E) OP(thumb00_1F) OP(thumb08_00) OP(thumb08_01) OP(thumb08_02) OP(thumb08_03) \
+  OP(thumb08_04) OP(thumb08_05) OP(thumb08_06) OP(thumb08_07) OP(thumb08_08) OP(thumb08_09) \
+  OP(thumb08_0A) OP(thumb08_0B) OP(thumb08_0C) OP(thumb08_0D) OP(thumb08_0E) OP(thumb08_0F) \
+  OP(thumb08_10) OP(thumb08_11) OP(thumb08_12) OP(thumb08_13) OP(thumb08_14) OP(thumb08_15) \
+  OP(thumb08_16) OP(thumb08_17) OP(thumb08_18) OP(thumb08_19) OP(thumb08_1A) OP(thumb08_1B) \
+  OP(thumb08_1C) OP(thumb08_1D) OP(thumb08_1E) OP(thumb08_1F) OP(thumb10_00) OP(thumb10_01) \
+  OP(thumb10_02) OP(thumb10_03) OP(thumb10_04) OP(thumb10_05) OP(thumb10_06) OP(thumb10_07) \
+  OP(thumb10_08) OP(thumb10_09) OP(thumb10_0A) OP(thumb10_0B) OP(thumb10_0C) OP(thumb10_0D) \
+  OP(thumb10_0E) OP(thumb10_0F) OP(thumb10_10) OP(thumb10_11) OP(thumb10_12) OP(thumb10_13) \
+  OP(thumb10_14) OP(thumb10_15) OP(thumb10_16) OP(thumb10_17) OP(thumb10_18) OP(thumb10_19) \
+  OP(thumb10_1A) OP(thumb10_1B) OP(thumb10_1C) OP(thumb10_1D) OP(thumb10_1E) OP(thumb10_1F) \
+  OP(thumb18_0) OP(thumb18_1) OP(thumb18_2) OP(thumb18_3) OP(thumb18_4) OP(thumb18_5) OP(thumb18_6) \
+  OP(thumb18_7) OP(thumb1A_0) OP(thumb1A_1) OP(thumb1A_2) OP(thumb1A_3) OP(thumb1A_4) OP(thumb1A_5) \
+  OP(thumb1A_6) OP(thumb1A_7) OP(thumb1C_0) OP(thumb1C_1) OP(thumb1C_2) OP(thumb1C_3) OP(thumb1C_4) \
+  OP(thumb1C_5) OP(thumb1C_6) OP(thumb1C_7) OP(thumb1E_0) OP(thumb1E_1) OP(thumb1E_2) OP(thumb1E_3) \
+  OP(thumb1E_4) OP(thumb1E_5) OP(thumb1E_6) OP(thumb1E_7) OP(thumb20) OP(thumb21) OP(thumb22) \
+  OP(thumb23) OP(thumb24) OP(thumb25) OP(thumb26) OP(thumb27) OP(thumb28) OP(thumb29) OP(thumb2A) \
+  OP(thumb2B) OP(thumb2C) OP(thumb2D) OP(thumb2E) OP(thumb2F) OP(thumb30) OP(thumb31) OP(thumb32) \
+  OP(thumb33) OP(thumb34) OP(thumb35) OP(thumb36) OP(thumb37) OP(thumb38) OP(thumb39) OP(thumb3A) \
+  OP(thumb3B) OP(thumb3C) OP(thumb3D) OP(thumb3E) OP(thumb3F) OP(thumb40_0) OP(thumb40_1) \
+  OP(thumb40_2) OP(thumb40_3) OP(thumb41_0) OP(thumb41_1) OP(thumb41_2) OP(thumb41_3) OP(thumb42_0) \
+  OP(thumb42_1) OP(thumb42_2) OP(thumb42_3) OP(thumb43_0) OP(thumb43_1) OP(thumb43_2) OP(thumb43_3) \
+  OP(thumbUnknownInsn) OP(thumb44_1) OP(thumb44_2) OP(thumb44_3) OP(thumb45_1) OP(thumb45_2) \
+  OP(thumb45_3) OP(thumb46_1) OP(thumb46_2) OP(thumb46_3) OP(thumb47) OP(thumb48) OP(thumb50) \
+  OP(thumb52) OP(thumb54) OP(thumb56) OP(thumb58) OP(thumb5A) OP(thumb5C) OP(thumb5E) OP(thumb60) \
+  OP(thumb68) OP(thumb70) OP(thumb78) OP(thumb80) OP(thumb88) OP(thumb90) OP(thumb98) OP(thumbA0) \
+  OP(thumbA8) OP(thumbB0) OP(thumbB4) OP(thumbB5) OP(thumbBC) OP(thumbBD) OP(thumbC0) OP(thumbC8) \
+  OP(thumbD0) OP(thumbD1) OP(thumbD2) OP(thumbD3) OP(thumbD4) OP(thumbD5) OP(thumbD6) OP(thumbD7) \
+  OP(thumbD8) OP(thumbD9) OP(thumbDA) OP(thumbDB) OP(thumbDC) OP(thumbDD) OP(thumbDF) OP(thumbE0) \
+  OP(thumbF0) OP(thumbF4) OP(thumbF8)
+
+#ifdef USE_SWITICKS
+#define THUMB_KEEP_RUNNING (cpuTotalTicks < cpuNextEvent && !armState && !holdState && !SWITicks)
+#else
+#define THUMB_KEEP_RUNNING (cpuTotalTicks < cpuNextEvent && !armState && !holdState)
+#endif
+
+#if USE_CHEATS
+#define THUMB_CHEAT_CHECK cpuMasterCodeCheck();
+#else
+#define THUMB_CHEAT_CHECK
+#endif
+
+#define THUMB_DISPATCH \
+   clockTicks = 0; \
+   THUMB_CHEAT_CHECK \
+   opcode = cpuPrefetch[0]; \
+   cpuPrefetch[0] = cpuPrefetch[1]; \
+   bus.busPrefetch = false; \
+   oldArmNextPC = bus.armNextPC; \
+   bus.armNextPC = bus.reg[15].I; \
+   bus.reg[15].I += 2; \
+   THUMB_PREFETCH_NEXT; \
+   goto *dispatch[opcode >> 6];
+
+#define THUMB_NEXT \
+   if (clockTicks < 0) \
+      return 0; \
+   if (clockTicks == 0) \
+      clockTicks = codeTicksAccessSeq16(oldArmNextPC) + 1; \
+   cpuTotalTicks += clockTicks; \
+   if (!THUMB_KEEP_RUNNING) \
+      return 1; \
+   THUMB_DISPATCH
+
+#define THUMB_LABEL_PAIR(insn) { insn, &&label_##insn },
+#define THUMB_LABEL_BODY(insn) label_##insn: insn(opcode); THUMB_NEXT
+
+static int thumbExecute (void)
+{
+   static const void *dispatch[1024];
+   static const struct {
+      insnfunc_t insn;
+      const void *label;
+   } labels[] = { THUMB_HANDLERS(THUMB_LABEL_PAIR) };
+
+   u32 opcode;
+   u32 oldArmNextPC;
+
+   if (!dispatch[0])
+   {
+      for (int i = 0; i < 1024; i++)
+         for (unsigned j = 0; j < sizeof(labels) / sizeof(labels[0]); j++)
+            if (labels[j].insn == thumbInsnTable[i])
+            {
+               dispatch[i] = labels[j].label;
+               break;
+            }
+   }
+
+   CACHE_PREFETCH(clockTicks);
+
+   THUMB_DISPATCH
+
+   THUMB_HANDLERS(THUMB_LABEL_BODY)
+
+   return 1;
+}
+
+#else
 
 static int thumbExecute (void)
 {
@@ -6498,6 +7515,8 @@ static int thumbExecute (void)
    return 1;
 }
 
+#endif
+
 
 /*============================================================
 	GBA GFX
@@ -8707,6 +9726,179 @@ static variable_desc saveGameStruct[] = {
 	{ NULL, 0 }
 };
 
+/* A FIFO refill that can run late: a repeating sound DMA without an IRQ
+ * that reads RAM or ROM, or no sound DMA at all. */
+static bool CPUSoundDMACanBatch (uint16_t control, uint32_t source)
+{
+	if((control & 0xB000) != 0xB000)
+		return true;
+
+	uint32_t region = source >> 24;
+	return (control & 0x4200) == 0x0200 &&
+		(region == 2 || region == 3 || (region >= 8 && region <= 0x0D));
+}
+
+static bool CPUTimerCanBatch (int timer)
+{
+	uint16_t control = io_registers[REG_TM0CNT + timer * 2];
+	if((control & 0x40) || (timer && (control & 4)))
+		return false;
+
+	// the next timer counting this one's overflows
+	if(timer < 3 && (io_registers[REG_TM0CNT + timer * 2 + 2] & 0x84) == 0x84)
+		return false;
+
+	int dmas = soundTimerDmas(timer);
+	if((dmas & 2) && !CPUSoundDMACanBatch(DM1CNT_H, dma1Source))
+		return false;
+	if((dmas & 4) && !CPUSoundDMACanBatch(DM2CNT_H, dma2Source))
+		return false;
+	return true;
+}
+
+/* Reloads a free-running countdown that ran out ticks ago. A batched
+ * timer can be several overflows behind, the sound core gets each one. */
+static void CPUTimerOverflow (int timer, int &ticks, int period)
+{
+	do {
+		soundTimerOverflow(timer, -ticks);
+		ticks += period;
+	} while(ticks <= 0 && (timerBatched & (1 << timer)));
+}
+
+/* Brings the free-running timers up to date, raising overflows and
+ * stepping cascaded timers. Called when the next overflow is due and
+ * before anything that needs the countdowns to be exact. */
+static void CPUSyncTimers (void)
+{
+	int timerOverflow = 0;
+
+	timerSyncing = true;
+
+	if(timer0On) {
+		timer0Ticks -= timerElapsed;
+		if(timer0Ticks <= 0) {
+			CPUTimerOverflow(0, timer0Ticks, (0x10000 - timer0Reload) << timer0ClockReload);
+			timerOverflow |= 1;
+			if(io_registers[REG_TM0CNT] & 0x40) {
+				io_registers[REG_IF] |= 0x08;
+				UPDATE_REG(0x202, io_registers[REG_IF]);
+			}
+		}
+		io_registers[REG_TM0D] = 0xFFFF - (timer0Ticks >> timer0ClockReload);
+		UPDATE_REG(0x100, io_registers[REG_TM0D]);
+	}
+
+	if(timer1On) {
+		if(io_registers[REG_TM1CNT] & 4) {
+			if(timerOverflow & 1) {
+				io_registers[REG_TM1D]++;
+				if(io_registers[REG_TM1D] == 0) {
+					io_registers[REG_TM1D] += timer1Reload;
+					timerOverflow |= 2;
+					soundTimerOverflow(1, 0);
+					if(io_registers[REG_TM1CNT] & 0x40) {
+						io_registers[REG_IF] |= 0x10;
+						UPDATE_REG(0x202, io_registers[REG_IF]);
+					}
+				}
+				UPDATE_REG(0x104, io_registers[REG_TM1D]);
+			}
+		} else {
+			timer1Ticks -= timerElapsed;
+			if(timer1Ticks <= 0) {
+				CPUTimerOverflow(1, timer1Ticks, (0x10000 - timer1Reload) << timer1ClockReload);
+				timerOverflow |= 2;
+				if(io_registers[REG_TM1CNT] & 0x40) {
+					io_registers[REG_IF] |= 0x10;
+					UPDATE_REG(0x202, io_registers[REG_IF]);
+				}
+			}
+			io_registers[REG_TM1D] = 0xFFFF - (timer1Ticks >> timer1ClockReload);
+			UPDATE_REG(0x104, io_registers[REG_TM1D]);
+		}
+	}
+
+	if(timer2On) {
+		if(io_registers[REG_TM2CNT] & 4) {
+			if(timerOverflow & 2) {
+				io_registers[REG_TM2D]++;
+				if(io_registers[REG_TM2D] == 0) {
+					io_registers[REG_TM2D] += timer2Reload;
+					timerOverflow |= 4;
+					if(io_registers[REG_TM2CNT] & 0x40) {
+						io_registers[REG_IF] |= 0x20;
+						UPDATE_REG(0x202, io_registers[REG_IF]);
+					}
+				}
+				UPDATE_REG(0x108, io_registers[REG_TM2D]);
+			}
+		} else {
+			timer2Ticks -= timerElapsed;
+			if(timer2Ticks <= 0) {
+				CPUTimerOverflow(2, timer2Ticks, (0x10000 - timer2Reload) << timer2ClockReload);
+				timerOverflow |= 4;
+				if(io_registers[REG_TM2CNT] & 0x40) {
+					io_registers[REG_IF] |= 0x20;
+					UPDATE_REG(0x202, io_registers[REG_IF]);
+				}
+			}
+			io_registers[REG_TM2D] = 0xFFFF - (timer2Ticks >> timer2ClockReload);
+			UPDATE_REG(0x108, io_registers[REG_TM2D]);
+		}
+	}
+
+	if(timer3On) {
+		if(io_registers[REG_TM3CNT] & 4) {
+			if(timerOverflow & 4) {
+				io_registers[REG_TM3D]++;
+				if(io_registers[REG_TM3D] == 0) {
+					io_registers[REG_TM3D] += timer3Reload;
+					if(io_registers[REG_TM3CNT] & 0x40) {
+						io_registers[REG_IF] |= 0x40;
+						UPDATE_REG(0x202, io_registers[REG_IF]);
+					}
+				}
+				UPDATE_REG(0x10C, io_registers[REG_TM3D]);
+			}
+		} else {
+			timer3Ticks -= timerElapsed;
+			if(timer3Ticks <= 0) {
+				CPUTimerOverflow(3, timer3Ticks, (0x10000 - timer3Reload) << timer3ClockReload);
+				if(io_registers[REG_TM3CNT] & 0x40) {
+					io_registers[REG_IF] |= 0x40;
+					UPDATE_REG(0x202, io_registers[REG_IF]);
+				}
+			}
+			io_registers[REG_TM3D] = 0xFFFF - (timer3Ticks >> timer3ClockReload);
+			UPDATE_REG(0x10C, io_registers[REG_TM3D]);
+		}
+	}
+
+	timerElapsed = 0;
+	timerBatched = 0;
+	if(timer0On && CPUTimerCanBatch(0))
+		timerBatched |= 1;
+	if(timer1On && CPUTimerCanBatch(1))
+		timerBatched |= 2;
+	if(timer2On && CPUTimerCanBatch(2))
+		timerBatched |= 4;
+	if(timer3On && CPUTimerCanBatch(3))
+		timerBatched |= 8;
+
+	timerNextSync = TIMER_NO_OVERFLOW;
+	if(timer0On && !(timerBatched & 1) && timer0Ticks < timerNextSync)
+		timerNextSync = timer0Ticks;
+	if(timer1On && !(io_registers[REG_TM1CNT] & 4) && !(timerBatched & 2) && timer1Ticks < timerNextSync)
+		timerNextSync = timer1Ticks;
+	if(timer2On && !(io_registers[REG_TM2CNT] & 4) && !(timerBatched & 4) && timer2Ticks < timerNextSync)
+		timerNextSync = timer2Ticks;
+	if(timer3On && !(io_registers[REG_TM3CNT] & 4) && !(timerBatched & 8) && timer3Ticks < timerNextSync)
+		timerNextSync = timer3Ticks;
+
+	timerSyncing = false;
+}
+
 static INLINE int CPUUpdateTicks (void)
 {
 	int cpuLoopTicks = graphics.lcdTicks;
@@ -8714,17 +9906,8 @@ static INLINE int CPUUpdateTicks (void)
 	if(soundTicks < cpuLoopTicks)
 		cpuLoopTicks = soundTicks;
 
-	if(timer0On && (timer0Ticks < cpuLoopTicks))
-		cpuLoopTicks = timer0Ticks;
-
-	if(timer1On && !(io_registers[REG_TM1CNT] & 4) && (timer1Ticks < cpuLoopTicks))
-		cpuLoopTicks = timer1Ticks;
-
-	if(timer2On && !(io_registers[REG_TM2CNT] & 4) && (timer2Ticks < cpuLoopTicks))
-		cpuLoopTicks = timer2Ticks;
-
-	if(timer3On && !(io_registers[REG_TM3CNT] & 4) && (timer3Ticks < cpuLoopTicks))
-		cpuLoopTicks = timer3Ticks;
+	if(timerNextSync - timerElapsed < cpuLoopTicks)
+		cpuLoopTicks = timerNextSync - timerElapsed;
 
 #ifdef USE_SWITICKS
 	if (SWITicks)
@@ -8811,37 +9994,227 @@ static INLINE int CPUUpdateTicks (void)
   }
 
 
-unsigned CPUWriteState(uint8_t* data, unsigned size)
+/* Save states from version 11 on are a header (version, rom title, chunk
+ * count), a chunk table and the chunks themselves, each starting on a
+ * STATE_CHUNK_ALIGN boundary so the big memory regions are single aligned
+ * copies. Readers skip chunk ids they don't know. */
+
+#define STATE_CHUNK_ALIGN 16
+#define STATE_CHUNK_ID(a, b, c, d) ((a) | ((b) << 8) | ((c) << 16) | ((d) << 24))
+#define STATE_HEADER_SIZE (sizeof(int) + 16 + sizeof(int))
+/* set in the size of a chunk whose crc wasn't computed */
+#define STATE_CHUNK_UNCHECKED 0x80000000U
+
+/* only the visible part of pix, without the line padding */
+#define STATE_PIX_LINE_SIZE (240 * sizeof(uint16_t))
+
+typedef struct {
+	u32 id;
+	u32 offset;
+	u32 size;
+	u32 crc;
+} state_chunk_t;
+
+enum {
+	STATE_CHUNK_CPU,
+	STATE_CHUNK_IRAM,
+	STATE_CHUNK_PRAM,
+	STATE_CHUNK_WRAM,
+	STATE_CHUNK_VRAM,
+	STATE_CHUNK_OAM,
+	STATE_CHUNK_IO,
+	STATE_CHUNK_PIX,
+	STATE_CHUNK_EEPROM,
+	STATE_CHUNK_FLASH,
+	STATE_CHUNK_SOUND,
+	STATE_CHUNK_RTC,
+	STATE_CHUNK_COUNT
+};
+
+static const u32 stateChunkIds[STATE_CHUNK_COUNT] = {
+	STATE_CHUNK_ID('C', 'P', 'U', ' '),
+	STATE_CHUNK_ID('I', 'R', 'A', 'M'),
+	STATE_CHUNK_ID('P', 'R', 'A', 'M'),
+	STATE_CHUNK_ID('W', 'R', 'A', 'M'),
+	STATE_CHUNK_ID('V', 'R', 'A', 'M'),
+	STATE_CHUNK_ID('O', 'A', 'M', ' '),
+	STATE_CHUNK_ID('I', 'O', ' ', ' '),
+	STATE_CHUNK_ID('P', 'I', 'X', ' '),
+	STATE_CHUNK_ID('E', 'E', 'P', 'R'),
+	STATE_CHUNK_ID('F', 'L', 'S', 'H'),
+	STATE_CHUNK_ID('S', 'N', 'D', ' '),
+	STATE_CHUNK_ID('R', 'T', 'C', ' '),
+};
+
+/* sizes of the plain memory chunks, 0 for the ones with their own serialiser */
+static const u32 stateChunkSizes[STATE_CHUNK_COUNT] = {
+	0, 0x8000, 0x400, 0x40000, 0x20000, 0x400, 0x400, STATE_PIX_LINE_SIZE * 160, 0, 0, 0, 0
+};
+
+/* Copies the pages of a tracked region stamped at or after since, in runs
+ * of consecutive dirty pages. since == 0 copies the whole region. When
+ * restoring, restore is the guest address of dst: the copied pages are
+ * stamped and code cached from them is dropped, the rest keeps its code
+ * pages and idle loop verdicts. */
+static void CPUCopyStatePages(uint8_t *dst, const uint8_t *src, uint32_t size, int first, uint32_t since, uint32_t restore)
+{
+	uint32_t pages = size >> STATE_PAGE_SHIFT;
+	uint32_t page = 0;
+
+	while (page < pages)
+	{
+		if (statePageEpoch[first + page] < since)
+		{
+			page++;
+			continue;
+		}
+
+		uint32_t run = page;
+		while (run < pages && statePageEpoch[first + run] >= since)
+		{
+			if (restore)
+				statePageEpoch[first + run] = stateEpoch;
+			run++;
+		}
+
+		memcpy(dst + (page << STATE_PAGE_SHIFT), src + (page << STATE_PAGE_SHIFT), (run - page) << STATE_PAGE_SHIFT);
+		if (restore)
+			CPUInvalidateCodeRange(restore + (page << STATE_PAGE_SHIFT), (run - page) << STATE_PAGE_SHIFT);
+		page = run;
+	}
+}
+
+static void CPUWriteStateChunk(int chunk, uint8_t *& data, uint32_t since)
+{
+	switch (chunk)
+	{
+		case STATE_CHUNK_CPU:
+			utilWriteIntMem(data, useBios);
+			utilWriteMem(data, &bus.reg[0], sizeof(bus.reg));
+			utilWriteDataMem(data, saveGameStruct);
+			utilWriteIntMem(data, stopState);
+			utilWriteIntMem(data, IRQTicks);
+			break;
+		case STATE_CHUNK_IRAM:
+			CPUCopyStatePages(data, internalRAM, 0x8000, STATE_PAGE_IWRAM, since, 0);
+			data += 0x8000;
+			break;
+		case STATE_CHUNK_PRAM:
+			utilWriteMem(data, paletteRAM, 0x400);
+			break;
+		case STATE_CHUNK_WRAM:
+			CPUCopyStatePages(data, workRAM, 0x40000, STATE_PAGE_EWRAM, since, 0);
+			data += 0x40000;
+			break;
+		case STATE_CHUNK_VRAM:
+			CPUCopyStatePages(data, vram, 0x20000, STATE_PAGE_VRAM, since, 0);
+			data += 0x20000;
+			break;
+		case STATE_CHUNK_OAM:
+			utilWriteMem(data, oam, 0x400);
+			break;
+		case STATE_CHUNK_IO:
+			utilWriteMem(data, ioMem, 0x400);
+			break;
+		case STATE_CHUNK_PIX:
+			for (int y = 0; y < 160; y++)
+				utilWriteMem(data, pix + y * PIX_BUFFER_SCREEN_WIDTH, STATE_PIX_LINE_SIZE);
+			break;
+		case STATE_CHUNK_EEPROM:
+			eepromSaveGameMem(data);
+			break;
+		case STATE_CHUNK_FLASH:
+			flashSaveGameMem(data);
+			break;
+		case STATE_CHUNK_SOUND:
+			soundSaveGameMem(data);
+			break;
+		case STATE_CHUNK_RTC:
+			rtcSaveGameMem(data);
+			break;
+	}
+}
+
+/* bytes the serialiser of a chunk reads, plain memory chunks are in stateChunkSizes */
+static unsigned CPUStateChunkFieldsSize(int chunk)
+{
+	switch (chunk)
+	{
+		case STATE_CHUNK_CPU:
+			return sizeof(int) + sizeof(bus.reg) + utilDataMemSize(saveGameStruct) + 2 * sizeof(int);
+		case STATE_CHUNK_EEPROM:
+			return eepromGameMemSize();
+		case STATE_CHUNK_FLASH:
+			return flashGameMemSize();
+		case STATE_CHUNK_SOUND:
+			return soundGameMemSize();
+		case STATE_CHUNK_RTC:
+			return rtcGameMemSize();
+	}
+	return 0;
+}
+
+static bool CPUIsPagedChunk(int chunk)
+{
+	return chunk == STATE_CHUNK_IRAM || chunk == STATE_CHUNK_WRAM || chunk == STATE_CHUNK_VRAM;
+}
+
+static unsigned CPUWriteStateImage(uint8_t* data, state_checkpoint_t *checkpoint)
 {
 	uint8_t *orig = data;
+	uint32_t since = checkpoint ? checkpoint->epoch : 0;
+
+	CPUSyncTimers();
 
 	utilWriteIntMem(data, SAVE_GAME_VERSION);
 	utilWriteMem(data, &rom[0xa0], 16);
-	utilWriteIntMem(data, useBios);
-	utilWriteMem(data, &bus.reg[0], sizeof(bus.reg));
-
-	utilWriteDataMem(data, saveGameStruct);
+	utilWriteIntMem(data, STATE_CHUNK_COUNT);
 
-	utilWriteIntMem(data, stopState);
-	utilWriteIntMem(data, IRQTicks);
+	uint8_t *table = data;
+	data += STATE_CHUNK_COUNT * sizeof(state_chunk_t);
 
-	utilWriteMem(data, internalRAM, 0x8000);
-	utilWriteMem(data, paletteRAM, 0x400);
-	utilWriteMem(data, workRAM, 0x40000);
-	utilWriteMem(data, vram, 0x20000);
-	utilWriteMem(data, oam, 0x400);
-	utilWriteMem(data, pix, 4 * PIX_BUFFER_SCREEN_WIDTH * 160);
-	utilWriteMem(data, ioMem, 0x400);
+	for (int i = 0; i < STATE_CHUNK_COUNT; i++)
+	{
+		/* zero the padding, rewind diffs whole images */
+		while ((data - orig) & (STATE_CHUNK_ALIGN - 1))
+			*data++ = 0;
+
+		uint8_t *start = data;
+		CPUWriteStateChunk(i, data, since);
+
+		state_chunk_t chunk;
+		chunk.id = stateChunkIds[i];
+		chunk.offset = start - orig;
+		chunk.size = data - start;
+		chunk.crc = 0;
+		/* checksumming the paged chunks would cost what skipping them saves,
+		 * incremental images only live in memory anyway */
+		if (checkpoint && CPUIsPagedChunk(i))
+			chunk.size |= STATE_CHUNK_UNCHECKED;
+		else
+			chunk.crc = utilCRC32(0, start, chunk.size);
+		memcpy(table + i * sizeof(state_chunk_t), &chunk, sizeof(chunk));
+	}
 
-	eepromSaveGameMem(data);
-	flashSaveGameMem(data);
-	soundSaveGameMem(data);
-	rtcSaveGameMem(data);
+	if (checkpoint)
+		checkpoint->epoch = ++stateEpoch;
 
 	return (ptrdiff_t)data - (ptrdiff_t)orig;
 }
 
-bool CPUWriteBatteryFile(const char *fileName)
+unsigned CPUWriteState(uint8_t* data, unsigned size)
+{
+	return CPUWriteStateImage(data, NULL);
+}
+
+unsigned CPUWriteStateIncremental(uint8_t* data, unsigned size, state_checkpoint_t *checkpoint)
+{
+	return CPUWriteStateImage(data, checkpoint);
+}
+
+/* Returns the live save memory that belongs in the battery file and its
+ * size, or NULL when the game has nothing to save (yet). */
+const uint8_t *CPUBatteryData(unsigned *size)
 {
 	if(gbaSaveType == 0)
 	{
@@ -8859,7 +10232,25 @@ bool CPUWriteBatteryFile(const char *fileName)
 			}
 	}
 
-	if((gbaSaveType) && (gbaSaveType!=5))
+	if(!gbaSaveType || gbaSaveType == 5)
+		return NULL;
+
+	// only save if Flash/Sram in use or EEprom in use
+	if(gbaSaveType != 3) {
+		*size = gbaSaveType == 2 ? flashSize : 0x10000;
+		return flashSaveMemory;
+	}
+
+	*size = eepromSize;
+	return eepromData;
+}
+
+bool CPUWriteBatteryFile(const char *fileName)
+{
+	unsigned size;
+	const uint8_t *data = CPUBatteryData(&size);
+
+	if(data)
 	{
 		FILE *file = fopen(fileName, "wb");
 
@@ -8868,30 +10259,14 @@ bool CPUWriteBatteryFile(const char *fileName)
 			return false;
 		}
 
-		// only save if Flash/Sram in use or EEprom in use
-		if(gbaSaveType != 3) {
-			if(gbaSaveType == 2) {
-				if(fwrite(flashSaveMemory, 1, flashSize, file) != (size_t)flashSize) {
-					fclose(file);
-					return false;
-				}
-			} else {
-				if(fwrite(flashSaveMemory, 1, 0x10000, file) != 0x10000) {
-					fclose(file);
-					return false;
-				}
-			}
-		} else {
-			if(fwrite(eepromData, 1, eepromSize, file) != (size_t)eepromSize) {
-				fclose(file);
-				return false;
-			}
+		if(fwrite(data, 1, size, file) != size) {
+			fclose(file);
+			return false;
 		}
 		fclose(file);
 	}
 	return true;
 }
-
 bool CPUReadBatteryFile(const char *fileName)
 {
 	FILE *file = fopen(fileName, "rb");
@@ -8977,10 +10352,14 @@ static bool CPUIsELF(const char *file)
 
 void CPUCleanUp (void)
 {
+	CPUClearCodePages();
+
 	if(rom != NULL) {
 		memalign_free(rom);
 		rom = NULL;
 	}
+	romBufferSize = 0;
+	romMirrorSize = 0;
 
 	if(vram != NULL) {
 		memalign_free(vram);
@@ -9027,12 +10406,12 @@ void CPUCleanUp (void)
 bool CPUSetupBuffers()
 {
 	romSize = 0x2000000;
-	if(rom != NULL)
+	if(workRAM != NULL)
 		CPUCleanUp();
 
 	//systemSaveUpdateCounter = SYSTEM_SAVE_NOT_UPDATED;
 
-	rom = (uint8_t *)memalign_alloc_aligned(0x2000000);
+	/* rom is allocated by CPUSetupROM once the image size is known */
 	workRAM = (uint8_t *)memalign_alloc_aligned(0x40000);
 	bios = (uint8_t *)memalign_alloc_aligned(0x4000);
 	internalRAM = (uint8_t *)memalign_alloc_aligned(0x8000);
@@ -9042,7 +10421,6 @@ bool CPUSetupBuffers()
 	pix = (uint16_t *)memalign_alloc_aligned(4 * PIX_BUFFER_SCREEN_WIDTH * 160);
 	ioMem = (uint8_t *)memalign_alloc_aligned(0x400);
 
-	memset(rom, 0, 0x2000000);
 	memset(workRAM, 1, 0x40000);
 	memset(bios, 1, 0x4000);
 	memset(internalRAM, 1, 0x8000);
@@ -9052,7 +10430,7 @@ bool CPUSetupBuffers()
 	memset(pix, 1, 4 * PIX_BUFFER_SCREEN_WIDTH * 160);
 	memset(ioMem, 1, 0x400);
 
-	if(rom == NULL || workRAM == NULL || bios == NULL ||
+	if(workRAM == NULL || bios == NULL ||
 	   internalRAM == NULL || paletteRAM == NULL ||
 	   vram == NULL || oam == NULL || pix == NULL || ioMem == NULL) {
 		CPUCleanUp();
@@ -9108,34 +10486,66 @@ static void applyCartridgeOverride(char* code) {
 #endif
 }
 
+/* Allocates rom for an image of the given size, rounded up to a power of
+ * two so the map[] masks used by the fetch paths never leave the buffer. */
+static bool CPUSetupROM(int size)
+{
+	romBufferSize = 0x10000;
+	while(romBufferSize < (uint32_t)size)
+		romBufferSize <<= 1;
+
+	romMirrorSize = 0;
+	rom = (uint8_t *)memalign_alloc_aligned(romBufferSize);
+	if(rom == NULL)
+		return false;
+
+	memset(rom, 0, romBufferSize);
+	return true;
+}
+
+/* Fills the rest of the rom buffer with the open bus pattern; anything
+ * past the buffer is generated on read by CPUReadROMOpenBus. */
+static void CPUFillROMOpenBus()
+{
+	uint16_t *temp = (uint16_t *)(rom+((romSize+1)&~1));
+
+	for(uint32_t i = (romSize+1)&~1; i < romBufferSize; i+=2) {
+		WRITE16LE(temp, (i >> 1) & 0xFFFF);
+		temp++;
+	}
+}
+
 int CPULoadRom(const char * file)
 {
 	if (!CPUSetupBuffers()) return 0;
-	
-	uint8_t *whereToLoad = cpuIsMultiBoot ? workRAM : rom;
 
 	if(file != NULL)
 	{
+		int size = utilImageSize(file, utilIsGBAImage);
+		int limit = cpuIsMultiBoot ? 0x40000 : 0x2000000;
+
+		if(size <= 0 || size > limit || !CPUSetupROM(cpuIsMultiBoot ? 0 : size)) {
+			CPUCleanUp();
+			return 0;
+		}
+
+		uint8_t *whereToLoad = cpuIsMultiBoot ? workRAM : rom;
+
 		if(!utilLoad(file,
 					utilIsGBAImage,
 					whereToLoad,
 					romSize)) {
-			memalign_free(rom);
-			rom = NULL;
-			memalign_free(workRAM);
-			workRAM = NULL;
+			CPUCleanUp();
 			return 0;
 		}
 	}
-
-	uint16_t *temp = (uint16_t *)(rom+((romSize+1)&~1));
-	int i;
-
-	for(i = (romSize+1)&~1; i < 0x2000000; i+=2) {
-		WRITE16LE(temp, (i >> 1) & 0xFFFF);
-		temp++;
+	else if(!CPUSetupROM(romSize)) {
+		CPUCleanUp();
+		return 0;
 	}
 
+	CPUFillROMOpenBus();
+
 	return romSize;
 }
 
@@ -9143,6 +10553,12 @@ int CPULoadRomData(const char *data, int size)
 {
 	if (!CPUSetupBuffers()) return 0;
 
+	if(size <= 0 || size > (cpuIsMultiBoot ? 0x40000 : 0x2000000) ||
+	   !CPUSetupROM(cpuIsMultiBoot ? 0 : size)) {
+		CPUCleanUp();
+		return 0;
+	}
+
 	uint8_t *whereToLoad = cpuIsMultiBoot ? workRAM : rom;
 
 	romSize = size % 2 == 0 ? size : size + 1;
@@ -9152,13 +10568,7 @@ int CPULoadRomData(const char *data, int size)
 	memcpy(cartridgeCode, whereToLoad + 0xAC, 4);
 	applyCartridgeOverride(cartridgeCode);
 
-	uint16_t *temp = (u16 *)(rom+((romSize+1)&~1));
-	int i;
-
-	for(i = (romSize+1)&~1; i < 0x2000000; i+=2) {
-		WRITE16LE(temp, (i >> 1) & 0xFFFF);
-		temp++;
-	}
+	CPUFillROMOpenBus();
 
 	return romSize;
 }
@@ -9167,16 +10577,25 @@ void doMirroring (bool b)
 {
 	uint32_t mirroredRomSize = (((romSize)>>20) & 0x3F)<<20;
 	uint32_t mirroredRomAddress = romSize;
+	romMirrorSize = 0;
 	if ((mirroredRomSize <=0x800000) && (b))
 	{
-		mirroredRomAddress = mirroredRomSize;
 		if (mirroredRomSize==0)
 			mirroredRomSize=0x100000;
-		while (mirroredRomAddress<0x01000000)
+		mirroredRomAddress = mirroredRomSize;
+		/* only the part of the mirror backed by rom is copied, the slow
+		 * read paths fold the rest of the first 16 MB with romMirrorSize.
+		 * The last copy is cut short when the buffer ends inside a mirror */
+		uint32_t mirrorEnd = romBufferSize < 0x01000000 ? romBufferSize : 0x01000000;
+		while (mirroredRomAddress < mirrorEnd)
 		{
-			memcpy((uint16_t *)(rom+mirroredRomAddress), (uint16_t *)(rom), mirroredRomSize);
+			uint32_t copySize = mirrorEnd - mirroredRomAddress;
+			if (copySize > mirroredRomSize)
+				copySize = mirroredRomSize;
+			memcpy((uint16_t *)(rom+mirroredRomAddress), (uint16_t *)(rom), copySize);
 			mirroredRomAddress+=mirroredRomSize;
 		}
+		romMirrorSize = mirroredRomSize;
 	}
 }
 
@@ -11518,16 +12937,13 @@ renderfunc_t GetRenderFunc(int mode, int type) {
 	}
 }
 
-bool CPUReadState(const uint8_t* data, unsigned size)
+/* version 10 states are the same fields written back to back */
+static bool CPUReadStateV10(const uint8_t *data, unsigned size)
 {
-	// Don't really care about version.
-	int version = utilReadIntMem(data);
-	if (version != SAVE_GAME_VERSION)
-		return false;
-
-	char romname[16];
-	utilReadMem(romname, data, 16);
-	if (memcmp(&rom[0xa0], romname, 16) != 0)
+	unsigned fieldsSize = CPUStateChunkFieldsSize(STATE_CHUNK_CPU) + 0x8000 + 0x400 + 0x40000 + 0x20000 + 0x400 +
+		4 * PIX_BUFFER_SCREEN_WIDTH * 160 + 0x400 + eepromGameMemSize() + flashGameMemSize() +
+		soundGameMemSize() + rtcGameMemSize();
+	if (size < fieldsSize)
 		return false;
 
 	// Don't care about use bios ...
@@ -11540,13 +12956,6 @@ bool CPUReadState(const uint8_t* data, unsigned size)
 	stopState = utilReadIntMem(data) ? true : false;
 
 	IRQTicks = utilReadIntMem(data);
-	if (IRQTicks > 0)
-		intState = true;
-	else
-	{
-		intState = false;
-		IRQTicks = 0;
-	}
 
 	utilReadMem(internalRAM, data, 0x8000);
 	utilReadMem(paletteRAM, data, 0x400);
@@ -11556,11 +12965,131 @@ bool CPUReadState(const uint8_t* data, unsigned size)
 	utilReadMem(pix, data, 4 * PIX_BUFFER_SCREEN_WIDTH * 160);
 	utilReadMem(ioMem, data, 0x400);
 
-	eepromReadGameMem(data, version);
-	flashReadGameMem(data, version);
-	soundReadGameMem(data, version);
+	eepromReadGameMem(data, SAVE_GAME_VERSION_10);
+	flashReadGameMem(data, SAVE_GAME_VERSION_10);
+	soundReadGameMem(data, SAVE_GAME_VERSION_10);
+	rtcReadGameMem(data);
+
+	return true;
+}
+
+/* since is the epoch of the checkpoint an incremental image was written
+ * against, 0 for a complete state from anywhere else */
+static bool CPUReadStateChunks(const uint8_t *orig, unsigned size, uint32_t since)
+{
+	const uint8_t *chunkData[STATE_CHUNK_COUNT] = { NULL };
+	unsigned chunkSize[STATE_CHUNK_COUNT] = { 0 };
+
+	u32 count;
+	memcpy(&count, orig + STATE_HEADER_SIZE - sizeof(int), sizeof(count));
+	if (count > (size - STATE_HEADER_SIZE) / sizeof(state_chunk_t))
+		return false;
+
+	/* validate everything before touching any emulator state */
+	for (u32 i = 0; i < count; i++)
+	{
+		state_chunk_t chunk;
+		memcpy(&chunk, orig + STATE_HEADER_SIZE + i * sizeof(state_chunk_t), sizeof(chunk));
+
+		bool unchecked = (chunk.size & STATE_CHUNK_UNCHECKED) != 0;
+		chunk.size &= ~STATE_CHUNK_UNCHECKED;
+		if (chunk.offset > size || chunk.size > size - chunk.offset)
+			return false;
+		/* only incremental images, which never leave memory, skip the check */
+		if (unchecked ? !since : utilCRC32(0, orig + chunk.offset, chunk.size) != chunk.crc)
+			return false;
+
+		for (int j = 0; j < STATE_CHUNK_COUNT; j++)
+		{
+			if (stateChunkIds[j] == chunk.id)
+			{
+				chunkData[j] = orig + chunk.offset;
+				chunkSize[j] = chunk.size;
+				break;
+			}
+		}
+	}
+
+	for (int j = 0; j < STATE_CHUNK_COUNT; j++)
+	{
+		if (!chunkData[j])
+			return false;
+		/* serialised chunks may carry fields of a newer version at the end,
+		 * but every field read here has to be inside the chunk */
+		if (stateChunkSizes[j] ? chunkSize[j] != stateChunkSizes[j] : chunkSize[j] < CPUStateChunkFieldsSize(j))
+			return false;
+	}
+
+	const uint8_t *data = chunkData[STATE_CHUNK_CPU];
+	utilReadIntMem(data);
+	utilReadMem(&bus.reg[0], data, sizeof(bus.reg));
+	utilReadDataMem(data, saveGameStruct);
+	stopState = utilReadIntMem(data) ? true : false;
+	IRQTicks = utilReadIntMem(data);
+
+	/* pages that weren't written since the checkpoint still match the image.
+	 * Whatever is copied changed under every other checkpoint, so it is stamped */
+	CPUCopyStatePages(internalRAM, chunkData[STATE_CHUNK_IRAM], 0x8000, STATE_PAGE_IWRAM, since, 0x03000000);
+	memcpy(paletteRAM, chunkData[STATE_CHUNK_PRAM], 0x400);
+	CPUCopyStatePages(workRAM, chunkData[STATE_CHUNK_WRAM], 0x40000, STATE_PAGE_EWRAM, since, 0x02000000);
+	CPUCopyStatePages(vram, chunkData[STATE_CHUNK_VRAM], 0x20000, STATE_PAGE_VRAM, since, 0x06000000);
+	memcpy(oam, chunkData[STATE_CHUNK_OAM], 0x400);
+	memcpy(ioMem, chunkData[STATE_CHUNK_IO], 0x400);
+
+	for (int y = 0; y < 160; y++)
+		memcpy(pix + y * PIX_BUFFER_SCREEN_WIDTH, chunkData[STATE_CHUNK_PIX] + y * STATE_PIX_LINE_SIZE, STATE_PIX_LINE_SIZE);
+
+	data = chunkData[STATE_CHUNK_EEPROM];
+	eepromReadGameMem(data, SAVE_GAME_VERSION);
+	data = chunkData[STATE_CHUNK_FLASH];
+	flashReadGameMem(data, SAVE_GAME_VERSION);
+	data = chunkData[STATE_CHUNK_SOUND];
+	soundReadGameMem(data, SAVE_GAME_VERSION);
+	data = chunkData[STATE_CHUNK_RTC];
 	rtcReadGameMem(data);
 
+	return true;
+}
+
+static bool CPUReadStateImage(const uint8_t* data, unsigned size, const state_checkpoint_t *checkpoint)
+{
+	if (size < STATE_HEADER_SIZE)
+		return false;
+
+	int version;
+	memcpy(&version, data, sizeof(version));
+
+	if (memcmp(&rom[0xa0], data + sizeof(int), 16) != 0)
+		return false;
+
+	bool ok;
+	if (version == SAVE_GAME_VERSION_11)
+		ok = CPUReadStateChunks(data, size, checkpoint ? checkpoint->epoch : 0);
+	else if (version == SAVE_GAME_VERSION_10 && !checkpoint)
+	{
+		ok = CPUReadStateV10(data + sizeof(int) + 16, size - sizeof(int) - 16);
+		CPUMarkStateAll();
+		CPUInvalidateCodeRange(0x03000000, 0x8000);
+		CPUInvalidateCodeRange(0x02000000, 0x40000);
+	}
+	else
+		return false;
+
+	if (!ok)
+		return false;
+
+	if (IRQTicks > 0)
+		intState = true;
+	else
+	{
+		intState = false;
+		IRQTicks = 0;
+	}
+
+	// saved countdowns are exact, only the overflow schedule is rebuilt
+	timerElapsed = 0;
+	CPUSyncTimers();
+
 	//// Copypasta stuff ...
 	// set pointers!
 	graphics.layerEnable = io_registers[REG_DISPCNT];
@@ -11611,6 +13140,16 @@ bool CPUReadState(const uint8_t* data, unsigned size)
 	return true;
 }
 
+bool CPUReadState(const uint8_t* data, unsigned size)
+{
+	return CPUReadStateImage(data, size, NULL);
+}
+
+bool CPUReadStateIncremental(const uint8_t* data, unsigned size, const state_checkpoint_t *checkpoint)
+{
+	return CPUReadStateImage(data, size, checkpoint);
+}
+
 
 #define CPUSwap(a, b) \
 a ^= b; \
@@ -12145,6 +13684,7 @@ void CPUUpdateRegister(uint32_t address, uint16_t value)
 		case 0x7c:
 		case 0x80:
 		case 0x84:			
+			CPUSyncBatchedTimers();
 			soundEvent_u8(table[(int32_t)(address & 0xFF) - 0x60], (uint32_t)(address & 0xFF), (uint8_t)(value & 0xFF));
 			soundEvent_u8(table[(int32_t)((address & 0xFF) + 1) - 0x60], (uint32_t)((address & 0xFF) + 1), (uint8_t)(value >> 8));
 			break;			
@@ -12162,7 +13702,11 @@ void CPUUpdateRegister(uint32_t address, uint16_t value)
 		case 0x9a:
 		case 0x9c:
 		case 0x9e:
+			CPUSyncBatchedTimers();
 			soundEvent_u16(address&0xFF, value);
+			// SOUNDCNT_H picks the timers clocking the FIFOs
+			if(address == 0x82)
+				CPURescheduleBatchedTimers();
 			break;
 		case 0xB0:
 			DM0SAD_L = value;
@@ -12222,6 +13766,8 @@ void CPUUpdateRegister(uint32_t address, uint16_t value)
 			break;
 		case 0xC6:
 			{
+				CPUSyncBatchedTimers();
+
 				bool start = ((DM1CNT_H ^ value) & 0x8000) ? true : false;
 				value &= 0xF7E0;
 
@@ -12234,6 +13780,8 @@ void CPUUpdateRegister(uint32_t address, uint16_t value)
 					dma1Dest = DM1DAD_L | (DM1DAD_H << 16);
 					CPUCheckDMA(0, 2);
 				}
+
+				CPURescheduleBatchedTimers();
 			}
 			break;
 		case 0xC8:
@@ -12258,6 +13806,8 @@ void CPUUpdateRegister(uint32_t address, uint16_t value)
 			break;
 		case 0xD2:
 			{
+				CPUSyncBatchedTimers();
+
 				bool start = ((DM2CNT_H ^ value) & 0x8000) ? true : false;
 
 				value &= 0xF7E0;
@@ -12271,6 +13821,8 @@ void CPUUpdateRegister(uint32_t address, uint16_t value)
 
 					CPUCheckDMA(0, 4);
 				}
+
+				CPURescheduleBatchedTimers();
 			}
 			break;
 		case 0xD4:
@@ -12310,6 +13862,7 @@ void CPUUpdateRegister(uint32_t address, uint16_t value)
 			}
 			break;
 		case 0x100:
+			CPUSyncBatchedTimers();
 			timer0Reload = value;
 			break;
 		case 0x102:
@@ -12318,6 +13871,7 @@ void CPUUpdateRegister(uint32_t address, uint16_t value)
 			cpuNextEvent = cpuTotalTicks;
 			break;
 		case 0x104:
+			CPUSyncBatchedTimers();
 			timer1Reload = value;
 			break;
 		case 0x106:
@@ -12326,6 +13880,7 @@ void CPUUpdateRegister(uint32_t address, uint16_t value)
 			cpuNextEvent = cpuTotalTicks;
 			break;
 		case 0x108:
+			CPUSyncBatchedTimers();
 			timer2Reload = value;
 			break;
 		case 0x10A:
@@ -12334,6 +13889,7 @@ void CPUUpdateRegister(uint32_t address, uint16_t value)
 			cpuNextEvent = cpuTotalTicks;
 			break;
 		case 0x10C:
+			CPUSyncBatchedTimers();
 			timer3Reload = value;
 			break;
 		case 0x10E:
@@ -12509,7 +14065,8 @@ void CPUInit(const char *biosFileName, bool useBiosFile)
 	for(i = 0x304; i < 0x400; i++)
 		ioReadable[i] = false;
 
-	if(romSize < 0x1fe2000) {
+	romAGBPrintHook = romSize < 0x1fe2000;
+	if(romAGBPrintHook && romBufferSize > 0x1fe209e) {
 		*((uint16_t *)&rom[0x1fe209c]) = 0xdffa; // SWI 0xFA
 		*((uint16_t *)&rom[0x1fe209e]) = 0x4770; // BX LR
 	}
@@ -12576,6 +14133,10 @@ void CPUReset (void)
 	memset(pix, 0, 4 * 160 * 240);		// clean picture
 	memset(vram, 0, 0x20000);			// clean vram
 	memset(ioMem, 0, 0x400);			// clean io memory
+	CPUInvalidateCodeRange(0x02000000, 0x40000);
+	CPUInvalidateCodeRange(0x03000000, 0x8000);
+	CPUIdleLoopInvalidate(0, 0xFFFFFFFF);
+	CPUMarkStateAll();
 
 	io_registers[REG_DISPCNT]  = 0x0080;
 	io_registers[REG_DISPSTAT] = 0x0000;
@@ -12730,6 +14291,9 @@ void CPUReset (void)
 	timer3Ticks = 0;
 	timer3Reload = 0;
 	timer3ClockReload  = 0;
+	timerElapsed = 0;
+	timerNextSync = TIMER_NO_OVERFLOW;
+	timerBatched = 0;
 	dma0Source = 0;
 	dma0Dest = 0;
 	dma1Source = 0;
@@ -12771,13 +14335,13 @@ void CPUReset (void)
 	map[7].address = oam;
 	map[7].mask = 0x3FF;
 	map[8].address = rom;
-	map[8].mask = 0x1FFFFFF;
+	map[8].mask = romBufferSize - 1;
 	map[9].address = rom;
-	map[9].mask = 0x1FFFFFF;
+	map[9].mask = romBufferSize - 1;
 	map[10].address = rom;
-	map[10].mask = 0x1FFFFFF;
+	map[10].mask = romBufferSize - 1;
 	map[12].address = rom;
-	map[12].mask = 0x1FFFFFF;
+	map[12].mask = romBufferSize - 1;
 	map[14].address = flashSaveMemory;
 	map[14].mask = 0xFFFF;
 
@@ -12908,7 +14472,6 @@ void UpdateJoypad(void)
 void CPULoop (void)
 {
 	bool framedone;
-	int timerOverflow = 0;
 	int ticks = 300000;
 
 	bus.busPrefetchCount = 0;
@@ -13055,7 +14618,7 @@ updateLoop:
 				else
 				{
 #if USE_FRAME_SKIP
-					if(fs_draw) {
+					if(fs_draw && fs_render) {
 #endif
 #if THREADED_RENDERER
 						postRender();
@@ -13094,117 +14657,20 @@ updateLoop:
 			// if sound is disabled, so in stop state, soundTick will just produce
 			// mute sound
 			soundTicks -= clockTicks;
+
+			if(!stopState) {
+				timerElapsed += clockTicks;
+				// batched overflows go into the sound frame they happened in
+				if(timerElapsed >= timerNextSync || (!soundTicks && timerBatched))
+					CPUSyncTimers();
+			}
+
 			if(!soundTicks)
 			{
 				process_sound_tick_fn();
 				soundTicks += SOUND_CLOCK_TICKS;
 			}
 
-			if(!stopState) {
-				if(timer0On) {
-					timer0Ticks -= clockTicks;
-					if(timer0Ticks <= 0) {
-						timer0Ticks += (0x10000 - timer0Reload) << timer0ClockReload;
-						timerOverflow |= 1;
-						soundTimerOverflow(0);
-						if(io_registers[REG_TM0CNT] & 0x40) {
-							io_registers[REG_IF] |= 0x08;
-							UPDATE_REG(0x202, io_registers[REG_IF]);
-						}
-					}
-					io_registers[REG_TM0D] = 0xFFFF - (timer0Ticks >> timer0ClockReload);
-					UPDATE_REG(0x100, io_registers[REG_TM0D]);
-				}
-
-				if(timer1On) {
-					if(io_registers[REG_TM1CNT] & 4) {
-						if(timerOverflow & 1) {
-							io_registers[REG_TM1D]++;
-							if(io_registers[REG_TM1D] == 0) {
-								io_registers[REG_TM1D] += timer1Reload;
-								timerOverflow |= 2;
-								soundTimerOverflow(1);
-								if(io_registers[REG_TM1CNT] & 0x40) {
-									io_registers[REG_IF] |= 0x10;
-									UPDATE_REG(0x202, io_registers[REG_IF]);
-								}
-							}
-							UPDATE_REG(0x104, io_registers[REG_TM1D]);
-						}
-					} else {
-						timer1Ticks -= clockTicks;
-						if(timer1Ticks <= 0) {
-							timer1Ticks += (0x10000 - timer1Reload) << timer1ClockReload;
-							timerOverflow |= 2;
-							soundTimerOverflow(1);
-							if(io_registers[REG_TM1CNT] & 0x40) {
-								io_registers[REG_IF] |= 0x10;
-								UPDATE_REG(0x202, io_registers[REG_IF]);
-							}
-						}
-						io_registers[REG_TM1D] = 0xFFFF - (timer1Ticks >> timer1ClockReload);
-						UPDATE_REG(0x104, io_registers[REG_TM1D]);
-					}
-				}
-
-				if(timer2On) {
-					if(io_registers[REG_TM2CNT] & 4) {
-						if(timerOverflow & 2) {
-							io_registers[REG_TM2D]++;
-							if(io_registers[REG_TM2D] == 0) {
-								io_registers[REG_TM2D] += timer2Reload;
-								timerOverflow |= 4;
-								if(io_registers[REG_TM2CNT] & 0x40) {
-									io_registers[REG_IF] |= 0x20;
-									UPDATE_REG(0x202, io_registers[REG_IF]);
-								}
-							}
-							UPDATE_REG(0x108, io_registers[REG_TM2D]);
-						}
-					} else {
-						timer2Ticks -= clockTicks;
-						if(timer2Ticks <= 0) {
-							timer2Ticks += (0x10000 - timer2Reload) << timer2ClockReload;
-							timerOverflow |= 4;
-							if(io_registers[REG_TM2CNT] & 0x40) {
-								io_registers[REG_IF] |= 0x20;
-								UPDATE_REG(0x202, io_registers[REG_IF]);
-							}
-						}
-						io_registers[REG_TM2D] = 0xFFFF - (timer2Ticks >> timer2ClockReload);
-						UPDATE_REG(0x108, io_registers[REG_TM2D]);
-					}
-				}
-
-				if(timer3On) {
-					if(io_registers[REG_TM3CNT] & 4) {
-						if(timerOverflow & 4) {
-							io_registers[REG_TM3D]++;
-							if(io_registers[REG_TM3D] == 0) {
-								io_registers[REG_TM3D] += timer3Reload;
-								if(io_registers[REG_TM3CNT] & 0x40) {
-									io_registers[REG_IF] |= 0x40;
-									UPDATE_REG(0x202, io_registers[REG_IF]);
-								}
-							}
-							UPDATE_REG(0x10C, io_registers[REG_TM3D]);
-						}
-					} else {
-						timer3Ticks -= clockTicks;
-						if(timer3Ticks <= 0) {
-							timer3Ticks += (0x10000 - timer3Reload) << timer3ClockReload;
-							if(io_registers[REG_TM3CNT] & 0x40) {
-								io_registers[REG_IF] |= 0x40;
-								UPDATE_REG(0x202, io_registers[REG_IF]);
-							}
-						}
-						io_registers[REG_TM3D] = 0xFFFF - (timer3Ticks >> timer3ClockReload);
-						UPDATE_REG(0x10C, io_registers[REG_TM3D]);
-					}
-				}
-			}
-
-			timerOverflow = 0;
 			ticks -= clockTicks;
 			cpuNextEvent = CPUUpdateTicks();
 
@@ -13276,6 +14742,7 @@ updateLoop:
 
 			if (timerOnOffDelay)
 			{
+				CPUSyncTimers();
 				// Apply Timer
 				if (timerOnOffDelay & 1)
 				{
@@ -13329,6 +14796,8 @@ updateLoop:
 					io_registers[REG_TM3CNT] = timer3Value & 0xC7;
 					UPDATE_REG(0x10E, io_registers[REG_TM3CNT]);
 				}
+				// reschedule the next overflow for the new configuration
+				CPUSyncTimers();
 				cpuNextEvent = CPUUpdateTicks();
 				timerOnOffDelay = 0;
 				// End of Apply Timer
@@ -13338,7 +14807,11 @@ updateLoop:
 				cpuNextEvent = ticks;
 
 			if(ticks <= 0 || framedone)
+			{
+				// the frontend may flush the sound before the next call
+				CPUSyncBatchedTimers();
 				break;
+			}
 		}
 	} while(1);
 }
@@ -13642,10 +15115,12 @@ u8 v3_deadtable2[256] = {
 #define CHEAT_IS_HEX(a) ( ((a)>='A' && (a) <='F') || ((a) >='0' && (a) <= '9'))
 
 #define CHEAT_PATCH_ROM_16BIT(a,v) \
-  WRITE16LE(((u16 *)&rom[(a) & 0x1ffffff]), v);
+  do { if(((a) & 0x1ffffff) < romBufferSize) \
+    WRITE16LE(((u16 *)&rom[(a) & 0x1ffffff]), v); } while(0)
 
 #define CHEAT_PATCH_ROM_32BIT(a,v) \
-  WRITE32LE(((u32 *)&rom[(a) & 0x1ffffff]), v);
+  do { if(((a) & 0x1ffffff) < romBufferSize) \
+    WRITE32LE(((u32 *)&rom[(a) & 0x1ffffff]), v); } while(0)
 
 static bool isMultilineWithData(int i)
 {
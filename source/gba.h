@@ -19,7 +19,8 @@
 #define SAVE_GAME_VERSION_8 8
 #define SAVE_GAME_VERSION_9 9
 #define SAVE_GAME_VERSION_10 10
-#define SAVE_GAME_VERSION  SAVE_GAME_VERSION_10
+#define SAVE_GAME_VERSION_11 11
+#define SAVE_GAME_VERSION  SAVE_GAME_VERSION_11
 
 #define R13_IRQ  18
 #define R14_IRQ  19
@@ -97,12 +98,35 @@ typedef struct
 
 extern uint64_t joy;
 
+typedef struct
+{
+	uint32_t pagesMarked;
+	uint32_t invalidations;
+	uint32_t rangeChecks;
+} code_page_stats_t;
+
+extern code_page_stats_t codePageStats;
+extern void (*cpuCodeInvalidateFunc)(uint32_t address, uint32_t size);
+
 extern void (*cpuSaveGameFunc)(uint32_t,uint8_t);
 
+extern const uint8_t *CPUBatteryData(unsigned *size);
 extern bool CPUWriteBatteryFile(const char *);
 extern bool CPUReadBatteryFile(const char *);
 extern bool CPUReadState(const uint8_t * data, unsigned size);
 extern unsigned CPUWriteState(uint8_t* data, unsigned size);
+
+/* Incremental states only rewrite the IWRAM/EWRAM/VRAM pages dirtied since
+ * the checkpoint's previous capture, so data must still hold that image.
+ * A zeroed checkpoint does a full capture. Reading back the same image only
+ * restores the pages written since. Images are for in-memory use. */
+typedef struct
+{
+	uint32_t epoch;
+} state_checkpoint_t;
+
+extern unsigned CPUWriteStateIncremental(uint8_t* data, unsigned size, state_checkpoint_t *checkpoint);
+extern bool CPUReadStateIncremental(const uint8_t * data, unsigned size, const state_checkpoint_t *checkpoint);
 extern int CPULoadRom(const char *);
 extern int CPULoadRomData(const char *data, int size);
 extern void doMirroring(bool);
@@ -113,9 +137,15 @@ extern void CPUReset (void);
 extern void CPULoop(void);
 extern void UpdateJoypad(void);
 extern void CPUCheckDMA(int,int);
+extern void CPUMarkCodePage(uint32_t address);
+extern void CPUInvalidateCodeRange(uint32_t address, uint32_t size);
+extern void CPUClearCodePages(void);
 #if USE_FRAME_SKIP
 extern void SetFrameskip(int);
+extern void SetFrameRendering(bool);
 #endif
+extern void SetIdleLoopSkip(bool);
+extern void SetIdleLoopHints(const uint32_t *branches, int count);
 
 #if THREADED_RENDERER
 extern void ThreadedRendererStart();
@@ -2,6 +2,7 @@
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
 
 #include "gba.h"
 #include "globals.h"
@@ -58,15 +59,225 @@ static int utilGetSize(int size)
 	return res;
 }
 
+/* Images may be stored raw, gzipped or as an entry of a zip archive. The
+ * compressed ones are inflated straight into the destination buffer as the
+ * file is read, so no second copy of the image is ever held. */
+enum {
+	IMAGE_RAW,
+	IMAGE_GZIP,
+	IMAGE_ZIP_STORED,
+	IMAGE_ZIP_DEFLATE
+};
+
+#define ZIP_LOCAL_MAGIC   0x04034b50
+#define ZIP_CENTRAL_MAGIC 0x02014b50
+#define ZIP_END_MAGIC     0x06054b50
+#define ZIP_END_SIZE      22
+#define ZIP_COMMENT_MAX   0xFFFF
+
+#define INFLATE_CHUNK_SIZE 0x40000
+
+typedef struct {
+	int type;
+	long offset;     /* start of the (packed) data */
+	long packedSize;
+	int size;        /* unpacked image size */
+	uint32_t crc;    /* zip only, gzip checks its own */
+} util_image_t;
+
+static uint32_t utilLE16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t utilLE32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+static bool utilHasExtension(const char *file, const char *ext)
+{
+	const char *p = strrchr(file, '.');
+	return p != NULL && !strcasecmp(p + 1, ext);
+}
+
+static bool utilFindZipImage(FILE *fp, long fileSize, bool (*accept)(const char *), util_image_t *image)
+{
+	long tailSize = fileSize < ZIP_END_SIZE + ZIP_COMMENT_MAX ? fileSize : ZIP_END_SIZE + ZIP_COMMENT_MAX;
+	uint8_t *tail = (uint8_t *)malloc(tailSize);
+	uint8_t *dir = NULL;
+	bool found = false;
+
+	if(tail == NULL || fseek(fp, fileSize - tailSize, SEEK_SET) || fread(tail, 1, tailSize, fp) != (size_t)tailSize)
+		goto done;
+
+	for(long end = tailSize - ZIP_END_SIZE; end >= 0; end--)
+	{
+		if(utilLE32(tail + end) != ZIP_END_MAGIC)
+			continue;
+
+		unsigned entries = utilLE16(tail + end + 10);
+		uint32_t dirSize = utilLE32(tail + end + 12);
+		uint32_t dirOffset = utilLE32(tail + end + 16);
+
+		if((long)dirOffset + (long)dirSize > fileSize || (dir = (uint8_t *)malloc(dirSize + 1)) == NULL)
+			goto done;
+		if(fseek(fp, dirOffset, SEEK_SET) || fread(dir, 1, dirSize, fp) != dirSize)
+			goto done;
+
+		/* the first image entry we can unpack wins */
+		for(uint32_t pos = 0; entries-- && pos + 46 <= dirSize;)
+		{
+			const uint8_t *entry = dir + pos;
+			if(utilLE32(entry) != ZIP_CENTRAL_MAGIC)
+				break;
+
+			unsigned flags = utilLE16(entry + 8);
+			unsigned method = utilLE16(entry + 10);
+			unsigned nameLength = utilLE16(entry + 28);
+			pos += 46 + nameLength + utilLE16(entry + 30) + utilLE16(entry + 32);
+			if(pos > dirSize)
+				break;
+
+			char name[nameLength + 1];
+			memcpy(name, entry + 46, nameLength);
+			name[nameLength] = 0;
+
+			if((flags & 1) || (method != 0 && method != 8) || !accept(name))
+				continue;
+
+			uint8_t local[30];
+			uint32_t localOffset = utilLE32(entry + 42);
+			if(fseek(fp, localOffset, SEEK_SET) || fread(local, 1, sizeof(local), fp) != sizeof(local) ||
+			   utilLE32(local) != ZIP_LOCAL_MAGIC)
+				break;
+
+			image->type = method == 8 ? IMAGE_ZIP_DEFLATE : IMAGE_ZIP_STORED;
+			image->crc = utilLE32(entry + 16);
+			image->packedSize = utilLE32(entry + 20);
+			image->size = utilLE32(entry + 24);
+			image->offset = localOffset + sizeof(local) + utilLE16(local + 26) + utilLE16(local + 28);
+			found = image->offset + image->packedSize <= fileSize;
+			break;
+		}
+		break;
+	}
+
+done:
+	free(dir);
+	free(tail);
+	return found;
+}
+
+static bool utilFindImage(FILE *fp, const char *file, bool (*accept)(const char *), util_image_t *image)
+{
+	fseek(fp, 0, SEEK_END);
+	long fileSize = ftell(fp);
+	if(fileSize <= 0)
+		return false;
+
+	if(utilHasExtension(file, "zip"))
+		return utilFindZipImage(fp, fileSize, accept, image);
+
+	image->offset = 0;
+	image->packedSize = fileSize;
+	image->crc = 0;
+
+	if(utilHasExtension(file, "gz"))
+	{
+		/* a .gz carries no entry list, the inner name only matters to flag
+		 * multiboot images; the size comes from the ISIZE trailer */
+		char name[strlen(file) + 1];
+		strcpy(name, file);
+		*strrchr(name, '.') = 0;
+		accept(name);
+
+		uint8_t trailer[4];
+		if(fileSize < 18 || fseek(fp, fileSize - 4, SEEK_SET) || fread(trailer, 1, 4, fp) != 4)
+			return false;
+
+		image->type = IMAGE_GZIP;
+		image->size = utilLE32(trailer);
+		return true;
+	}
+
+	image->type = IMAGE_RAW;
+	image->size = fileSize;
+	return accept(file);
+}
+
+static bool utilInflateImage(FILE *fp, const util_image_t *image, uint8_t *out)
+{
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(inflateInit2(&zs, image->type == IMAGE_GZIP ? 16 + MAX_WBITS : -MAX_WBITS) != Z_OK)
+		return false;
+
+	uint8_t *chunk = (uint8_t *)malloc(INFLATE_CHUNK_SIZE);
+	long left = image->packedSize;
+	int ret = chunk != NULL && !fseek(fp, image->offset, SEEK_SET) ? Z_OK : Z_MEM_ERROR;
+
+	zs.next_out = out;
+	zs.avail_out = image->size;
+
+	/* runs until the end of the stream, so a truncated or corrupt image can't
+	 * pass just because the output buffer filled up */
+	while(ret == Z_OK)
+	{
+		if(zs.avail_in == 0)
+		{
+			size_t read = fread(chunk, 1, left < INFLATE_CHUNK_SIZE ? left : INFLATE_CHUNK_SIZE, fp);
+			if(read == 0)
+				break;
+			left -= read;
+			zs.next_in = chunk;
+			zs.avail_in = read;
+		}
+		ret = inflate(&zs, Z_NO_FLUSH);
+	}
+
+	bool ok = ret == Z_STREAM_END && zs.avail_out == 0 && zs.total_out == (uLong)image->size;
+	/* the size came from the ISIZE trailer, which only describes the whole
+	 * file when it holds a single member */
+	if(image->type == IMAGE_GZIP)
+		ok = ok && zs.avail_in == 0 && left == 0;
+	inflateEnd(&zs);
+	free(chunk);
+	return ok;
+}
+
+static bool utilReadImage(FILE *fp, const util_image_t *image, uint8_t *out)
+{
+	bool ok;
+
+	if(image->type == IMAGE_RAW || image->type == IMAGE_ZIP_STORED)
+		ok = !fseek(fp, image->offset, SEEK_SET) && fread(out, 1, image->size, fp) == (size_t)image->size;
+	else
+		ok = utilInflateImage(fp, image, out);
+
+	if(ok && image->type >= IMAGE_ZIP_STORED)
+		ok = crc32(0, out, image->size) == image->crc;
+
+	return ok;
+}
+
+int utilImageSize(const char *file, bool (*accept)(const char *))
+{
+	FILE *fp = fopen(file, "rb");
+	if(!fp) return -1;
+
+	util_image_t image;
+	bool found = utilFindImage(fp, file, accept, &image);
+	fclose(fp);
+	return found ? image.size : -1;
+}
+
 uint8_t *utilLoad(const char *file, bool (*accept)(const char *), uint8_t *data, int &size)
 {
     uint8_t *image = NULL;
 	FILE *fp       = fopen(file,"rb");
     if(!fp) return NULL;
 
-	fseek(fp, 0, SEEK_END); /*go to end*/
-	size = ftell(fp); /* get position at end (length)*/
-	rewind(fp);
+	util_image_t entry;
+	if(!utilFindImage(fp, file, accept, &entry))
+	{
+		fclose(fp);
+		return NULL;
+	}
+	size = entry.size;
 
 	image = data;
 
@@ -77,11 +288,19 @@ uint8_t *utilLoad(const char *file, bool (*accept)(const char *), uint8_t *data,
 		if(image == NULL)
 		{
 			systemMessage("Failed to allocate memory for data");
+			fclose(fp);
 			return NULL;
 		}
 	}
 
-	fread(image, 1, size, fp); /* read into buffer*/
+	if(!utilReadImage(fp, &entry, image))
+	{
+		systemMessage("Failed to read image %s", file);
+		if(image != data)
+			free(image);
+		image = NULL;
+	}
+
 	fclose(fp);
 	return image;
 }
@@ -132,6 +351,78 @@ void utilReadDataMem(const uint8_t *& data, variable_desc *desc)
 	}
 }
 
+/* bytes utilWriteDataMem writes and utilReadDataMem reads for desc */
+unsigned utilDataMemSize(const variable_desc *desc)
+{
+	unsigned size = 0;
+	for (; desc->address; desc++)
+		size += desc->size;
+	return size;
+}
+
+/* CRC-32 (IEEE 802.3, same as zlib), used to check save state chunks.
+ * The A57 has the ARMv8 CRC32 instructions, everything else goes through
+ * a slice-by-4 table. */
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+
+u32 utilCRC32(u32 crc, const void *data, unsigned size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	crc = ~crc;
+	for (; size >= 8; size -= 8, p += 8)
+	{
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __crc32d(crc, v);
+	}
+	for (; size > 0; size--)
+		crc = __crc32b(crc, *p++);
+
+	return ~crc;
+}
+#else
+static u32 crcTable[4][256];
+static bool crcTableReady = false;
+
+static void utilCRC32Init(void)
+{
+	for (unsigned i = 0; i < 256; i++)
+	{
+		u32 c = i;
+		for (int k = 0; k < 8; k++)
+			c = (c >> 1) ^ (0xEDB88320 & -(c & 1));
+		crcTable[0][i] = c;
+	}
+	for (unsigned i = 0; i < 256; i++)
+		for (int t = 1; t < 4; t++)
+			crcTable[t][i] = (crcTable[t - 1][i] >> 8) ^ crcTable[0][crcTable[t - 1][i] & 0xFF];
+
+	crcTableReady = true;
+}
+
+u32 utilCRC32(u32 crc, const void *data, unsigned size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	if (!crcTableReady)
+		utilCRC32Init();
+
+	crc = ~crc;
+	for (; size >= 4; size -= 4, p += 4)
+	{
+		crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+		crc = crcTable[3][crc & 0xFF] ^ crcTable[2][(crc >> 8) & 0xFF] ^
+			crcTable[1][(crc >> 16) & 0xFF] ^ crcTable[0][crc >> 24];
+	}
+	for (; size > 0; size--)
+		crc = (crc >> 8) ^ crcTable[0][(crc ^ *p++) & 0xFF];
+
+	return ~crc;
+}
+#endif
+
 /*============================================================
 	FLASH
 ============================================================ */
@@ -192,6 +483,11 @@ void flashReadGameMem(const uint8_t *& data, int)
 	utilReadDataMem(data, flashSaveData3);
 }
 
+unsigned flashGameMemSize(void)
+{
+	return utilDataMemSize(flashSaveData3);
+}
+
 void flashSetSize(int size)
 {
 	if(size == 0x10000) {
@@ -409,6 +705,11 @@ void eepromReadGameMem(const uint8_t *& data, int version)
 	utilReadMem(eepromData, data, 0x2000);
 }
 
+unsigned eepromGameMemSize(void)
+{
+	return utilDataMemSize(eepromSaveData) + sizeof(int) + 0x2000;
+}
+
 int eepromRead (void)
 {
 	switch(eepromMode)
@@ -913,3 +1214,8 @@ void rtcReadGameMem(const uint8_t *& data)
 	utilReadMem(&rtcClockData, data, sizeof(rtcClockData));
 }
 
+unsigned rtcGameMemSize(void)
+{
+	return sizeof(rtcClockData);
+}
+
@@ -35,6 +35,7 @@ extern u8 *eepromData;
 
 extern void eepromReadGameMem(const uint8_t *&data, int version);
 extern void eepromSaveGameMem(uint8_t *&data);
+extern unsigned eepromGameMemSize(void);
 
 extern int eepromRead(void);
 extern void eepromWrite(u8 value);
@@ -46,6 +47,7 @@ extern void sramWrite(u32 address, u8 byte);
 extern void sramDelayedWrite(u32 address, u8 byte);
 extern void flashSaveGameMem(uint8_t *& data);
 extern void flashReadGameMem(const uint8_t *& data, int version);
+extern unsigned flashGameMemSize(void);
 
 extern uint8_t flashRead(uint32_t address);
 extern void flashWrite(uint32_t address, uint8_t byte);
@@ -62,11 +64,13 @@ extern bool rtcIsEnabled (void);
 extern void rtcReset (void);
 extern void rtcReadGameMem(const uint8_t *& data);
 extern void rtcSaveGameMem(uint8_t *& data);
+extern unsigned rtcGameMemSize(void);
 
 extern u16 gyroRead(u32 address);
 extern bool gyroWrite(u32 address, u16 value);
 
 bool utilIsGBAImage(const char *);
+int utilImageSize(const char *, bool (*)(const char*));
 uint8_t *utilLoad(const char *, bool (*)(const char*), uint8_t *, int &);
 
 void utilWriteIntMem(uint8_t *& data, int);
@@ -76,5 +80,8 @@ void utilWriteDataMem(uint8_t *& data, variable_desc *);
 int utilReadIntMem(const uint8_t *& data);
 void utilReadMem(void *buf, const uint8_t *& data, unsigned size);
 void utilReadDataMem(const uint8_t *& data, variable_desc *);
+unsigned utilDataMemSize(const variable_desc *);
+
+u32 utilCRC32(u32 crc, const void *data, unsigned size);
 
 #endif // GBA_MEMORY_H
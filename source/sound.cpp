@@ -15,6 +15,14 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA */
 #include <limits.h>
 #include <math.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define STEREO_BUFFER_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define STEREO_BUFFER_SSE2
+#endif
+
 #include "sound.h"
 
 #include "gba.h"
@@ -46,8 +54,11 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA */
 #define NR51 0x81
 #define NR52 0x84
 
-/* 1/100th of a second */
-#define SOUND_CLOCK_TICKS_ 167772 
+/* One video frame, 228 lines of 1232 clocks. Synthesized sound is mixed and
+ * handed over once per sound frame, see soundSetFrameLength */
+#define SOUND_CLOCK_TICKS_ 280896
+#define SOUND_CLOCK_TICKS_MIN 1024
+#define SOUND_CLOCK_TICKS_MAX (CLOCK_RATE / 10)
 #define SOUNDVOLUME 0.5f
 #define SOUNDVOLUME_ -1
 
@@ -67,9 +78,10 @@ class Blip_Buffer
 		int length_;		/* Length of buffer in milliseconds*/
 		long sample_rate_;	/* Current output sample rate*/
 		uint32_t factor_;
-		uint32_t offset_;
+		uint32_t offset_;	/* Write position, keeps growing and wraps with the ring*/
 		int32_t * buffer_;
-		int32_t buffer_size_;
+		uint32_t buffer_mask_;	/* Ring size minus one*/
+		uint32_t read_pos_;	/* First unread sample, in the same units as offset_ >> 16*/
 		int32_t reader_accum_;
 		Blip_Buffer();
 		~Blip_Buffer();
@@ -113,6 +125,8 @@ class Gb_Osc
 	int length_ctr;			/* length counter*/
 	unsigned phase;			/* waveform phase (or equivalent)*/
 	bool enabled;			/* internal enabled flag*/
+	bool idle;			/* output can't change, runs are deferred*/
+	int32_t idle_time;		/* time run to before going idle*/
 
 	void clock_length();
 	void reset();
@@ -238,19 +252,23 @@ INLINE void Blip_Synth::offset_resampled( uint32_t time, int delta, Blip_Buffer*
 	int32_t left, right, phase;
 	int32_t *buf;
 
+	uint32_t index, mask;
+
 	delta *= delta_factor;
-	buf = blip_buf->buffer_ + (time >> BLIP_BUFFER_ACCURACY);
+	buf = blip_buf->buffer_;
+	mask = blip_buf->buffer_mask_;
+	index = time >> BLIP_BUFFER_ACCURACY;
 	phase = (int) (time >> (BLIP_BUFFER_ACCURACY - BLIP_PHASE_BITS) & BLIP_RES_MIN_ONE);
 
-	left = buf [0] + delta;
+	left = buf [index & mask] + delta;
 
 	right = (delta >> BLIP_PHASE_BITS) * phase;
 
 	left  -= right;
-	right += buf [1];
+	right += buf [(index + 1) & mask];
 
-	buf [0] = left;
-	buf [1] = right;
+	buf [index & mask] = left;
+	buf [(index + 1) & mask] = right;
 }
 
 INLINE void Blip_Synth::offset( int32_t t, int delta, Blip_Buffer* buf ) const
@@ -287,12 +305,13 @@ INLINE void Gb_Wave::write( unsigned addr, int data )
 		wave_bank[index] = data;;
 }
 
-static int16_t   soundFinalWave [1600];
+static int16_t   soundFinalWave [4096];
 long  soundSampleRate    = 22050;
 int   SOUND_CLOCK_TICKS  = SOUND_CLOCK_TICKS_;
 int   soundTicks         = SOUND_CLOCK_TICKS_;
 
 static int soundEnableFlag   = 0x3ff; /* emulator channels enabled*/
+static bool soundSynthesis   = true;  /* channels connected to the mixer*/
 static float const apu_vols [4] = { -0.25f, -0.5f, -1.0f, -0.25f };
 
 static const int table [0x40] =
@@ -334,7 +353,6 @@ static gba_pcm_fifo_t   pcm [2];
 static Blip_Synth pcm_synth; // 32 kHz, 16 kHz, 8 kHz
 
 static Blip_Buffer bufs_buffer [BUFS_SIZE];
-static int mixer_samples_read;
 
 static void gba_pcm_init (void)
 {
@@ -354,7 +372,7 @@ static void gba_pcm_apply_control( int pcm_idx, int idx )
 	int ch = 0;
 	pcm[pcm_idx].pcm.shift = ~ioMem [SGCNT0_H] >> (2 + idx) & 1;
 
-	if ( (ioMem [NR52] & 0x80) )
+	if ( (ioMem [NR52] & 0x80) && soundSynthesis )
 		ch = ioMem [SGCNT0_H+1] >> (idx << 2) & 3;
 
 	Blip_Buffer* out = 0;
@@ -515,6 +533,58 @@ static void gb_apu_silence_osc( Gb_Osc& o )
 	}
 }
 
+static INLINE void gb_apu_run_osc( int i, int32_t time, int32_t end_time )
+{
+	switch ( i )
+	{
+		case 0:
+			gb_apu.square1.run( time, end_time );
+			break;
+		case 1:
+			gb_apu.square2.run( time, end_time );
+			break;
+		case 2:
+			gb_apu.wave.run( time, end_time );
+			break;
+		case 3:
+			gb_apu.noise.run( time, end_time );
+			break;
+	}
+}
+
+/* Once run, an oscillator that is panned off, has its DAC off or is disabled keeps
+ * outputting the same amplitude. The wave channel's amplitude for inaudible
+ * frequencies depends on the timer and while enabled it keeps reading wave RAM,
+ * which the length counter can stop at any step, so it needs its DAC off or to be
+ * both disabled and panned off. */
+static INLINE bool gb_apu_osc_silent( int i )
+{
+	Gb_Osc const& o = *gb_apu.oscs [i];
+	if ( i == 2 )
+		return !(o.regs [0] & 0x80) || (!o.output && !o.enabled);
+	return !o.output || !o.enabled || !(o.regs [2] & 0xF8);
+}
+
+/* Silent oscillators are not run at every step. Their runs are done as one
+ * over the whole stretch before anything could change them, which leaves timer,
+ * phase and LFSR where the single steps would have.*/
+static void gb_apu_wake_osc( int i )
+{
+	Gb_Osc& o = *gb_apu.oscs [i];
+	if ( o.idle )
+	{
+		o.idle = false;
+		if ( o.idle_time < gb_apu.last_time )
+			gb_apu_run_osc( i, o.idle_time, gb_apu.last_time );
+	}
+}
+
+static void gb_apu_wake_oscs (void)
+{
+	for ( int i = 0; i < OSC_COUNT; i++ )
+		gb_apu_wake_osc( i );
+}
+
 static void gb_apu_run_until_( int32_t end_time )
 {
 	int32_t time;
@@ -525,10 +595,19 @@ static void gb_apu_run_until_( int32_t end_time )
 		if ( time > gb_apu.frame_time )
 			time = gb_apu.frame_time;
 
-		gb_apu.square1.run( gb_apu.last_time, time );
-		gb_apu.square2.run( gb_apu.last_time, time );
-		gb_apu.wave   .run( gb_apu.last_time, time );
-		gb_apu.noise  .run( gb_apu.last_time, time );
+		for ( int i = 0; i < OSC_COUNT; i++ )
+		{
+			Gb_Osc& o = *gb_apu.oscs [i];
+			if ( o.idle )
+				continue;
+
+			gb_apu_run_osc( i, gb_apu.last_time, time );
+			if ( gb_apu_osc_silent( i ) )
+			{
+				o.idle = true;
+				o.idle_time = time;
+			}
+		}
 		gb_apu.last_time = time;
 
 		if ( time == end_time )
@@ -541,6 +620,7 @@ static void gb_apu_run_until_( int32_t end_time )
 			case 2:
 			case 6:
 				/* 128 Hz*/
+				gb_apu_wake_osc( 0 );	/* sweep can change the period*/
 				gb_apu.square1.clock_sweep();
 			case 0:
 			case 4:
@@ -633,6 +713,9 @@ static void gb_apu_write_osc( int index, int reg, int old_data, int data )
 
 static INLINE int gb_apu_calc_output( int osc )
 {
+	if ( !soundSynthesis )
+		return 0;
+
 	int bits = gb_apu.regs [STEREO_REG - START_ADDR] >> osc;
 	return (bits >> 3 & 2) | (bits & 1);
 }
@@ -648,6 +731,7 @@ static void gb_apu_write_register( int32_t time, unsigned addr, int data )
 
 	if ( time > gb_apu.last_time )
 		gb_apu_run_until_( time );
+	gb_apu_wake_oscs();
 
 	if ( addr >= WAVE_RAM )
 	{
@@ -803,10 +887,14 @@ static void gb_apu_set_output( Blip_Buffer* center, Blip_Buffer* left, Blip_Buff
 	while ( i < osc );
 }
 
-static void gb_apu_volume( double v )
+static void gb_apu_volume( int32_t time, double v )
 {
 	if ( gb_apu.volume_ != v )
 	{
+		/* the new volume only applies from time on*/
+		if ( time > gb_apu.last_time )
+			gb_apu_run_until_( time );
+
 		gb_apu.volume_ = v;
 		gb_apu_apply_volume();
 	}
@@ -889,6 +977,7 @@ static INLINE void gb_apu_save_load2( gb_apu_state_t* io, bool save )
 
 static void gb_apu_save_state( gb_apu_state_t* out )
 {
+	gb_apu_wake_oscs();
 	(void) gb_apu_save_load( out, true );
 	gb_apu_save_load2( out, true );
 }
@@ -897,6 +986,8 @@ static const char * gb_apu_load_state( gb_apu_state_t const& in )
 {
 	RETURN_ERR( gb_apu_save_load( CONST_CAST(gb_apu_state_t*,&in), false));
 	gb_apu_save_load2( CONST_CAST(gb_apu_state_t*,&in), false );
+	for ( int i = OSC_COUNT; --i >= 0; )
+		gb_apu.oscs [i]->idle = false;
 
 	gb_apu_apply_stereo();
 	gb_apu_synth_volume( 0 );          /* suppress output for the moment*/
@@ -923,6 +1014,7 @@ void Gb_Osc::reset()
         delay    = 0;
         phase    = 0;
         enabled  = false;
+        idle     = false;
 }
 
 INLINE void Gb_Osc::update_amp( int32_t time, int new_amp )
@@ -1222,10 +1314,8 @@ static unsigned run_lfsr( unsigned s, unsigned mask, int count )
 		count += 15;
 
 		/* Remaining singles*/
-		do{
-			--count;
+		while ( --count >= 0 )
 			s = ((s & 2) * (3 << 13)) ^ (s >> 1);
-		}while(count >= 0);
 
 		/* Convert back to Fibonacci configuration*/
 		s &= 0x7FFF;
@@ -1233,10 +1323,8 @@ static unsigned run_lfsr( unsigned s, unsigned mask, int count )
 	else if ( count < 8)
 	{
 		/* won't fully replace upper 8 bits, so have to do the unoptimized way*/
-		do{
-			--count;
+		while ( --count >= 0 )
 			s = (s >> 1 | mask) ^ (mask & -((s - 1) & 2));
-		}while(count >= 0);
 	}
 	else
 	{
@@ -1466,7 +1554,7 @@ Blip_Buffer::Blip_Buffer()
 {
    factor_       = INT_MAX;
    buffer_       = 0;
-   buffer_size_  = 0;
+   buffer_mask_  = 0;
    sample_rate_  = 0;
    clock_rate_   = 0;
    length_       = 0;
@@ -1483,9 +1571,10 @@ Blip_Buffer::~Blip_Buffer()
 void Blip_Buffer::clear( void)
 {
    offset_       = 0;
+   read_pos_     = 0;
    reader_accum_ = 0;
    if (buffer_)
-      memset( buffer_, 0, (buffer_size_ + BLIP_BUFFER_EXTRA_) * sizeof (int32_t) );
+      memset( buffer_, 0, (buffer_mask_ + 1) * sizeof (int32_t) );
 }
 
 const char * Blip_Buffer::set_sample_rate( long new_rate, int msec )
@@ -1499,15 +1588,22 @@ const char * Blip_Buffer::set_sample_rate( long new_rate, int msec )
          new_size = s;
    }
 
-   if ( buffer_size_ != new_size )
+   /* samples are read in place from a ring, which also has to hold the impulse
+      tails written past the end of the unread ones*/
+   uint32_t ring_size = 1;
+   while ( ring_size < (uint32_t) (new_size + BLIP_BUFFER_EXTRA_) && ring_size <= BLIP_BUFFER_POS_MASK / 2 )
+      ring_size <<= 1;
+   new_size = ring_size - BLIP_BUFFER_EXTRA_ < new_size ? ring_size - BLIP_BUFFER_EXTRA_ : new_size;
+
+   if ( buffer_mask_ + 1 != ring_size )
    {
-      void* p = realloc( buffer_, (new_size + BLIP_BUFFER_EXTRA_) * sizeof *buffer_ );
+      void* p = realloc( buffer_, ring_size * sizeof *buffer_ );
       if ( !p )
          return "Out of memory";
       buffer_ = (int32_t *) p;
    }
 
-   buffer_size_ = new_size;
+   buffer_mask_ = ring_size - 1;
 
    /* update things based on the sample rate*/
    sample_rate_ = new_rate;
@@ -1544,18 +1640,26 @@ Blip_Synth::Blip_Synth()
 
 void Blip_Buffer::save_state( blip_buffer_state_t* out )
 {
+        uint32_t pos = offset_ >> BLIP_BUFFER_ACCURACY;
+
         out->offset_       = offset_;
+        out->read_pos_     = read_pos_;
         out->reader_accum_ = reader_accum_;
-        memcpy( out->buf, &buffer_ [offset_ >> BLIP_BUFFER_ACCURACY], sizeof out->buf );
+        for ( int i = 0; i < BLIP_BUFFER_EXTRA_; i++ )
+                out->buf [i] = buffer_ [(pos + i) & buffer_mask_];
 }
 
 void Blip_Buffer::load_state( blip_buffer_state_t const& in )
 {
         clear();
 
+        uint32_t pos = in.offset_ >> BLIP_BUFFER_ACCURACY;
+
         offset_       = in.offset_;
+        read_pos_     = in.read_pos_;
         reader_accum_ = in.reader_accum_;
-        memcpy( buffer_, in.buf, sizeof(in.buf));
+        for ( int i = 0; i < BLIP_BUFFER_EXTRA_; i++ )
+                buffer_ [(pos + i) & buffer_mask_] = in.buf [i];
 }
 
 /*============================================================
@@ -1564,13 +1668,12 @@ void Blip_Buffer::load_state( blip_buffer_state_t const& in )
 
 /* Uses three buffers (one for center) and outputs stereo sample pairs. */
 
-#define STEREO_BUFFER_SAMPLES_AVAILABLE() ((long)(bufs_buffer[0].offset_ -  mixer_samples_read) << 1)
-#define stereo_buffer_samples_avail() ((((bufs_buffer [0].offset_ >> BLIP_BUFFER_ACCURACY) - mixer_samples_read) << 1))
+/* samples synthesized but not read yet, the three buffers advance together */
+#define stereo_buffer_samples_avail() (((((bufs_buffer [0].offset_ >> BLIP_BUFFER_ACCURACY) - bufs_buffer [0].read_pos_) & BLIP_BUFFER_POS_MASK) << 1))
 
 
 static const char * stereo_buffer_set_sample_rate( long rate, int msec )
 {
-        mixer_samples_read = 0;
         for ( int i = BUFS_SIZE; --i >= 0; )
                 RETURN_ERR( bufs_buffer [i].set_sample_rate( rate, msec ) );
         return 0; 
@@ -1585,113 +1688,250 @@ static void stereo_buffer_clock_rate( long rate )
 
 static void stereo_buffer_clear (void)
 {
-        mixer_samples_read = 0;
 	bufs_buffer [2].clear();
 	bufs_buffer [1].clear();
 	bufs_buffer [0].clear();
 }
 
-/* mixers use a single index value to improve performance on register-challenged processors
- * offset goes from negative to zero*/
+/* samples are read straight out of the rings and each slot is zeroed as it is
+ * taken, so nothing has to be moved or cleared after a read. The vector mixers
+ * are checked against this one, so it is built everywhere */
 
-static INLINE void stereo_buffer_mixer_read_pairs( int16_t* out, int count )
+static INLINE void stereo_buffer_mixer_read_pairs_ref( int16_t* out, int count )
 {
-	/* TODO: if caller never marks buffers as modified, uses mono*/
-	/* except that buffer isn't cleared, so caller can encounter*/
-	/* subtle problems and not realize the cause.*/
-	mixer_samples_read += count;
-	int16_t* outtemp = out + count * STEREO;
-
 	/* do left + center and right + center separately to reduce register load*/
-	Blip_Buffer* buf = &bufs_buffer [2];
 	{
-		--buf;
-		--outtemp;
-
-		BLIP_READER_BEGIN( side,   *buf );
+		BLIP_READER_BEGIN( side,   bufs_buffer[1] );
 		BLIP_READER_BEGIN( center, bufs_buffer[2] );
 
-		BLIP_READER_ADJ_( side,   mixer_samples_read );
-		BLIP_READER_ADJ_( center, mixer_samples_read );
-
-		int offset = -count;
-		do
+		for ( int i = 0; i < count; i++ )
 		{
 			int s = (center_reader_accum + side_reader_accum) >> 14;
-			BLIP_READER_NEXT_IDX_( side,   offset );
-			BLIP_READER_NEXT_IDX_( center, offset );
+			BLIP_READER_TAKE_IDX_( side,   i );
+			BLIP_READER_NEXT_IDX_( center, i );
 			BLIP_CLAMP( s, s );
 
-			++offset; /* before write since out is decremented to slightly before end*/
-			outtemp [offset * STEREO] = (int16_t) s;
-		}while ( offset );
+			out [i * STEREO + 1] = (int16_t) s;
+		}
 
-		BLIP_READER_END( side,   *buf );
+		BLIP_READER_END( side,   bufs_buffer[1], count );
 	}
 	{
-		--buf;
-		--outtemp;
-
-		BLIP_READER_BEGIN( side,   *buf );
+		BLIP_READER_BEGIN( side,   bufs_buffer[0] );
 		BLIP_READER_BEGIN( center, bufs_buffer[2] );
 
-		BLIP_READER_ADJ_( side,   mixer_samples_read );
-		BLIP_READER_ADJ_( center, mixer_samples_read );
-
-		int offset = -count;
-		do
+		for ( int i = 0; i < count; i++ )
 		{
 			int s = (center_reader_accum + side_reader_accum) >> 14;
-			BLIP_READER_NEXT_IDX_( side,   offset );
-			BLIP_READER_NEXT_IDX_( center, offset );
+			BLIP_READER_TAKE_IDX_( side,   i );
+			BLIP_READER_TAKE_IDX_( center, i );
 			BLIP_CLAMP( s, s );
 
-			++offset; /* before write since out is decremented to slightly before end*/
-			outtemp [offset * STEREO] = (int16_t) s;
-		}while ( offset );
+			out [i * STEREO] = (int16_t) s;
+		}
 
-		BLIP_READER_END( side,   *buf );
+		BLIP_READER_END( side,   bufs_buffer[0], count );
 
 		/* only end center once*/
-		BLIP_READER_END( center, bufs_buffer[2] );
+		BLIP_READER_END( center, bufs_buffer[2], count );
 	}
 }
 
-static void blip_buffer_remove_all_samples( long count )
+#if defined(STEREO_BUFFER_NEON) || defined(STEREO_BUFFER_SSE2)
+
+/* The three bass integrators run side by side in the lanes {left, right, center,
+ * center}, so one vector step advances all of them and adding the upper half to
+ * the lower half yields both output samples. Lanes don't interact, so the result
+ * is the same as the scalar mixer's bit for bit: the shifts are arithmetic and
+ * the saturating narrow matches BLIP_CLAMP for everything a >> 14 can produce.
+ * Samples are read four at a time and transposed into per-sample lane vectors;
+ * slots are zeroed as they are taken like the scalar reader does. */
+
+#ifdef STEREO_BUFFER_NEON
+typedef int32x4_t mixer_accum_t;
+
+static INLINE void stereo_buffer_mixer_block( int16_t* out, int32_t* left, int32_t* right,
+		int32_t* center, int count, mixer_accum_t* accum )
 {
-	uint32_t new_offset = (uint32_t)count << BLIP_BUFFER_ACCURACY;
-	/* BLIP BUFFER #1 */
-	bufs_buffer[0].offset_ -= new_offset;
-	bufs_buffer[1].offset_ -= new_offset;
-	bufs_buffer[2].offset_ -= new_offset;
+	mixer_accum_t acc = *accum;
+	const int32x4_t zero = vdupq_n_s32( 0 );
+	int i = 0;
 
-	/* copy remaining samples to beginning and clear old samples*/
-	long remain = (bufs_buffer[0].offset_ >> BLIP_BUFFER_ACCURACY) + BLIP_BUFFER_EXTRA_;
-	memmove( bufs_buffer[0].buffer_, bufs_buffer[0].buffer_ + count, remain * sizeof *bufs_buffer[0].buffer_ );
-	memset( bufs_buffer[0].buffer_ + remain, 0, count * sizeof(*bufs_buffer[0].buffer_));
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		int32x4x2_t lr = vzipq_s32( vld1q_s32( left + i ), vld1q_s32( right + i ) );
+		int32x4_t c = vld1q_s32( center + i );
+		int32x4x2_t cc = vzipq_s32( c, c );
+		int32x4_t in [4] = {
+			vcombine_s32( vget_low_s32( lr.val[0] ),  vget_low_s32( cc.val[0] ) ),
+			vcombine_s32( vget_high_s32( lr.val[0] ), vget_high_s32( cc.val[0] ) ),
+			vcombine_s32( vget_low_s32( lr.val[1] ),  vget_low_s32( cc.val[1] ) ),
+			vcombine_s32( vget_high_s32( lr.val[1] ), vget_high_s32( cc.val[1] ) )
+		};
+		vst1q_s32( left + i, zero );
+		vst1q_s32( right + i, zero );
+		vst1q_s32( center + i, zero );
+
+		int32x2_t s [4];
+		for ( int j = 0; j < 4; j++ )
+		{
+			s [j] = vshr_n_s32( vadd_s32( vget_low_s32( acc ), vget_high_s32( acc ) ), 14 );
+			acc = vaddq_s32( vsubq_s32( acc, vshrq_n_s32( acc, BLIP_READER_DEFAULT_BASS ) ), in [j] );
+		}
+
+		vst1q_s16( out + i * STEREO, vcombine_s16(
+				vqmovn_s32( vcombine_s32( s [0], s [1] ) ),
+				vqmovn_s32( vcombine_s32( s [2], s [3] ) ) ) );
+	}
+
+	for ( ; i < count; i++ )
+	{
+		int32_t lanes [4] = { left [i], right [i], center [i], center [i] };
+		left [i] = right [i] = center [i] = 0;
 
-	remain = (bufs_buffer[1].offset_ >> BLIP_BUFFER_ACCURACY) + BLIP_BUFFER_EXTRA_;
-	memmove( bufs_buffer[1].buffer_, bufs_buffer[1].buffer_ + count, remain * sizeof *bufs_buffer[1].buffer_ );
-	memset( bufs_buffer[1].buffer_ + remain, 0, count * sizeof(*bufs_buffer[1].buffer_));
+		int32x2_t s = vshr_n_s32( vadd_s32( vget_low_s32( acc ), vget_high_s32( acc ) ), 14 );
+		acc = vaddq_s32( vsubq_s32( acc, vshrq_n_s32( acc, BLIP_READER_DEFAULT_BASS ) ), vld1q_s32( lanes ) );
 
-	remain = (bufs_buffer[2].offset_ >> BLIP_BUFFER_ACCURACY) + BLIP_BUFFER_EXTRA_;
-	memmove( bufs_buffer[2].buffer_, bufs_buffer[2].buffer_ + count, remain * sizeof *bufs_buffer[2].buffer_ );
-	memset( bufs_buffer[2].buffer_ + remain, 0, count * sizeof(*bufs_buffer[2].buffer_));
+		int16x4_t pair = vqmovn_s32( vcombine_s32( s, s ) );
+		vst1_lane_s16( out + i * STEREO,     pair, 0 );
+		vst1_lane_s16( out + i * STEREO + 1, pair, 1 );
+	}
+
+	*accum = acc;
+}
+
+static INLINE mixer_accum_t stereo_buffer_mixer_load_accum( void )
+{
+	int32_t lanes [4] = { bufs_buffer[0].reader_accum_, bufs_buffer[1].reader_accum_,
+		bufs_buffer[2].reader_accum_, bufs_buffer[2].reader_accum_ };
+	return vld1q_s32( lanes );
+}
+
+static INLINE void stereo_buffer_mixer_store_accum( mixer_accum_t acc )
+{
+	int32_t lanes [4];
+	vst1q_s32( lanes, acc );
+	bufs_buffer[0].reader_accum_ = lanes [0];
+	bufs_buffer[1].reader_accum_ = lanes [1];
+	bufs_buffer[2].reader_accum_ = lanes [2];
+}
+#else
+typedef __m128i mixer_accum_t;
+
+static INLINE __m128i stereo_buffer_mixer_pair( __m128i acc )
+{
+	return _mm_srai_epi32( _mm_add_epi32( acc, _mm_unpackhi_epi64( acc, acc ) ), 14 );
+}
+
+static INLINE __m128i stereo_buffer_mixer_step( __m128i acc, __m128i in )
+{
+	return _mm_add_epi32( _mm_sub_epi32( acc, _mm_srai_epi32( acc, BLIP_READER_DEFAULT_BASS ) ), in );
 }
 
+static INLINE void stereo_buffer_mixer_block( int16_t* out, int32_t* left, int32_t* right,
+		int32_t* center, int count, mixer_accum_t* accum )
+{
+	__m128i acc = *accum;
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		__m128i l = _mm_loadu_si128( (const __m128i*) (left + i) );
+		__m128i r = _mm_loadu_si128( (const __m128i*) (right + i) );
+		__m128i c = _mm_loadu_si128( (const __m128i*) (center + i) );
+		__m128i lr_lo = _mm_unpacklo_epi32( l, r ), lr_hi = _mm_unpackhi_epi32( l, r );
+		__m128i cc_lo = _mm_unpacklo_epi32( c, c ), cc_hi = _mm_unpackhi_epi32( c, c );
+		_mm_storeu_si128( (__m128i*) (left + i), zero );
+		_mm_storeu_si128( (__m128i*) (right + i), zero );
+		_mm_storeu_si128( (__m128i*) (center + i), zero );
+
+		__m128i s0 = stereo_buffer_mixer_pair( acc );
+		acc = stereo_buffer_mixer_step( acc, _mm_unpacklo_epi64( lr_lo, cc_lo ) );
+		__m128i s1 = stereo_buffer_mixer_pair( acc );
+		acc = stereo_buffer_mixer_step( acc, _mm_unpackhi_epi64( lr_lo, cc_lo ) );
+		__m128i s2 = stereo_buffer_mixer_pair( acc );
+		acc = stereo_buffer_mixer_step( acc, _mm_unpacklo_epi64( lr_hi, cc_hi ) );
+		__m128i s3 = stereo_buffer_mixer_pair( acc );
+		acc = stereo_buffer_mixer_step( acc, _mm_unpackhi_epi64( lr_hi, cc_hi ) );
+
+		_mm_storeu_si128( (__m128i*) (out + i * STEREO), _mm_packs_epi32(
+				_mm_unpacklo_epi64( s0, s1 ), _mm_unpacklo_epi64( s2, s3 ) ) );
+	}
+
+	for ( ; i < count; i++ )
+	{
+		__m128i in = _mm_setr_epi32( left [i], right [i], center [i], center [i] );
+		left [i] = right [i] = center [i] = 0;
+
+		__m128i s = stereo_buffer_mixer_pair( acc );
+		acc = stereo_buffer_mixer_step( acc, in );
+
+		int32_t pair = _mm_cvtsi128_si32( _mm_packs_epi32( s, s ) );
+		memcpy( out + i * STEREO, &pair, sizeof pair );
+	}
+
+	*accum = acc;
+}
+
+static INLINE mixer_accum_t stereo_buffer_mixer_load_accum( void )
+{
+	return _mm_setr_epi32( bufs_buffer[0].reader_accum_, bufs_buffer[1].reader_accum_,
+		bufs_buffer[2].reader_accum_, bufs_buffer[2].reader_accum_ );
+}
+
+static INLINE void stereo_buffer_mixer_store_accum( mixer_accum_t acc )
+{
+	int32_t lanes [4];
+	_mm_storeu_si128( (__m128i*) lanes, acc );
+	bufs_buffer[0].reader_accum_ = lanes [0];
+	bufs_buffer[1].reader_accum_ = lanes [1];
+	bufs_buffer[2].reader_accum_ = lanes [2];
+}
+#endif
+
+static INLINE void stereo_buffer_mixer_read_pairs( int16_t* out, int count )
+{
+	/* the buffers share sample rate and read position, so they wrap together */
+	uint32_t mask = bufs_buffer[0].buffer_mask_;
+	uint32_t pos  = bufs_buffer[0].read_pos_;
+	mixer_accum_t acc = stereo_buffer_mixer_load_accum();
+
+	for ( int done = 0; done < count; )
+	{
+		uint32_t index = (pos + done) & mask;
+		int n = count - done;
+		if ( (uint32_t) n > mask + 1 - index )
+			n = mask + 1 - index;
+
+		stereo_buffer_mixer_block( out + done * STEREO, bufs_buffer[0].buffer_ + index,
+				bufs_buffer[1].buffer_ + index, bufs_buffer[2].buffer_ + index, n, &acc );
+		done += n;
+	}
+
+	stereo_buffer_mixer_store_accum( acc );
+	for ( int i = 0; i < BUFS_SIZE; i++ )
+		bufs_buffer[i].read_pos_ = (pos + count) & BLIP_BUFFER_POS_MASK;
+}
+
+#else
+
+static INLINE void stereo_buffer_mixer_read_pairs( int16_t* out, int count )
+{
+	stereo_buffer_mixer_read_pairs_ref( out, count );
+}
+
+#endif
+
 static long stereo_buffer_read_samples( int16_t * out, long out_size )
 {
 	int pair_count;
 
-        out_size = (STEREO_BUFFER_SAMPLES_AVAILABLE() < out_size) ? STEREO_BUFFER_SAMPLES_AVAILABLE() : out_size;
+        out_size = (stereo_buffer_samples_avail() < out_size) ? stereo_buffer_samples_avail() : out_size;
 
         pair_count = int (out_size >> 1);
         if ( pair_count )
-	{
 		stereo_buffer_mixer_read_pairs( out, pair_count );
-		blip_buffer_remove_all_samples( mixer_samples_read );
-		mixer_samples_read = 0;
-	}
         return out_size;
 }
 
@@ -1775,7 +2015,7 @@ static void soundEvent_u16_parallel(uint32_t address[])
 				WRITE16LE( &ioMem [SGCNT0_H], 0 & 0x770F );
 				pcm_fifo_write_control(0, 0);
 
-				gb_apu_volume( apu_vols [ioMem [SGCNT0_H] & 3] );
+				gb_apu_volume( SOUND_CLOCK_TICKS - soundTicks, apu_vols [ioMem [SGCNT0_H] & 3] );
 				//End of SGCNT0_H
 				break;
 
@@ -1814,7 +2054,7 @@ static void soundEvent_u16_parallel(uint32_t address[])
 	}
 }
 
-static void gba_pcm_fifo_timer_overflowed( unsigned pcm_idx )
+static void gba_pcm_fifo_timer_overflowed( unsigned pcm_idx, int late )
 {
 	if ( pcm[pcm_idx].count <= 16 )
 	{
@@ -1838,7 +2078,9 @@ static void gba_pcm_fifo_timer_overflowed( unsigned pcm_idx )
 
 	if(pcm[pcm_idx].pcm.output)
 	{
-		int time = SOUND_CLOCK_TICKS -  soundTicks;
+		int time = SOUND_CLOCK_TICKS -  soundTicks - late;
+		if ( time < 0 )
+			time = 0;
 
 		pcm[pcm_idx].dac = (int8_t)pcm[pcm_idx].dac >> pcm[pcm_idx].pcm.shift;
 		int delta = pcm[pcm_idx].dac - pcm[pcm_idx].pcm.last_amp;
@@ -1890,7 +2132,7 @@ void soundEvent_u16(uint32_t address, uint16_t data)
 			WRITE16LE( &ioMem [SGCNT0_H], data & 0x770F );
 			pcm_fifo_write_control( data, data >> 4);
 
-			gb_apu_volume( apu_vols [ioMem [SGCNT0_H] & 3] );
+			gb_apu_volume( SOUND_CLOCK_TICKS - soundTicks, apu_vols [ioMem [SGCNT0_H] & 3] );
 			//End of SGCNT0_H
 			break;
 
@@ -1929,43 +2171,126 @@ void soundEvent_u16(uint32_t address, uint16_t data)
 	}
 }
 
-void soundTimerOverflow(int timer)
+void soundTimerOverflow(int timer, int late)
 {
 	if ( timer == pcm[0].timer && pcm[0].enabled )
-		gba_pcm_fifo_timer_overflowed(0);
+		gba_pcm_fifo_timer_overflowed(0, late);
 	if ( timer == pcm[1].timer && pcm[1].enabled )
-		gba_pcm_fifo_timer_overflowed(1);
+		gba_pcm_fifo_timer_overflowed(1, late);
 }
 
-void process_sound_tick_fn (void)
+int soundTimerDmas(int timer)
+{
+	int dmas = 0;
+	if ( timer == pcm[0].timer && pcm[0].enabled )
+		dmas |= pcm[0].which ? 4 : 2;
+	if ( timer == pcm[1].timer && pcm[1].enabled )
+		dmas |= pcm[1].which ? 4 : 2;
+	return dmas;
+}
+
+static void sound_end_frame( int ticks )
 {
 	// Run sound hardware to present
-	pcm[0].pcm.last_time -= SOUND_CLOCK_TICKS;
+	pcm[0].pcm.last_time -= ticks;
 	if ( pcm[0].pcm.last_time < -2048 )
 		pcm[0].pcm.last_time = -2048;
 
-	pcm[1].pcm.last_time -= SOUND_CLOCK_TICKS;
+	pcm[1].pcm.last_time -= ticks;
 	if ( pcm[1].pcm.last_time < -2048 )
 		pcm[1].pcm.last_time = -2048;
 
 	/* Emulates sound hardware up to a specified time, ends current time
 	frame, then starts a new frame at time 0 */
 
-	if(SOUND_CLOCK_TICKS > gb_apu.last_time)
-		gb_apu_run_until_( SOUND_CLOCK_TICKS );
+	if(ticks > gb_apu.last_time)
+		gb_apu_run_until_( ticks );
+	gb_apu_wake_oscs();
 
-	gb_apu.frame_time -= SOUND_CLOCK_TICKS;
-	gb_apu.last_time -= SOUND_CLOCK_TICKS;
+	gb_apu.frame_time -= ticks;
+	gb_apu.last_time -= ticks;
 
-	bufs_buffer[2].offset_ += SOUND_CLOCK_TICKS * bufs_buffer[2].factor_;
-	bufs_buffer[1].offset_ += SOUND_CLOCK_TICKS * bufs_buffer[1].factor_;
-	bufs_buffer[0].offset_ += SOUND_CLOCK_TICKS * bufs_buffer[0].factor_;
+	bufs_buffer[2].offset_ += ticks * bufs_buffer[2].factor_;
+	bufs_buffer[1].offset_ += ticks * bufs_buffer[1].factor_;
+	bufs_buffer[0].offset_ += ticks * bufs_buffer[0].factor_;
 
 
-	// dump all the samples available
-	// VBA will only ever store 1 frame worth of samples
-	int numSamples = stereo_buffer_read_samples( (int16_t*) soundFinalWave, stereo_buffer_samples_avail());
-	systemOnWriteDataToSoundBuffer(soundFinalWave, numSamples);
+	// dump all the samples available, a frame at the usual rates takes one pass
+	long numSamples;
+	while ( (numSamples = stereo_buffer_read_samples( soundFinalWave, sizeof soundFinalWave / sizeof *soundFinalWave )) )
+	{
+		if ( soundSynthesis )
+			systemOnWriteDataToSoundBuffer(soundFinalWave, numSamples);
+	}
+}
+
+void process_sound_tick_fn (void)
+{
+	sound_end_frame( SOUND_CLOCK_TICKS );
+}
+
+/* Ends the current sound frame early so everything synthesized so far is
+ * handed to systemOnWriteDataToSoundBuffer. The next frame starts at time 0. */
+void soundFlush (void)
+{
+	int elapsed = SOUND_CLOCK_TICKS - soundTicks;
+	if ( elapsed > 0 )
+	{
+		sound_end_frame( elapsed );
+		soundTicks = SOUND_CLOCK_TICKS;
+	}
+}
+
+/* With synthesis off the channels keep running, but with no output: the
+ * oscillators only keep their phase and the FIFOs only drain, so nothing is
+ * synthesized or handed to systemOnWriteDataToSoundBuffer. */
+void soundSetSynthesis (bool enabled)
+{
+	if ( soundSynthesis == enabled )
+		return;
+	soundSynthesis = enabled;
+
+	int32_t time = SOUND_CLOCK_TICKS - soundTicks;
+	if ( time > gb_apu.last_time )
+		gb_apu_run_until_( time );
+	gb_apu_wake_oscs();
+	gb_apu_apply_stereo();
+
+	gba_pcm_apply_control( 0, 0 );
+	gba_pcm_apply_control( 1, 1 );
+}
+
+void soundSetFrameLength (int ticks)
+{
+	if ( ticks < SOUND_CLOCK_TICKS_MIN )
+		ticks = SOUND_CLOCK_TICKS_MIN;
+	if ( ticks > SOUND_CLOCK_TICKS_MAX )
+		ticks = SOUND_CLOCK_TICKS_MAX;
+	if ( ticks == SOUND_CLOCK_TICKS )
+		return;
+
+	// without a game there is nothing to hand over
+	if ( ioMem )
+		soundFlush();
+	SOUND_CLOCK_TICKS = ticks;
+	soundTicks        = ticks;
+}
+
+/* soundReadGameMem clears the mixer, which is right for a state load but clicks
+ * when run-ahead rolls back every frame. These keep the Blip_Buffer tails and
+ * integrators of the real timeline, call soundSaveMixer right after soundFlush. */
+static blip_buffer_state_t mixer_state [BUFS_SIZE];
+
+void soundSaveMixer (void)
+{
+	for ( int i = 0; i < BUFS_SIZE; i++ )
+		bufs_buffer[i].save_state( &mixer_state[i] );
+}
+
+void soundRestoreMixer (void)
+{
+	for ( int i = 0; i < BUFS_SIZE; i++ )
+		bufs_buffer[i].load_state( mixer_state[i] );
 }
 
 static void apply_muting (void)
@@ -1992,7 +2317,6 @@ static void remake_stereo_buffer (void)
 
 	// Stereo_Buffer
 
-        mixer_samples_read = 0;
 	stereo_buffer_set_sample_rate( soundSampleRate, BLIP_DEFAULT_LENGTH );
 	stereo_buffer_clock_rate( CLOCK_RATE );
 
@@ -2010,7 +2334,7 @@ static void remake_stereo_buffer (void)
 
 	apply_muting();
 
-	gb_apu_volume(apu_vols [ioMem [SGCNT0_H] & 3] );
+	gb_apu_volume( 0, apu_vols [ioMem [SGCNT0_H] & 3] );
 
 	pcm_synth.volume( 0.66 / 256 * SOUNDVOLUME_ );
 }
@@ -2026,9 +2350,6 @@ void soundReset (void)
 	soundTicks = SOUND_CLOCK_TICKS;
 	//End of Reset APU
 
-	SOUND_CLOCK_TICKS = SOUND_CLOCK_TICKS_;
-	soundTicks        = SOUND_CLOCK_TICKS_;
-
 	// Sound Event (NR52)
 	int gb_addr = table[NR52 - 0x60];
 	if ( gb_addr )
@@ -2147,7 +2468,12 @@ void soundReadGameMem(const uint8_t *& in_data, int)
 	WRITE16LE( &ioMem [SGCNT0_H], data & 0x770F );
 	pcm_fifo_write_control( data, data >> 4 );
 
-	gb_apu_volume(apu_vols [ioMem [SGCNT0_H] & 3] );
+	gb_apu_volume( 0, apu_vols [ioMem [SGCNT0_H] & 3] );
 	//End of SGCNT0_H
 }
 
+unsigned soundGameMemSize (void)
+{
+	return utilDataMemSize( gba_state );
+}
+
@@ -49,38 +49,44 @@
 #define MIXED_TYPE	WAVE_TYPE | NOISE_TYPE
 #define TYPE_INDEX_MASK	0xFF
 
+/* The sample part of offset_ wraps at this, so ring sizes are powers of two up to it */
+#define BLIP_BUFFER_POS_MASK ((1U << (32 - BLIP_BUFFER_ACCURACY)) - 1)
+
 struct blip_buffer_state_t
 {
         uint32_t offset_;
+        uint32_t read_pos_;
         int32_t reader_accum_;
         int32_t buf [BLIP_BUFFER_EXTRA_];
 };
 
 
-/* Begins reading from buffer. Name should be unique to the current block.*/
+/* Begins reading from buffer. Name should be unique to the current block.
+   The buffer is a ring, sample idx of the block is at (pos + idx) & mask.*/
 #define BLIP_READER_BEGIN( name, blip_buffer ) \
-        const int32_t * name##_reader_buf = (blip_buffer).buffer_;\
+        int32_t * name##_reader_buf = (blip_buffer).buffer_;\
+        uint32_t name##_reader_mask = (blip_buffer).buffer_mask_;\
+        uint32_t name##_reader_pos = (blip_buffer).read_pos_;\
         int32_t name##_reader_accum = (blip_buffer).reader_accum_
 
-/* Advances to next sample*/
-#define BLIP_READER_NEXT( name, bass ) \
-        (void) (name##_reader_accum += *name##_reader_buf++ - (name##_reader_accum >> (bass)))
-
-/* Ends reading samples from buffer. The number of samples read must now be removed
-   using Blip_Buffer::remove_samples(). */
-#define BLIP_READER_END( name, blip_buffer ) \
-        (void) ((blip_buffer).reader_accum_ = name##_reader_accum)
-
-#define BLIP_READER_ADJ_( name, offset ) (name##_reader_buf += offset)
+/* Ends reading samples from buffer, count samples are consumed. Every slot that was
+   read has to have been taken with BLIP_READER_TAKE_IDX_ by one of the readers. */
+#define BLIP_READER_END( name, blip_buffer, count ) \
+        (void) ((blip_buffer).reader_accum_ = name##_reader_accum,\
+                (blip_buffer).read_pos_ = (name##_reader_pos + (count)) & BLIP_BUFFER_POS_MASK)
 
 #define BLIP_READER_NEXT_IDX_( name, idx ) {\
         name##_reader_accum -= name##_reader_accum >> BLIP_READER_DEFAULT_BASS;\
-        name##_reader_accum += name##_reader_buf [(idx)];\
+        name##_reader_accum += name##_reader_buf [(name##_reader_pos + (idx)) & name##_reader_mask];\
 }
 
-#define BLIP_READER_NEXT_RAW_IDX_( name, idx ) {\
-        name##_reader_accum -= name##_reader_accum >> BLIP_READER_DEFAULT_BASS; \
-        name##_reader_accum += *(int32_t const*) ((char const*) name##_reader_buf + (idx)); \
+/* Same as BLIP_READER_NEXT_IDX_, also zeroes the slot so synthesis can add into it
+   again once the ring wraps around */
+#define BLIP_READER_TAKE_IDX_( name, idx ) {\
+        int32_t * name##_reader_slot = &name##_reader_buf [(name##_reader_pos + (idx)) & name##_reader_mask];\
+        name##_reader_accum -= name##_reader_accum >> BLIP_READER_DEFAULT_BASS;\
+        name##_reader_accum += *name##_reader_slot;\
+        *name##_reader_slot = 0;\
 }
 
 #if defined (_M_IX86) || defined (_M_IA64) || defined (__i486__) || \
@@ -121,10 +127,25 @@ void soundReset (void);
 void soundEvent_u8( int gb_addr, uint32_t addr, uint8_t  data );
 void soundEvent_u8_parallel(int gb_addr[], uint32_t address[], uint8_t data[]);
 void soundEvent_u16( uint32_t addr, uint16_t data );
-void soundTimerOverflow( int which );
+// Clocks the FIFOs driven by timer which, late is how many clocks ago it overflowed
+void soundTimerOverflow( int which, int late );
+// DMA channels refilling the FIFOs driven by timer which, bit 1 for DMA 1, bit 2 for DMA 2
+int soundTimerDmas( int which );
 void process_sound_tick_fn (void);
+void soundFlush (void);
+// Sets how many clocks are synthesized before the sound is mixed and handed to
+// systemOnWriteDataToSoundBuffer, one video frame by default. Call between
+// frames, the CPU loop picks up the new length when it is entered
+void soundSetFrameLength (int ticks);
+// Turns synthesis off and on, for frames whose sound is not wanted. The
+// hardware is still emulated, only the output stays silent and isn't mixed
+void soundSetSynthesis (bool enabled);
+void soundSaveMixer (void);
+void soundRestoreMixer (void);
 void soundSaveGameMem(uint8_t *& data);
 void soundReadGameMem(const uint8_t *& data, int version);
+// bytes soundSaveGameMem writes and soundReadGameMem reads
+unsigned soundGameMemSize(void);
 
 extern int SOUND_CLOCK_TICKS;   // Number of 16.8 MHz clocks between calls to soundTick()
 extern int soundTicks;          // Number of 16.8 MHz clocks until soundTick() will be called
@@ -0,0 +1,263 @@
+#include "audio.h"
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+
+#define SECONDS_PER_TICKS (1.0 / 19200000)
+
+#define NORMAL_PERIODS 2
+#define NORMAL_PERIOD_FRAMES (AUDIO_SAMPLERATE / 20)
+#define LOW_PERIODS 3
+#define LOW_PERIOD_FRAMES (AUDIO_SAMPLERATE / 200)
+#define LOW_PERIOD_STEP (AUDIO_SAMPLERATE / 400)
+#define LOW_PERIOD_MAX_FRAMES (AUDIO_SAMPLERATE / 50)
+
+#define MAX_PERIODS 3
+#define MAX_PERIOD_FRAMES NORMAL_PERIOD_FRAMES
+
+#define QUEUE_FRAMES (NORMAL_PERIOD_FRAMES * 4)
+// a video frame of sound arrives at once, low latency holds two of them on top of a period
+#define LOW_QUEUE_FRAMES (AUDIO_SAMPLERATE / 60 * 2)
+
+// an underrun only counts while the emulation is writing sound, not in menus or while loading
+#define WRITE_ACTIVE_SECONDS 0.1
+// one stall shouldn't grow the period by several steps
+#define GROW_INTERVAL_SECONDS 0.5
+
+// the most rate control may bend the pitch
+#define MAX_RATE_ADJUST 0.005
+#define LATENCY_SMOOTHING 0.05
+#define STATS_WINDOW_SECONDS 1.0
+
+static Thread outputThread;
+static Mutex queueLock;
+static std::atomic<bool> outputQuit(false);
+// without the output thread nothing reaches the device, writes are dropped
+static bool outputRunning = false;
+
+static AudioOutBuffer buffers[MAX_PERIODS];
+static u32 *bufferData[MAX_PERIODS];
+// buffers the device doesn't have, they are appended while fewer than periods are queued there
+static AudioOutBuffer *idleBuffers[MAX_PERIODS];
+static unsigned idleCount = 0;
+static unsigned deviceFrames = 0;
+
+static u32 queue[QUEUE_FRAMES];
+static unsigned queueUsed = 0;
+
+static AudioLatency latencyMode = audioLatencyNormal;
+static unsigned periods = NORMAL_PERIODS;
+static unsigned periodFrames = NORMAL_PERIOD_FRAMES;
+
+static double lastWriteTime = 0;
+static double lastGrowTime = 0;
+
+static AudioStats stats;
+static double windowStart = 0;
+static u64 windowWritten = 0;
+static u64 windowConsumed = 0;
+static double windowMaxLatency = 0;
+
+static double now() { return (double)svcGetSystemTick() * SECONDS_PER_TICKS; }
+
+static unsigned queueLimit() {
+	return latencyMode == audioLatencyLow ? periodFrames + LOW_QUEUE_FRAMES : QUEUE_FRAMES;
+}
+
+static unsigned queueTarget() { return latencyMode == audioLatencyLow ? periodFrames : NORMAL_PERIOD_FRAMES; }
+
+static void applyLatency(AudioLatency latency) {
+	latencyMode = latency;
+	periods = latency == audioLatencyLow ? LOW_PERIODS : NORMAL_PERIODS;
+	periodFrames = latency == audioLatencyLow ? LOW_PERIOD_FRAMES : NORMAL_PERIOD_FRAMES;
+}
+
+// expects the queue lock
+static void fillBuffer(AudioOutBuffer *buffer) {
+	u32 *data = (u32 *)buffer->buffer;
+	unsigned frames = queueUsed < periodFrames ? queueUsed : periodFrames;
+
+	if (frames < periodFrames) {
+		double time = now();
+		if (time - lastWriteTime < WRITE_ACTIVE_SECONDS) {
+			stats.underruns++;
+			if (latencyMode == audioLatencyLow && periodFrames < LOW_PERIOD_MAX_FRAMES &&
+			    time - lastGrowTime >= GROW_INTERVAL_SECONDS) {
+				periodFrames += LOW_PERIOD_STEP;
+				lastGrowTime = time;
+			}
+		}
+		memset(data + frames, 0, (periodFrames - frames) * sizeof(u32));
+	}
+
+	stats.played += frames;
+	stats.silence += periodFrames - frames;
+	windowConsumed += periodFrames;
+
+	memcpy(data, queue, frames * sizeof(u32));
+	queueUsed -= frames;
+	memmove(queue, queue + frames, queueUsed * sizeof(u32));
+
+	buffer->data_size = periodFrames * sizeof(u32);
+	deviceFrames += periodFrames;
+}
+
+static void outputMain(void *) {
+	while (!outputQuit.load(std::memory_order_acquire)) {
+		AudioOutBuffer *released;
+		u32 count = 0;
+		audoutWaitPlayFinish(&released, &count, U64_MAX);
+
+		mutexLock(&queueLock);
+
+		if (count) {
+			deviceFrames -= released->data_size / sizeof(u32);
+			idleBuffers[idleCount++] = released;
+		}
+
+		// what was just written plays after everything queued before it
+		double latency = (double)(queueUsed + deviceFrames) / AUDIO_SAMPLERATE;
+		stats.latency += (latency - stats.latency) * LATENCY_SMOOTHING;
+		if (latency > windowMaxLatency) windowMaxLatency = latency;
+
+		double time = now();
+		if (time - windowStart >= STATS_WINDOW_SECONDS) {
+			stats.rateRatio = windowConsumed ? (double)windowWritten / windowConsumed : 0;
+			stats.maxLatency = windowMaxLatency;
+			windowStart = time;
+			windowWritten = windowConsumed = 0;
+			windowMaxLatency = 0;
+		}
+
+		unsigned queued = MAX_PERIODS - idleCount;
+		while (queued < periods && idleCount) {
+			AudioOutBuffer *buffer = idleBuffers[--idleCount];
+			fillBuffer(buffer);
+			audoutAppendAudioOutBuffer(buffer);
+			queued++;
+		}
+
+		mutexUnlock(&queueLock);
+	}
+}
+
+void audioInit(AudioLatency latency) {
+	mutexInit(&queueLock);
+	applyLatency(latency);
+	queueUsed = 0;
+	memset(&stats, 0, sizeof(stats));
+	windowStart = now();
+	windowWritten = windowConsumed = 0;
+	windowMaxLatency = 0;
+
+	audoutInitialize();
+	audoutStartAudioOut();
+
+	u32 dataSize = (MAX_PERIOD_FRAMES * sizeof(u32) + 0xfff) & ~0xfff;
+	for (int i = 0; i < MAX_PERIODS; i++) {
+		bufferData[i] = (u32 *)memalign(0x1000, dataSize);
+		memset(bufferData[i], 0, dataSize);
+
+		buffers[i].next = NULL;
+		buffers[i].buffer = bufferData[i];
+		buffers[i].buffer_size = dataSize;
+		buffers[i].data_size = 0;
+		buffers[i].data_offset = 0;
+	}
+
+	deviceFrames = 0;
+	idleCount = 0;
+	for (int i = 0; i < MAX_PERIODS; i++) {
+		if ((unsigned)i < periods) {
+			fillBuffer(&buffers[i]);
+			audoutAppendAudioOutBuffer(&buffers[i]);
+		} else {
+			idleBuffers[idleCount++] = &buffers[i];
+		}
+	}
+
+	outputQuit.store(false);
+	Result rc = threadCreate(&outputThread, outputMain, NULL, 0x4000, 0x2B, 2);
+	if (R_SUCCEEDED(rc)) {
+		rc = threadStart(&outputThread);
+		if (R_FAILED(rc)) threadClose(&outputThread);
+	}
+	outputRunning = R_SUCCEEDED(rc);
+	if (!outputRunning) printf("Failed to start the audio output thread: %x, sound is off\n", rc);
+}
+
+void audioDeinit() {
+	if (outputRunning) {
+		// the device keeps releasing periods, so the thread sees this within one
+		outputQuit.store(true, std::memory_order_release);
+		threadWaitForExit(&outputThread);
+		threadClose(&outputThread);
+		outputRunning = false;
+	}
+
+	audoutStopAudioOut();
+	audoutExit();
+
+	for (int i = 0; i < MAX_PERIODS; i++) {
+		free(bufferData[i]);
+		bufferData[i] = NULL;
+	}
+}
+
+void audioSetLatency(AudioLatency latency) {
+	mutexLock(&queueLock);
+	if (latency != latencyMode) {
+		applyLatency(latency);
+		if (queueUsed > queueLimit()) {
+			stats.dropped += queueUsed - queueLimit();
+			queueUsed = queueLimit();
+		}
+	}
+	mutexUnlock(&queueLock);
+}
+
+void audioWrite(const s16 *samples, unsigned frames) {
+	mutexLock(&queueLock);
+	lastWriteTime = now();
+	windowWritten += frames;
+	stats.written += frames;
+	if (outputRunning && queueUsed + frames <= queueLimit()) {
+		memcpy(queue + queueUsed, samples, frames * sizeof(u32));
+		queueUsed += frames;
+	} else {
+		stats.dropped += frames;
+	}
+	mutexUnlock(&queueLock);
+}
+
+void audioClear() {
+	mutexLock(&queueLock);
+	stats.dropped += queueUsed;
+	queueUsed = 0;
+	mutexUnlock(&queueLock);
+}
+
+double audioRateAdjust() {
+	mutexLock(&queueLock);
+	double target = queueTarget();
+	double error = ((double)queueUsed - target) / target;
+	mutexUnlock(&queueLock);
+
+	if (error > 1) error = 1;
+	if (error < -1) error = -1;
+	return 1 + error * MAX_RATE_ADJUST;
+}
+
+void audioGetStats(AudioStats *out) {
+	mutexLock(&queueLock);
+	*out = stats;
+	out->periodFrames = periodFrames;
+	out->periods = periods;
+	out->queued = queueUsed;
+	out->queueLimit = queueLimit();
+	mutexUnlock(&queueLock);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <switch.h>
+
+/*
+    Audio output. The emulation thread queues interleaved stereo s16 frames,
+    an output thread hands them to audout one period at a time and pads a
+    period the queue can't fill with silence.
+
+    Normal latency keeps 2 periods of 50 ms queued at the device. Low latency
+    keeps 3 periods that start at 5 ms, and every underrun while sound is
+    coming in grows them by 2.5 ms, up to 20 ms.
+
+    Writes that don't fit in the queue are dropped. With the resampler,
+    audioRateAdjust steers the queue towards its target instead.
+
+    The counters in AudioStats run from audioInit. The rate ratio and the peak
+    latency are measured over the last full second.
+*/
+
+#define AUDIO_SAMPLERATE 48000
+
+enum AudioLatency {
+	audioLatencyNormal,
+	audioLatencyLow,
+	audioLatencyCount,
+};
+
+struct AudioStats {
+	unsigned periodFrames;
+	unsigned periods;
+	// periods padded with silence while sound was being written
+	unsigned underruns;
+	// seconds from audioWrite to the device finishing the frame, smoothed and peak
+	double latency;
+	double maxLatency;
+
+	// frames given to audioWrite, dropped because the queue was full or
+	// thrown out of it later, handed to the device and silence padded in for
+	// missing ones. written is always played + dropped + queued
+	u64 written;
+	u64 dropped;
+	u64 played;
+	u64 silence;
+
+	unsigned queued;
+	unsigned queueLimit;
+
+	// frames given to audioWrite per frame the device played, 0 until measured
+	double rateRatio;
+};
+
+void audioInit(AudioLatency latency);
+void audioDeinit();
+
+// takes effect from the next period, going back to low latency restarts at the smallest period
+void audioSetLatency(AudioLatency latency);
+
+void audioWrite(const s16 *samples, unsigned frames);
+
+// drops the queued frames, the device plays silence until the next write
+void audioClear();
+
+// the ratio for resamplerSetRatio that moves the queue towards its target fill
+double audioRateAdjust();
+
+void audioGetStats(AudioStats *stats);
@@ -0,0 +1,234 @@
+#include "battery.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <switch.h>
+
+#include "../gba.h"
+#include "ui.h"
+#include "util.h"
+
+// largest battery image, 128 KB flash
+#define BATTERY_MAX_SIZE 0x20000
+
+static Thread workerThread;
+static Mutex workerLock;
+static CondVar workerCond;
+static bool workerQuit = false;
+// without the worker, saves are written on the calling thread
+static bool workerRunning = false;
+
+static u8 *images[2] = {NULL, NULL};
+static unsigned imageSizes[2] = {0, 0};
+
+// indices into images, -1 when unused
+static int pendingImage = -1;
+static int busyImage = -1;
+// the image last handed to the writer, it matches the file unless writing it failed
+static int lastImage = -1;
+static char pendingFilename[PATH_LENGTH];
+static bool pendingReport = false;
+
+static bool resultReady = false;
+static bool resultOk = false;
+
+/* A save is written to .tmp, which is renamed to .new once it is closed and
+ * then replaces the old file. A .tmp may be torn and is never used, a .new
+ * is always complete. */
+static void tmpFilenameFor(char *tmpFilename, unsigned length, const char *filename, const char *suffix) {
+	snprintf(tmpFilename, length, "%s.%s", filename, suffix);
+}
+
+static bool writeBatteryFile(const char *filename, const u8 *data, unsigned size) {
+	char tmpFilename[PATH_LENGTH + 4];
+	char newFilename[PATH_LENGTH + 4];
+	tmpFilenameFor(tmpFilename, sizeof(tmpFilename), filename, "tmp");
+	tmpFilenameFor(newFilename, sizeof(newFilename), filename, "new");
+
+	FILE *f = fopen(tmpFilename, "wb");
+	if (!f) {
+		printf("Failed to open %s for write\n", tmpFilename);
+		return false;
+	}
+
+	bool ok = fwrite(data, 1, size, f) == size;
+	ok = fclose(f) == 0 && ok;
+
+	// the old file stays intact until the new one is complete
+	if (ok) {
+		remove(newFilename);
+		ok = rename(tmpFilename, newFilename) == 0;
+	}
+	if (!ok) {
+		printf("Failed to write to %s\n", tmpFilename);
+		remove(tmpFilename);
+		return false;
+	}
+
+	remove(filename);
+	ok = rename(newFilename, filename) == 0;
+	// the .new is left for batteryRecover
+	if (!ok) printf("Failed to rename %s\n", newFilename);
+
+	return ok;
+}
+
+// expects workerLock to be held
+static void finishWrite(int image, bool ok, bool report) {
+	// a failed write has to be retried on the next flush even if nothing changed
+	if (!ok && lastImage == image) lastImage = -1;
+	if (report || !ok) {
+		resultReady = true;
+		resultOk = ok;
+	}
+}
+
+static void workerMain(void *) {
+	char filename[PATH_LENGTH];
+	bool report;
+
+	mutexLock(&workerLock);
+	while (true) {
+		while (pendingImage == -1 && !workerQuit) condvarWait(&workerCond);
+		if (pendingImage == -1) break;
+
+		busyImage = pendingImage;
+		pendingImage = -1;
+		strcpy(filename, pendingFilename);
+		report = pendingReport;
+		mutexUnlock(&workerLock);
+
+		bool ok = writeBatteryFile(filename, images[busyImage], imageSizes[busyImage]);
+
+		mutexLock(&workerLock);
+		finishWrite(busyImage, ok, report);
+		busyImage = -1;
+		condvarWakeAll(&workerCond);
+	}
+	mutexUnlock(&workerLock);
+}
+
+static void waitForWorker() {
+	mutexLock(&workerLock);
+	while (pendingImage != -1 || busyImage != -1) condvarWait(&workerCond);
+	mutexUnlock(&workerLock);
+}
+
+void batteryInit() {
+	images[0] = (u8 *)malloc(BATTERY_MAX_SIZE);
+	images[1] = (u8 *)malloc(BATTERY_MAX_SIZE);
+
+	mutexInit(&workerLock);
+	condvarInit(&workerCond, &workerLock);
+	workerQuit = false;
+
+	Result rc = threadCreate(&workerThread, workerMain, NULL, 0x4000, 0x3B, -2);
+	if (R_SUCCEEDED(rc)) {
+		rc = threadStart(&workerThread);
+		if (R_FAILED(rc)) threadClose(&workerThread);
+	}
+	workerRunning = R_SUCCEEDED(rc);
+	if (!workerRunning) printf("Failed to start the battery save thread: %x, writing synchronously\n", rc);
+}
+
+void batteryDeinit() {
+	if (workerRunning) {
+		mutexLock(&workerLock);
+		workerQuit = true;
+		condvarWakeAll(&workerCond);
+		mutexUnlock(&workerLock);
+
+		threadWaitForExit(&workerThread);
+		threadClose(&workerThread);
+		workerRunning = false;
+	}
+
+	free(images[0]);
+	free(images[1]);
+	images[0] = images[1] = NULL;
+}
+
+void batteryRecover(const char *filename) {
+	// a write of the same file may still be queued from closing the game before
+	waitForWorker();
+
+	char tmpFilename[PATH_LENGTH + 4];
+	char newFilename[PATH_LENGTH + 4];
+	tmpFilenameFor(tmpFilename, sizeof(tmpFilename), filename, "tmp");
+	tmpFilenameFor(newFilename, sizeof(newFilename), filename, "new");
+
+	// the write stopped before the file was closed, it may be torn
+	remove(tmpFilename);
+
+	FILE *f = fopen(newFilename, "rb");
+	if (!f) return;
+	fclose(f);
+
+	// the write was complete but didn't replace the old file yet
+	remove(filename);
+	if (rename(newFilename, filename) == 0) printf("Recovered %s\n", filename);
+}
+
+void batteryLoaded(bool fromFile) {
+	// the buffers may still be in use for the previous game
+	waitForWorker();
+	lastImage = -1;
+
+	unsigned size;
+	const u8 *data = CPUBatteryData(&size);
+	if (!fromFile || !data || size > BATTERY_MAX_SIZE) return;
+
+	memcpy(images[0], data, size);
+	imageSizes[0] = size;
+	lastImage = 0;
+}
+
+bool batteryFlush(const char *filename, bool report) {
+	unsigned size;
+	const u8 *data = CPUBatteryData(&size);
+	if (!data || size > BATTERY_MAX_SIZE) return false;
+
+	mutexLock(&workerLock);
+
+	if (lastImage != -1 && imageSizes[lastImage] == size && memcmp(images[lastImage], data, size) == 0) {
+		mutexUnlock(&workerLock);
+		return false;
+	}
+
+	// a newer image replaces one the worker hasn't picked up yet
+	pendingImage = -1;
+	int image = busyImage == 0 ? 1 : 0;
+
+	memcpy(images[image], data, size);
+	imageSizes[image] = size;
+	lastImage = image;
+
+	if (!workerRunning) {
+		finishWrite(image, writeBatteryFile(filename, images[image], imageSizes[image]), report);
+		mutexUnlock(&workerLock);
+		return true;
+	}
+
+	strcpy_safe(pendingFilename, filename, PATH_LENGTH);
+	pendingReport = report;
+
+	pendingImage = image;
+	condvarWakeAll(&workerCond);
+	mutexUnlock(&workerLock);
+
+	return true;
+}
+
+void batteryPoll() {
+	mutexLock(&workerLock);
+	if (resultReady) {
+		if (resultOk)
+			uiStatusMsg("Wrote save file.");
+		else
+			uiStatusMsg("Failed to write save file.");
+		resultReady = false;
+	}
+	mutexUnlock(&workerLock);
+}
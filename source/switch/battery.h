@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+    Battery saves are copied into one of two buffers under the emulation lock
+    and written by a background thread through temporary files and renames, or
+    by batteryFlush itself if the thread can't be started.
+    A flush is skipped when the save memory matches the last image handed to
+    the writer, so pausing or closing a game that didn't save costs nothing.
+
+    batteryLoaded and batteryFlush expect the caller to hold the emulation lock.
+*/
+
+void batteryInit();
+// waits for queued writes
+void batteryDeinit();
+
+// waits for queued writes and puts back a complete save left by an interrupted
+// write, call before loading it
+void batteryRecover(const char *filename);
+// remembers the save memory as what is on disk, call after CPUReadBatteryFile
+void batteryLoaded(bool fromFile);
+
+// returns true if a write was queued, failures are always reported
+bool batteryFlush(const char *filename, bool report);
+
+// reports finished writes through uiStatusMsg, call from the UI thread only
+void batteryPoll();
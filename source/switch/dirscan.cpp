@@ -0,0 +1,291 @@
+#include "dirscan.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/dirent.h>
+#include <sys/stat.h>
+
+#include <switch.h>
+
+#include "ui.h"
+#include "util.h"
+
+#define INDEX_DIRECTORY "dircache"
+#define INDEX_MAGIC 0x58444256  // "VBDX"
+#define INDEX_VERSION 1
+
+// entries handed over at a time while a directory without an index is read
+#define SCAN_BATCH 64
+
+static Thread workerThread;
+static Mutex workerLock;
+static CondVar workerCond;
+static bool workerQuit = false;
+// without the worker, dirScanStart scans inline
+static bool workerRunning = false;
+
+// bumped by every dirScanStart, results of older scans are dropped
+static u32 requestGeneration = 0;
+static bool requestPending = false;
+static char requestDirectory[PATH_LENGTH];
+static const char **requestExtensions = NULL;
+
+static std::vector<std::string> found;
+static bool foundReplace = false;
+static bool scanRunning = false;
+
+bool dirScanLess(const std::string &a, const std::string &b) { return strcasecmp(a.c_str(), b.c_str()) < 0; }
+
+static bool scanIsCurrent(u32 generation) {
+	mutexLock(&workerLock);
+	bool current = generation == requestGeneration && !workerQuit;
+	mutexUnlock(&workerLock);
+	return current;
+}
+
+static void publish(u32 generation, std::vector<std::string>::const_iterator begin,
+		    std::vector<std::string>::const_iterator end, bool replace) {
+	mutexLock(&workerLock);
+	if (generation == requestGeneration) {
+		if (replace) {
+			found.assign(begin, end);
+			foundReplace = true;
+		} else {
+			found.insert(found.end(), begin, end);
+		}
+	}
+	mutexUnlock(&workerLock);
+}
+
+static void indexFilenameFor(char *indexFilename, unsigned length, const char *directory) {
+	// FNV-1a, the index stores the full path so a collision only costs a rescan
+	u32 hash = 2166136261u;
+	for (const char *c = directory; *c; c++) hash = (hash ^ (u8)*c) * 16777619u;
+	snprintf(indexFilename, length, INDEX_DIRECTORY "/%08x.idx", hash);
+}
+
+static bool readIndex(const char *directory, s64 *mtime, std::vector<std::string> &names) {
+	char indexFilename[64];
+	indexFilenameFor(indexFilename, sizeof(indexFilename), directory);
+
+	FILE *f = fopen(indexFilename, "rb");
+	if (!f) return false;
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+
+	char *data = (char *)malloc(size + 1);
+	bool ok = data && size >= 24 && fread(data, 1, size, f) == (size_t)size;
+	fclose(f);
+
+	if (ok) {
+		data[size] = '\0';  // the last name can't run off the end
+
+		u32 header[6];
+		memcpy(header, data, sizeof(header));
+		u32 pathLength = header[4], count = header[5];
+
+		ok = header[0] == INDEX_MAGIC && header[1] == INDEX_VERSION && pathLength == strlen(directory) &&
+		     24 + pathLength <= (u32)size && memcmp(data + 24, directory, pathLength) == 0;
+		if (ok) {
+			memcpy(mtime, &header[2], sizeof(s64));
+
+			names.clear();
+			names.reserve(std::min<u32>(count, size));
+			for (long pos = 24 + pathLength; pos < size && names.size() < count;) {
+				names.push_back(data + pos);
+				pos += names.back().size() + 1;
+			}
+			ok = names.size() == count;
+		}
+	}
+
+	free(data);
+	return ok;
+}
+
+static void writeIndex(const char *directory, s64 mtime, const std::vector<std::string> &names) {
+	char indexFilename[64];
+	indexFilenameFor(indexFilename, sizeof(indexFilename), directory);
+
+	FILE *f = fopen(indexFilename, "wb");
+	if (!f) return;
+
+	u32 header[6] = {INDEX_MAGIC, INDEX_VERSION, 0, 0, (u32)strlen(directory), (u32)names.size()};
+	memcpy(&header[2], &mtime, sizeof(s64));
+
+	bool ok = fwrite(header, 1, sizeof(header), f) == sizeof(header);
+	ok = ok && fwrite(directory, 1, header[4], f) == header[4];
+	for (size_t i = 0; ok && i < names.size(); i++)
+		ok = fwrite(names[i].c_str(), 1, names[i].size() + 1, f) == names[i].size() + 1;
+	ok = fclose(f) == 0 && ok;
+
+	// a partial index would only be rejected on the next read
+	if (!ok) remove(indexFilename);
+}
+
+static bool acceptEntry(const char *directory, struct dirent *ent, const char **extensions) {
+	if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) return false;
+
+	bool directoryEntry = ent->d_type == DT_DIR;
+	if (ent->d_type != DT_DIR && ent->d_type != DT_REG) {
+		char path[strlen(directory) + strlen(ent->d_name) + 2];
+		snprintf(path, sizeof(path), "%s/%s", directory, ent->d_name);
+		directoryEntry = isDirectory(path);
+	}
+	if (directoryEntry) return true;
+
+	const char *dot = strrchr(ent->d_name, '.');
+	if (!dot || dot == ent->d_name) return false;
+
+	for (const char **ext = extensions; *ext; ext++)
+		if (!strcasecmp(dot + 1, *ext)) return true;
+
+	return false;
+}
+
+static void scanDirectory(const char *directory, const char **extensions, u32 generation) {
+	char slash[strlen(directory) + 2];
+	snprintf(slash, sizeof(slash), "%s/", directory);
+
+	struct stat st;
+	s64 mtime = stat(slash, &st) == 0 ? (s64)st.st_mtime : 0;
+
+	std::vector<std::string> cached;
+	s64 cachedMtime = 0;
+	bool haveIndex = readIndex(directory, &cachedMtime, cached);
+	if (haveIndex) {
+		publish(generation, cached.begin(), cached.end(), true);
+		// not every filesystem keeps directory mtimes, without one the index is only a preview
+		if (mtime != 0 && cachedMtime == mtime) return;
+	}
+
+	std::vector<std::string> names;
+	size_t published = 0;
+
+	DIR *dir = opendir(slash);
+	if (!dir) {
+		publish(generation, names.begin(), names.end(), true);
+		return;
+	}
+
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		if (!scanIsCurrent(generation)) {
+			closedir(dir);
+			return;
+		}
+
+		if (acceptEntry(directory, ent, extensions)) names.push_back(ent->d_name);
+
+		// with an index on screen the result is swapped in once it's complete
+		if (!haveIndex && names.size() - published >= SCAN_BATCH) {
+			publish(generation, names.begin() + published, names.end(), false);
+			published = names.size();
+		}
+	}
+	closedir(dir);
+
+	std::sort(names.begin(), names.end(), dirScanLess);
+	if (!haveIndex || names != cached) publish(generation, names.begin(), names.end(), true);
+
+	if (!haveIndex || names != cached || mtime != cachedMtime) writeIndex(directory, mtime, names);
+}
+
+static void workerMain(void *) {
+	char directory[PATH_LENGTH];
+
+	mutexLock(&workerLock);
+	while (true) {
+		while (!requestPending && !workerQuit) condvarWait(&workerCond);
+		if (workerQuit) break;
+
+		requestPending = false;
+		u32 generation = requestGeneration;
+		const char **extensions = requestExtensions;
+		strcpy(directory, requestDirectory);
+		mutexUnlock(&workerLock);
+
+		scanDirectory(directory, extensions, generation);
+
+		mutexLock(&workerLock);
+		if (generation == requestGeneration) scanRunning = false;
+	}
+	mutexUnlock(&workerLock);
+}
+
+void dirScanInit() {
+	mkdir(INDEX_DIRECTORY, 0777);
+
+	mutexInit(&workerLock);
+	condvarInit(&workerCond, &workerLock);
+	workerQuit = false;
+
+	Result rc = threadCreate(&workerThread, workerMain, NULL, 0x10000, 0x3B, -2);
+	if (R_SUCCEEDED(rc)) {
+		rc = threadStart(&workerThread);
+		if (R_FAILED(rc)) threadClose(&workerThread);
+	}
+	workerRunning = R_SUCCEEDED(rc);
+	if (!workerRunning) printf("Failed to start the directory scan thread: %x, scanning inline\n", rc);
+}
+
+void dirScanDeinit() {
+	if (workerRunning) {
+		mutexLock(&workerLock);
+		workerQuit = true;
+		condvarWakeAll(&workerCond);
+		mutexUnlock(&workerLock);
+
+		threadWaitForExit(&workerThread);
+		threadClose(&workerThread);
+		workerRunning = false;
+	}
+
+	found.clear();
+}
+
+void dirScanStart(const char *directory, const char **extensions) {
+	mutexLock(&workerLock);
+	requestGeneration++;
+	requestPending = true;
+	strcpy_safe(requestDirectory, directory, PATH_LENGTH);
+	requestExtensions = extensions;
+
+	found.clear();
+	foundReplace = false;
+	scanRunning = true;
+
+	if (!workerRunning) {
+		requestPending = false;
+		u32 generation = requestGeneration;
+		mutexUnlock(&workerLock);
+
+		// blocks the browser for the length of the scan, but the listing still shows up
+		scanDirectory(directory, extensions, generation);
+
+		mutexLock(&workerLock);
+		scanRunning = false;
+		mutexUnlock(&workerLock);
+		return;
+	}
+
+	condvarWakeAll(&workerCond);
+	mutexUnlock(&workerLock);
+}
+
+bool dirScanPoll(std::vector<std::string> &entries, bool *replace) {
+	mutexLock(&workerLock);
+	entries.swap(found);
+	found.clear();
+	*replace = foundReplace;
+	foundReplace = false;
+	bool running = scanRunning;
+	mutexUnlock(&workerLock);
+
+	return running;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/*
+    Directory listings are produced by a background thread and handed to the UI
+    in batches, so large folders neither block the browser nor get truncated.
+    Each listing is kept in an index under dircache/ keyed by the directory's
+    mtime; a matching index is shown right away without touching the directory.
+    When the mtime can't be trusted the index is still shown first and the
+    directory is rescanned behind it.
+
+    Entries are names relative to the directory, without "..".
+*/
+
+void dirScanInit();
+void dirScanDeinit();
+
+// lists directory, abandoning any scan still running. extensions is a NULL-terminated
+// list of file extensions to keep and has to outlive the scan
+void dirScanStart(const char *directory, const char **extensions);
+
+// moves the entries found since the last call into entries, sorted when replace is set.
+// replace is set when they supersede everything returned before for this scan.
+// returns false once the scan is complete, call from the UI thread only
+bool dirScanPoll(std::vector<std::string> &entries, bool *replace);
+
+// the order entries are sorted in, ignoring case
+bool dirScanLess(const std::string &a, const std::string &b);
@@ -0,0 +1,132 @@
+#include "gamedb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+#include <unordered_set>
+
+#define GAMEDB_LINE_MAX 1024
+
+// keyed by code << 32 | crc, code-only entries have a crc of 0
+static std::unordered_map<u64, GameProfile> profiles;
+// codes with at least one CRC specific entry
+static std::unordered_set<u32> crcCodes;
+
+static u32 codeKey(const char *code) { return code[0] | (code[1] << 8) | (code[2] << 16) | ((u32)code[3] << 24); }
+
+static bool parseFrameSkip(const char *value, int *frameSkip) {
+	// same encoding as frameSkipValues in main.cpp, fractions skip 1 in 3 or 2 frames
+	if (!strcmp(value, "1/3")) {
+		*frameSkip = 0x13;
+	} else if (!strcmp(value, "1/2")) {
+		*frameSkip = 0x12;
+	} else {
+		char *end;
+		long frames = strtol(value, &end, 10);
+		if (*end || frames < 0 || frames > 4) return false;
+		*frameSkip = frames;
+	}
+	return true;
+}
+
+static bool parseIdleLoops(char *value, std::vector<u32> &idleLoops) {
+	char *save;
+	for (char *address = strtok_r(value, ",", &save); address; address = strtok_r(NULL, ",", &save)) {
+		char *end;
+		u32 branch = strtoul(address, &end, 16);
+		if (*end || branch < 0x02000000) return false;
+		idleLoops.push_back(branch);
+	}
+	return !idleLoops.empty();
+}
+
+static bool parseInt(const char *value, int min, int max, int *out) {
+	char *end;
+	long v = strtol(value, &end, 10);
+	if (*end || v < min || v > max) return false;
+	*out = v;
+	return true;
+}
+
+static bool parseKey(GameProfile *profile, const char *key, char *value) {
+	if (!strcmp(key, "flash"))
+		return parseInt(value, 0x10000, 0x20000, &profile->flashSize) &&
+		       (profile->flashSize == 0x10000 || profile->flashSize == 0x20000);
+	if (!strcmp(key, "save")) return parseInt(value, 0, 5, &profile->saveType);
+	if (!strcmp(key, "rtc")) return parseInt(value, 0, 1, &profile->rtcEnabled);
+	if (!strcmp(key, "mirror")) return parseInt(value, 0, 1, &profile->mirroringEnabled);
+	if (!strcmp(key, "idleskip")) return parseInt(value, 0, 1, &profile->idleLoopSkip);
+	if (!strcmp(key, "idle")) return parseIdleLoops(value, profile->idleLoops);
+	if (!strcmp(key, "frameskip")) return parseFrameSkip(value, &profile->frameSkip);
+	if (!strcmp(key, "runahead")) return parseInt(value, 0, 2, &profile->runAhead);
+	return false;
+}
+
+static void parseLine(const char *filename, int lineNumber, char *line) {
+	char *comment = strchr(line, '#');
+	if (comment) *comment = '\0';
+
+	char *save;
+	char *id = strtok_r(line, " \t\r\n", &save);
+	if (!id) return;
+
+	u32 crc = 0;
+	bool validId = strlen(id) == 4;
+	if (strlen(id) == 13 && id[4] == ':') {
+		char *end;
+		crc = strtoul(id + 5, &end, 16);
+		validId = !*end && crc;
+	}
+	if (!validId) {
+		printf("%s:%d: bad game id %s\n", filename, lineNumber, id);
+		return;
+	}
+
+	GameProfile profile;
+	profile.flashSize = 0;
+	profile.saveType = profile.rtcEnabled = profile.mirroringEnabled = -1;
+	profile.idleLoopSkip = profile.frameSkip = profile.runAhead = -1;
+
+	for (char *token = strtok_r(NULL, " \t\r\n", &save); token; token = strtok_r(NULL, " \t\r\n", &save)) {
+		char *value = strchr(token, '=');
+		if (value) *value++ = '\0';
+		if (!value || !parseKey(&profile, token, value)) {
+			printf("%s:%d: bad value for %s\n", filename, lineNumber, token);
+			return;
+		}
+	}
+
+	u32 code = codeKey(id);
+	profiles[(u64)code << 32 | crc] = profile;
+	if (crc) crcCodes.insert(code);
+}
+
+static void loadDatabase(const char *filename) {
+	FILE *f = fopen(filename, "r");
+	if (!f) return;
+
+	char line[GAMEDB_LINE_MAX];
+	for (int lineNumber = 1; fgets(line, sizeof(line), f); lineNumber++) parseLine(filename, lineNumber, line);
+
+	fclose(f);
+}
+
+void gameDbInit() {
+	profiles.clear();
+	crcCodes.clear();
+
+	loadDatabase("romfs:/gamedb.txt");
+	loadDatabase("gamedb.txt");
+}
+
+bool gameDbNeedsCrc(const char *code) { return crcCodes.count(codeKey(code)) != 0; }
+
+const GameProfile *gameDbFind(const char *code, u32 crc) {
+	u64 key = (u64)codeKey(code) << 32;
+
+	std::unordered_map<u64, GameProfile>::const_iterator it = profiles.find(key | crc);
+	if (it == profiles.end() && crc) it = profiles.find(key);
+
+	return it != profiles.end() ? &it->second : NULL;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <switch.h>
+#include <vector>
+
+/*
+    Per-title overrides and performance hints, read from romfs:/gamedb.txt and then
+    from gamedb.txt next to the settings, whose entries replace the built-in ones.
+
+    One title per line, everything after # is a comment:
+
+	CODE[:CRC32] key=value ...
+
+    CODE is the cartridge code at 0xAC. An entry with the CRC32 of the whole image
+    only matches that dump and is preferred over the entry for the code alone.
+
+    Overrides:    flash=65536|131072  save=0-5  rtc=0|1  mirror=0|1
+    Performance:  idleskip=0|1  idle=ADDR[,ADDR...]  frameskip=0|1/3|1/2|1-4  runahead=0-2
+
+    idle lists the addresses of backward branches closing loops that are known to only
+    wait for an interrupt, for loops the idle loop analysis can't prove.
+*/
+
+struct GameProfile {
+	// -1 (0 for flashSize) when the entry doesn't set it
+	int flashSize;
+	int saveType;
+	int rtcEnabled;
+	int mirroringEnabled;
+
+	int idleLoopSkip;
+	int frameSkip;  // as passed to SetFrameskip
+	int runAhead;
+	std::vector<u32> idleLoops;
+};
+
+void gameDbInit();
+
+// whether an entry for this code needs the image CRC to be picked
+bool gameDbNeedsCrc(const char *code);
+const GameProfile *gameDbFind(const char *code, u32 crc);
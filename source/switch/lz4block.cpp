@@ -0,0 +1,165 @@
+#include "lz4block.h"
+
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 12
+
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash32(uint32_t v) { return (v * 2654435761U) >> (32 - LZ4_HASH_LOG); }
+
+static inline uint8_t *writeLength(uint8_t *op, size_t len) {
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+size_t lz4BlockBound(size_t srcSize) { return srcSize + srcSize / 255 + 16; }
+
+size_t lz4BlockCompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity) {
+	// positions relative to src, 0 is a valid (and verified) candidate
+	uint32_t table[1 << LZ4_HASH_LOG];
+	memset(table, 0, sizeof(table));
+
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *end = src + srcSize;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dstCapacity;
+
+	if (srcSize > LZ4_MF_LIMIT) {
+		const uint8_t *mflimit = end - LZ4_MF_LIMIT;
+		const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash32(seq);
+			const uint8_t *ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+
+			if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq) {
+				ip++;
+				continue;
+			}
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+
+			const uint8_t *mp = ip + LZ4_MIN_MATCH;
+			const uint8_t *rp = ref + LZ4_MIN_MATCH;
+			while (mp < matchlimit && *mp == *rp) {
+				mp++;
+				rp++;
+			}
+
+			size_t litLen = ip - anchor;
+			size_t matchLen = mp - ip - LZ4_MIN_MATCH;
+
+			if ((size_t)(oend - op) < 1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1) return 0;
+
+			uint8_t *token = op++;
+			if (litLen >= 15) {
+				*token = 15 << 4;
+				op = writeLength(op, litLen - 15);
+			} else
+				*token = (uint8_t)(litLen << 4);
+
+			memcpy(op, anchor, litLen);
+			op += litLen;
+
+			size_t offset = ip - ref;
+			*op++ = offset & 0xFF;
+			*op++ = offset >> 8;
+
+			if (matchLen >= 15) {
+				*token |= 15;
+				op = writeLength(op, matchLen - 15);
+			} else
+				*token |= (uint8_t)matchLen;
+
+			// seed the table inside the match so runs of zeroes keep chaining
+			if (mp - 2 > ip) table[hash32(read32(mp - 2))] = (uint32_t)(mp - 2 - src);
+
+			ip = anchor = mp;
+		}
+	}
+
+	size_t litLen = end - anchor;
+	if ((size_t)(oend - op) < 1 + litLen / 255 + 1 + litLen) return 0;
+
+	if (litLen >= 15) {
+		*op++ = 15 << 4;
+		op = writeLength(op, litLen - 15);
+	} else
+		*op++ = (uint8_t)(litLen << 4);
+
+	memcpy(op, anchor, litLen);
+	op += litLen;
+
+	return op - dst;
+}
+
+static inline bool readLength(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+	uint8_t b;
+	do {
+		if (*ip >= iend) return false;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return true;
+}
+
+long lz4BlockDecompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity) {
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + srcSize;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dstCapacity;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+
+		size_t len = token >> 4;
+		if (len == 15 && !readLength(&ip, iend, &len)) return -1;
+		if (len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return -1;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		// the last sequence only carries literals
+		if (ip == iend) break;
+
+		if (iend - ip < 2) return -1;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+
+		len = token & 15;
+		if (len == 15 && !readLength(&ip, iend, &len)) return -1;
+		len += LZ4_MIN_MATCH;
+		if (len > (size_t)(oend - op)) return -1;
+
+		const uint8_t *ref = op - offset;
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			while (len--) *op++ = *ref++;
+		}
+	}
+
+	return op - dst;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Minimal compressor/decompressor for the LZ4 block format.
+
+    Output is compatible with LZ4_decompress_safe, but the compressor is a plain
+    single-probe greedy matcher. It is meant for save states, which are mostly
+    zeroes and repeated tiles, so the ratio is close to the reference one.
+*/
+
+// worst case size of the compressed data for srcSize input bytes
+size_t lz4BlockBound(size_t srcSize);
+
+// returns the compressed size or 0 if dst is too small
+size_t lz4BlockCompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity);
+
+// returns the decompressed size or -1 on malformed input or if dst is too small
+long lz4BlockDecompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity);
@@ -7,6 +7,8 @@
 #include <string.h>
 #include <time.h>
 
+#include <atomic>
+
 #include <arm_neon.h>
 
 #include "../gba.h"
@@ -17,8 +19,14 @@
 #include "../system.h"
 #include "../types.h"
 #include "../GBACheats.h"
-#include "gbaover.h"
 
+#include "audio.h"
+#include "battery.h"
+#include "gamedb.h"
+#include "recorder.h"
+#include "resampler.h"
+#include "rewind.h"
+#include "savestate.h"
 #include "util.h"
 #include "zoom.h"
 
@@ -65,8 +73,51 @@ static const int frameSkipValues[] = {0, 0x13, 0x12, 0x1, 0x2, 0x3, 0x4};
 static uint32_t frameSkip = 0;
 
 static uint32_t disableAnalogStick = 0;
+static uint32_t idleLoopSkip = 0;
 static uint32_t switchRLButtons = 0;
 
+static const char *rewindNames[] = {"Off", "16 MB", "32 MB", "64 MB"};
+static const size_t rewindBudgets[] = {0, 16 << 20, 32 << 20, 64 << 20};
+static uint32_t rewindBuffer = 0;
+#define REWIND_INTERVAL 2
+
+static const char *runAheadNames[] = {"Off", "1 frame", "2 frames"};
+static uint32_t runAhead = 0;
+// runAhead unless the game profile asks for something else
+static unsigned runAheadFrames = 0;
+
+// emulated frames per shown frame while the speedhack button is held, 0 runs as
+// many as fit in a frame time
+static const char *fastForwardNames[] = {"2x", "3x", "4x", "6x", "8x", "Unlimited"};
+static const unsigned fastForwardSpeeds[] = {2, 3, 4, 6, 8, 0};
+static uint32_t fastForwardSpeed = 5;
+// share of the frame time unlimited fast-forward spends on frames that aren't shown
+#define FAST_FORWARD_BUDGET 0.8
+
+// with the resampler the sound core runs at CLOCK_RATE / 256, so Blip_Buffer advances
+// a whole number of steps per clock, and is converted to the device rate
+#define RESAMPLER_INPUT_RATE 65536
+static const char *resamplerNames[] = {"Off", "Fast", "High quality"};
+static uint32_t audioResampler = 0;
+// turning it on or off restarts the sound core, so that waits until a game is started
+static bool resamplerActive = false;
+static uint32_t resamplerApplied = 0;
+// grown to what resamplerMaxOutput asks for, in frames
+static s16 *resampledWave = NULL;
+static unsigned resampledCapacity = 0;
+
+static const char *audioLatencyNames[] = {"Normal", "Low"};
+// clocks per video frame. Low latency has the sound core hand its sound over four
+// times a frame, so the short output periods are fed evenly instead of in bursts
+#define SOUND_FRAME_TICKS 280896
+#define SOUND_FRAME_TICKS_LOW (SOUND_FRAME_TICKS / 4)
+static uint32_t audioLatency = audioLatencyNormal;
+static uint32_t audioOverlay = 0;
+
+// performance hints of the game database replace the settings above
+static uint32_t useGameProfiles = 1;
+static const GameProfile *gameProfile = NULL;
+
 static char currentRomPath[PATH_LENGTH] = {'\0'};
 
 static Mutex videoLock;
@@ -85,20 +136,12 @@ static bool running = true;
 
 char filename_bios[0x100] = {0};
 
-#define AUDIO_SAMPLERATE 48000
-#define AUDIO_BUFFER_COUNT 6
-#define AUDIO_BUFFER_SAMPLES (AUDIO_SAMPLERATE / 20)
-#define AUDIO_TRANSFERBUF_SIZE (AUDIO_BUFFER_SAMPLES * 4)
-
-static int audioTransferBufferUsed = 0;
-static u32 *audioTransferBuffer;
-static Mutex audioLock;
-
 static unsigned libretro_save_size = sizeof(libretro_save_buf);
 
-uint32_t buttonMap[11] = {
+uint32_t buttonMap[12] = {
     KEY_A, KEY_B, KEY_MINUS, KEY_PLUS, KEY_RIGHT, KEY_LEFT, KEY_UP, KEY_DOWN, KEY_R, KEY_L,
-    KEY_ZR  // Speedhack Button
+    KEY_ZR,  // Speedhack Button
+    KEY_ZL   // Rewind Button
 };
 
 static bool has_video_frame;
@@ -109,6 +152,13 @@ static unsigned g_video_frames = 0;
 
 static unsigned serialize_size = 0;
 
+static u8 *runAheadState = NULL;
+static state_checkpoint_t runAheadCheckpoint;
+static bool discardVideo = false;
+static bool discardAudio = false;
+// set by the emulation thread when rolling back failed, reported by the UI thread
+static std::atomic<bool> runAheadFailed(false);
+
 static bool scan_area(const uint8_t *data, unsigned size) {
 	for (unsigned i = 0; i < size; i++)
 		if (data[i] != 0xff) return true;
@@ -152,6 +202,13 @@ void romPathWithExt(char *out, int outBufferLen, const char *ext) {
 	int dotLoc = strlen(out);
 	while (dotLoc >= 0 && out[dotLoc] != '.') dotLoc--;
 
+	// game.gba.gz shares its saves with game.gba
+	if (dotLoc > 0 && !strcasecmp(out + dotLoc, ".gz")) {
+		int innerLoc = dotLoc - 1;
+		while (innerLoc >= 0 && out[innerLoc] != '.' && out[innerLoc] != '/') innerLoc--;
+		if (innerLoc >= 0 && out[innerLoc] == '.') dotLoc = innerLoc;
+	}
+
 	int extLen = strlen(ext);
 	for (int i = 0; i < extLen + 1; i++) out[dotLoc + 1 + i] = ext[i];
 }
@@ -178,46 +235,40 @@ void retro_init(void) {
 #endif
 }
 
-static void load_image_preferences(void) {
-	char buffer[5];
-	buffer[0] = rom[0xac];
-	buffer[1] = rom[0xad];
-	buffer[2] = rom[0xae];
-	buffer[3] = rom[0xaf];
-	buffer[4] = 0;
-
-	bool found = false;
-	int found_no = 0;
-
-	for (int i = 0; i < 256; i++) {
-		if (!strcmp(gbaover[i].romid, buffer)) {
-			found = true;
-			found_no = i;
-			break;
-		}
-	}
+static void load_image_preferences(int romSize) {
+	const char *code = (const char *)rom + 0xac;
+	// hashing the whole image is only worth it when a specific dump is listed
+	u32 crc = gameDbNeedsCrc(code) ? utilCRC32(0, rom, romSize) : 0;
 
-	if (found) {
-		enableRtc = gbaover[found_no].rtcEnabled;
+	gameProfile = gameDbFind(code, crc);
+	if (!gameProfile) return;
 
-		if (gbaover[found_no].flashSize != 0)
-			flashSize = gbaover[found_no].flashSize;
-		else
-			flashSize = 65536;
+	if (gameProfile->rtcEnabled != -1) enableRtc = gameProfile->rtcEnabled;
+	if (gameProfile->flashSize != 0) flashSize = gameProfile->flashSize;
+	if (gameProfile->saveType != -1) cpuSaveType = gameProfile->saveType;
+	if (gameProfile->mirroringEnabled != -1) mirroringEnable = gameProfile->mirroringEnabled;
+}
 
-		cpuSaveType = gbaover[found_no].saveType;
+// the settings with the hints of the running game's profile applied, expects the emulation lock
+static void applyPerformanceSettings() {
+	const GameProfile *hints = useGameProfiles ? gameProfile : NULL;
 
-		mirroringEnable = gbaover[found_no].mirroringEnabled;
-	}
+	SetFrameskip(hints && hints->frameSkip != -1 ? hints->frameSkip : frameSkipValues[frameSkip]);
+	SetIdleLoopSkip(hints && hints->idleLoopSkip != -1 ? hints->idleLoopSkip : idleLoopSkip);
+	if (hints)
+		SetIdleLoopHints(hints->idleLoops.data(), hints->idleLoops.size());
+	else
+		SetIdleLoopHints(NULL, 0);
+	runAheadFrames = hints && hints->runAhead != -1 ? hints->runAhead : runAhead;
 }
 
-static void gba_init(void) {
+static void gba_init(int romSize) {
 	cpuSaveType = 0;
 	flashSize = 0x10000;
 	enableRtc = false;
 	mirroringEnable = false;
 
-	load_image_preferences();
+	load_image_preferences(romSize);
 
 	if (flashSize == 0x10000 || flashSize == 0x20000) flashSetSize(flashSize);
 
@@ -225,7 +276,14 @@ static void gba_init(void) {
 
 	doMirroring(mirroringEnable);
 
-	soundSetSampleRate(AUDIO_SAMPLERATE + 10); // slight oversampling makes the sound better
+	resamplerActive = audioResampler != 0;
+	resamplerApplied = audioResampler;
+	if (resamplerActive) {
+		soundSetSampleRate(RESAMPLER_INPUT_RATE);
+		resamplerInit(RESAMPLER_INPUT_RATE, AUDIO_SAMPLERATE + 10, (ResamplerQuality)(audioResampler - 1));
+	} else {
+		soundSetSampleRate(AUDIO_SAMPLERATE + 10); // slight oversampling makes the sound better
+	}
 
 #if HAVE_HLE_BIOS
 	bool usebios = false;
@@ -256,6 +314,11 @@ static void gba_init(void) {
 	uint8_t *state_buf = (uint8_t *)malloc(2000000);
 	serialize_size = CPUWriteState(state_buf, 2000000);
 	free(state_buf);
+
+	saveStateSetSize(serialize_size);
+	runAheadState = (u8 *)realloc(runAheadState, serialize_size);
+	memset(&runAheadCheckpoint, 0, sizeof(runAheadCheckpoint));
+	rewindReset(serialize_size);
 }
 
 void retro_deinit(void) {
@@ -274,13 +337,10 @@ void pause_emulation() {
 	uiPushState(statePaused);
 	char saveFilename[PATH_LENGTH];
 	romPathWithExt(saveFilename, PATH_LENGTH, "sav");
-	if (CPUWriteBatteryFile(saveFilename)) uiStatusMsg("Wrote save file.");
+	batteryFlush(saveFilename, true);
 	mutexUnlock(&emulationLock);
 
-	mutexLock(&audioLock);
-	memset(audioTransferBuffer, 0, AUDIO_TRANSFERBUF_SIZE * sizeof(u32));
-	audioTransferBufferUsed = AUDIO_TRANSFERBUF_SIZE;
-	mutexUnlock(&audioLock);
+	audioClear();
 }
 
 void unpause_emulation() {
@@ -290,6 +350,15 @@ void unpause_emulation() {
 	mutexUnlock(&emulationLock);
 }
 
+static void run_frame() {
+	has_video_frame = false;
+	audio_samples_written = 0;
+	UpdateJoypad();
+	do {
+		CPULoop();
+	} while (!has_video_frame);
+}
+
 void retro_run() {
 	mutexLock(&inputLock);
 	joy = 0;
@@ -300,22 +369,94 @@ void retro_run() {
 
 	mutexUnlock(&inputLock);
 
-	has_video_frame = false;
-	audio_samples_written = 0;
-	UpdateJoypad();
-	do {
-		CPULoop();
-	} while (!has_video_frame);
+	if (!runAheadFrames || !runAheadState) {
+		run_frame();
+		return;
+	}
+
+	// run the real frame without showing it, then the frames ahead with the same
+	// input and present the last one. Rolling back keeps the audio of the real frame
+	discardVideo = true;
+	run_frame();
+
+	soundFlush();
+	soundSaveMixer();
+	CPUWriteStateIncremental(runAheadState, serialize_size, &runAheadCheckpoint);
+
+	discardAudio = true;
+	for (unsigned i = 0; i < runAheadFrames; i++) {
+		discardVideo = i + 1 < runAheadFrames;
+		run_frame();
+	}
+	discardAudio = false;
+
+	if (!CPUReadStateIncremental(runAheadState, serialize_size, &runAheadCheckpoint)) {
+		// the game stays where the frames ahead left it, only without run-ahead from now on
+		runAheadFrames = 0;
+		memset(&runAheadCheckpoint, 0, sizeof(runAheadCheckpoint));
+		runAheadFailed.store(true, std::memory_order_relaxed);
+		return;
+	}
+	soundRestoreMixer();
+}
+
+// one step of fast-forward: the frames in between are neither rendered nor
+// synthesized, and only the last one is shown and heard, so the sound keeps its pitch
+static void fast_forward(double startTime) {
+	unsigned speed = fastForwardSpeeds[fastForwardSpeed];
+	double deadline = startTime + TARGET_FRAMETIME * FAST_FORWARD_BUDGET;
+
+	SetFrameRendering(false);
+	soundSetSynthesis(false);
+	discardVideo = true;
+	for (unsigned i = 1; speed ? i < speed : (double)svcGetSystemTick() * SECONDS_PER_TICKS < deadline; i++) run_frame();
+	discardVideo = false;
+	soundSetSynthesis(true);
+	SetFrameRendering(true);
+
+	retro_run();
+}
+
+static void stop_recording() {
+	RecorderStats stats;
+	recorderStop(&stats);
+	if (stats.failed)
+		uiStatusMsg("Failed to write the recording, kept %u frames", stats.frames);
+	else
+		uiStatusMsg("Recorded %u frames, %u dropped", stats.frames, stats.droppedFrames);
+}
+
+static void start_recording() {
+	char stamp[32];
+	time_t now = time(NULL);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", gmtime(&now));
+
+	char ext[48];
+	char videoFilename[PATH_LENGTH];
+	char soundFilename[PATH_LENGTH];
+	snprintf(ext, sizeof(ext), "%s.gbv", stamp);
+	romPathWithExt(videoFilename, PATH_LENGTH, ext);
+	snprintf(ext, sizeof(ext), "%s.wav", stamp);
+	romPathWithExt(soundFilename, PATH_LENGTH, ext);
+
+	// taken after the resampler, which runs at the rate the sound core is set to without it
+	if (recorderStart(videoFilename, soundFilename, AUDIO_SAMPLERATE + 10))
+		uiStatusMsg("Recording to %s", videoFilename);
+	else
+		uiStatusMsg("Failed to start recording %s", videoFilename);
 }
 
 bool retro_load_game() {
 	int ret = CPULoadRom(currentRomPath);
 
-	gba_init();
+	gba_init(ret);
 
 	char saveFileName[PATH_LENGTH];
 	romPathWithExt(saveFileName, PATH_LENGTH, "sav");
-	if (CPUReadBatteryFile(saveFileName)) uiStatusMsg("Loaded save file.");
+	batteryRecover(saveFileName);
+	bool loaded = CPUReadBatteryFile(saveFileName);
+	if (loaded) uiStatusMsg("Loaded save file.");
+	batteryLoaded(loaded);
 
 	return ret;
 }
@@ -323,77 +464,62 @@ bool retro_load_game() {
 void retro_unload_game(void) {
 	printf("[VBA] Sync stats: Audio frames: %u, Video frames: %u, AF/VF: %.2f\n", g_audio_frames, g_video_frames,
 	       (float)g_audio_frames / g_video_frames);
+
+	AudioStats audioStats;
+	audioGetStats(&audioStats);
+	printf("[VBA] Audio stats: %u periods of %u frames, latency %.1fms, underruns: %u\n", audioStats.periods,
+	       audioStats.periodFrames, audioStats.latency * 1000, audioStats.underruns);
+	printf("[VBA] Audio frames: written %llu, dropped %llu, played %llu, silence %llu\n",
+	       (unsigned long long)audioStats.written, (unsigned long long)audioStats.dropped, (unsigned long long)audioStats.played,
+	       (unsigned long long)audioStats.silence);
 	g_audio_frames = 0;
 	g_video_frames = 0;
 
-	char saveFilename[PATH_LENGTH];
-	romPathWithExt(saveFilename, PATH_LENGTH, "sav");
-	if (CPUWriteBatteryFile(saveFilename)) uiStatusMsg("Wrote save file.");
-}
-
-void audio_thread_main(void *) {
-	AudioOutBuffer sources[2];
-
-	u32 raw_data_size = (AUDIO_BUFFER_SAMPLES * sizeof(u32) + 0xfff) & ~0xfff;
-	u32 *raw_data[2];
-	for (int i = 0; i < 2; i++) {
-		raw_data[i] = (u32 *)memalign(0x1000, raw_data_size);
-		memset(raw_data[i], 0, raw_data_size);
-
-		sources[i].next = 0;
-		sources[i].buffer = raw_data[i];
-		sources[i].buffer_size = raw_data_size;
-		sources[i].data_size = AUDIO_BUFFER_SAMPLES * sizeof(u32);
-		sources[i].data_offset = 0;
-
-		audoutAppendAudioOutBuffer(&sources[i]);
-	}
-
-	while (running) {
-		u32 count;
-		AudioOutBuffer *released;
-		audoutWaitPlayFinish(&released, &count, U64_MAX);
-
-		mutexLock(&audioLock);
-
-		u32 size = (audioTransferBufferUsed < AUDIO_BUFFER_SAMPLES ? audioTransferBufferUsed : AUDIO_BUFFER_SAMPLES) * sizeof(u32);
-		memcpy(released->buffer, audioTransferBuffer, size);
-		released->data_size = size == 0 ? AUDIO_BUFFER_SAMPLES * sizeof(u32) : size;
-
-		audioTransferBufferUsed -= size / sizeof(u32);
-		memmove(audioTransferBuffer, audioTransferBuffer + (size / sizeof(u32)), audioTransferBufferUsed * sizeof(u32));
-
-		mutexUnlock(&audioLock);
+	if (recorderActive()) stop_recording();
 
-		audoutAppendAudioOutBuffer(released);
-	}
+	gameProfile = NULL;
 
-	free(raw_data[0]);
-	free(raw_data[1]);
+	char saveFilename[PATH_LENGTH];
+	romPathWithExt(saveFilename, PATH_LENGTH, "sav");
+	batteryFlush(saveFilename, true);
 }
 
 void systemOnWriteDataToSoundBuffer(int16_t *finalWave, int length) {
-	mutexLock(&audioLock);
-	if (audioTransferBufferUsed + length >= AUDIO_TRANSFERBUF_SIZE) {
-		mutexUnlock(&audioLock);
-		return;
+	if (discardAudio) return;
+
+	if (resamplerActive) {
+		// keeps the output queue at its target instead of dropping what doesn't fit
+		resamplerSetRatio(audioRateAdjust());
+		unsigned needed = resamplerMaxOutput(length / 2);
+		if (needed > resampledCapacity) {
+			s16 *grown = (s16 *)realloc(resampledWave, needed * 2 * sizeof(s16));
+			// without it the rest of the block is cut off
+			if (grown) {
+				resampledWave = grown;
+				resampledCapacity = needed;
+			}
+		}
+		length = resamplerProcess(finalWave, length / 2, resampledWave, resampledCapacity) * 2;
+		finalWave = resampledWave;
 	}
 
-	memcpy(audioTransferBuffer + audioTransferBufferUsed, finalWave, length * sizeof(s16));
-
-	audioTransferBufferUsed += length / 2;
-	mutexUnlock(&audioLock);
+	audioWrite(finalWave, length / 2);
+	recorderSound(finalWave, length / 2);
 
 	g_audio_frames += length / 2;
 }
 
 void systemDrawScreen() {
+	has_video_frame = true;
+	if (discardVideo) return;
+
 	mutexLock(&videoLock);
 	memcpy(videoTransferBuffer, pix, sizeof(u16) * 256 * 160);
 	mutexUnlock(&videoLock);
 
+	recorderVideo(pix);
+
 	g_video_frames++;
-	has_video_frame = true;
 }
 
 void threadFunc(void *args) {
@@ -406,13 +532,26 @@ void threadFunc(void *args) {
 
 		mutexLock(&emulationLock);
 
-		if (emulationRunning && !emulationPaused) retro_run();
+		if (emulationRunning && !emulationPaused) {
+			if (inputTransferKeysHeld & buttonMap[11]) {
+				// step back one capture and run a frame to get a picture of it
+				if (rewindStep()) retro_run();
+			} else {
+				if (inputTransferKeysHeld & buttonMap[10])
+					fast_forward(startTime);
+				else
+					retro_run();
+				rewindCapture();
+			}
+		}
 
 		mutexUnlock(&emulationLock);
 
 		double endTime = (double)svcGetSystemTick() * SECONDS_PER_TICKS;
 
-		if (!(inputTransferKeysHeld & buttonMap[10])) condvarWaitTimeout(&requestFrameCond, TARGET_FRAMETIME * 1000000000);
+		// a fast-forward step that took a whole frame time has missed the wakeup already
+		bool fastForwardLate = (inputTransferKeysHeld & buttonMap[10]) && endTime - startTime >= TARGET_FRAMETIME;
+		if (!fastForwardLate) condvarWaitTimeout(&requestFrameCond, TARGET_FRAMETIME * 1000000000);
 	}
 
 	mutexLock(&emulationLock);
@@ -422,7 +561,14 @@ void threadFunc(void *args) {
 
 static void applyConfig() {
 	mutexLock(&emulationLock);
-	SetFrameskip(frameSkipValues[frameSkip]);
+	applyPerformanceSettings();
+
+	if (resamplerActive && audioResampler && audioResampler != resamplerApplied) {
+		resamplerInit(RESAMPLER_INPUT_RATE, AUDIO_SAMPLERATE + 10, (ResamplerQuality)(audioResampler - 1));
+		resamplerApplied = audioResampler;
+	}
+	audioSetLatency((AudioLatency)audioLatency);
+	soundSetFrameLength(audioLatency == audioLatencyLow ? SOUND_FRAME_TICKS_LOW : SOUND_FRAME_TICKS);
 
 	if (!disableAnalogStick) {
 		buttonMap[4] = KEY_RIGHT;
@@ -440,16 +586,43 @@ static void applyConfig() {
 		buttonMap[8] = KEY_R;
 		buttonMap[9] = KEY_L;
 		buttonMap[10] = KEY_ZR;
+		buttonMap[11] = KEY_ZL;
 	} else {
 		buttonMap[8] = KEY_ZR;
 		buttonMap[9] = KEY_ZL;
 		buttonMap[10] = KEY_R;
+		buttonMap[11] = KEY_L;
 	}
+
+	rewindConfigure(rewindBudgets[rewindBuffer], REWIND_INTERVAL);
 	mutexUnlock(&emulationLock);
 }
 
 u32 __nx_applet_PerformanceConfiguration[2] = {/*0x92220008*/ /*0x20004*/ /*0x92220007*/ 0x92220007, 0x92220007};
 
+static void drawAudioOverlay() {
+	AudioStats stats;
+	audioGetStats(&stats);
+
+	const u32 x = 20, lineHeight = 22;
+	u32 y = 35;
+	drawRect(x - 10, y - 25, 470, lineHeight * 5 + 10, MakeColor(0, 0, 0, 160));
+
+	drawText(font14, x, y, COLOR_WHITE, "Queue %u / %u frames, %u periods of %u", stats.queued, stats.queueLimit, stats.periods,
+		 stats.periodFrames);
+	y += lineHeight;
+	drawText(font14, x, y, COLOR_WHITE, "Latency %.1f ms, peak %.1f ms", stats.latency * 1000, stats.maxLatency * 1000);
+	y += lineHeight;
+	drawText(font14, x, y, COLOR_WHITE, "Written %llu, played %llu", (unsigned long long)stats.written,
+		 (unsigned long long)stats.played);
+	y += lineHeight;
+	drawText(font14, x, y, COLOR_WHITE, "Dropped %llu, silence %llu, underruns %u", (unsigned long long)stats.dropped,
+		 (unsigned long long)stats.silence, stats.underruns);
+	y += lineHeight;
+	drawText(font14, x, y, COLOR_WHITE, "Rate ratio %.4f, AF/VF %.1f", stats.rateRatio,
+		 g_video_frames ? (float)g_audio_frames / g_video_frames : 0.f);
+}
+
 int main(int argc, char *argv[]) {
 	appletSetScreenShotPermission(1);
 
@@ -474,25 +647,29 @@ int main(int argc, char *argv[]) {
 	timeInitialize();
 	cheatListInit();
 
-	audioTransferBuffer = (u32 *)malloc(AUDIO_TRANSFERBUF_SIZE * sizeof(u32));
-	mutexInit(&audioLock);
-
-	audoutInitialize();
-	audoutStartAudioOut();
-
-	Thread audio_thread;
-	threadCreate(&audio_thread, audio_thread_main, NULL, 0x10000, 0x2B, 2);
-	threadStart(&audio_thread);
+	audioInit((AudioLatency)audioLatency);
 
 	videoTransferBuffer = (u16 *)malloc(256 * 160 * sizeof(u16));
 	conversionBuffer = (u32 *)malloc(256 * 160 * sizeof(u32));
 
 	mutexInit(&videoLock);
 
+	saveStateInit();
+	batteryInit();
+	gameDbInit();
+
 	uiInit();
 
 	uiAddSetting("Screen scaling method", &scalingFilter, filtersCount, filterStrNames);
 	uiAddSetting("Frameskip", &frameSkip, sizeof(frameSkipValues) / sizeof(frameSkipValues[0]), frameSkipNames);
+	uiAddSetting("Skip idle loops", &idleLoopSkip, 2, stringsNoYes);
+	uiAddSetting("Run-ahead", &runAhead, sizeof(runAheadNames) / sizeof(runAheadNames[0]), runAheadNames);
+	uiAddSetting("Fast-forward speed", &fastForwardSpeed, sizeof(fastForwardNames) / sizeof(fastForwardNames[0]), fastForwardNames);
+	uiAddSetting("Use game profiles", &useGameProfiles, 2, stringsNoYes);
+	uiAddSetting("Audio resampler", &audioResampler, sizeof(resamplerNames) / sizeof(resamplerNames[0]), resamplerNames);
+	uiAddSetting("Audio latency", &audioLatency, audioLatencyCount, audioLatencyNames);
+	uiAddSetting("Show audio stats", &audioOverlay, 2, stringsNoYes);
+	uiAddSetting("Rewind buffer", &rewindBuffer, sizeof(rewindNames) / sizeof(rewindNames[0]), rewindNames);
 	uiAddSetting("Disable analog stick", &disableAnalogStick, 2, stringsNoYes);
 	uiAddSetting("L R -> ZL ZR", &switchRLButtons, 2, stringsNoYes);
 	uiAddSetting("In game clock offset", &rtcOffset, 26, stringsRtcOffset);
@@ -619,9 +796,16 @@ int main(int argc, char *argv[]) {
 			}
 		}
 
+		if (audioOverlay && emulationRunning && !emulationPaused) drawAudioOverlay();
+
 		bool actionStopEmulation = false;
 		bool actionStartEmulation = false;
 
+		saveStatePoll();
+		batteryPoll();
+		recorderPoll();
+		if (runAheadFailed.exchange(false, std::memory_order_relaxed)) uiStatusMsg("Rolling back failed, run-ahead turned off");
+
 		uiDraw(keysDown);
 
 		UIResult result;
@@ -654,36 +838,27 @@ int main(int argc, char *argv[]) {
 				char stateFilename[PATH_LENGTH];
 				romPathWithExt(stateFilename, PATH_LENGTH, "ram");
 
-				u8 *buffer = (u8 *)malloc(serialize_size);
-
 				if (result == resultLoadState) {
-					FILE *f = fopen(stateFilename, "rb");
-
-					if (f) {
-						if (fread(buffer, 1, serialize_size, f) != serialize_size ||
-						    !CPUReadState(buffer, serialize_size))
-							uiStatusMsg("Failed to read save state %s", stateFilename);
-
-						fclose(f);
-					} else
-						printf("Failed to open %s for read", stateFilename);
+					if (saveStateRead(stateFilename))
+						uiStatusMsg("Loaded save state %s", stateFilename);
+					else
+						uiStatusMsg("Failed to read save state %s", stateFilename);
 				} else {
-					if (!CPUWriteState(buffer, serialize_size))
+					// only snapshots here, the worker reports when the file is written
+					if (!saveStateWrite(stateFilename))
 						uiStatusMsg("Failed to write save state %s", stateFilename);
-
-					FILE *f = fopen(stateFilename, "wb");
-
-					if (f) {
-						if (fwrite(buffer, 1, serialize_size, f) != serialize_size)
-							printf("Failed to write to %s", stateFilename);
-						fclose(f);
-					} else
-						printf("Failed to open %s for write", stateFilename);
 				}
 
-				free(buffer);
 				mutexUnlock(&emulationLock);
 			} break;
+			case resultToggleRecording:
+				mutexLock(&emulationLock);
+				if (recorderActive())
+					stop_recording();
+				else
+					start_recording();
+				mutexUnlock(&emulationLock);
+				break;
 			case resultSaveSettings:
 				applyConfig();
 				uiSaveSettings();
@@ -724,7 +899,7 @@ int main(int argc, char *argv[]) {
 
 			retro_load_game();
 
-			SetFrameskip(frameSkipValues[frameSkip]);
+			applyPerformanceSettings();
 
 			emulationRunning = true;
 			emulationPaused = false;
@@ -739,7 +914,7 @@ int main(int argc, char *argv[]) {
 
 		if (emulationRunning && !emulationPaused && --autosaveCountdown == 0) {
 			mutexLock(&emulationLock);
-			CPUWriteBatteryFile(saveFilename);
+			batteryFlush(saveFilename, false);
 			mutexUnlock(&emulationLock);
 		}
 
@@ -754,6 +929,14 @@ int main(int argc, char *argv[]) {
 		if (frameTimeSum >= 1) {
 			printf("avg. frametime %fms\n", 1000.0 * (frameTimeSum / (double)frameTimeFrames));
 
+			AudioStats audioStats;
+			audioGetStats(&audioStats);
+			printf("audio latency %.1fms (peak %.1fms), period %u frames, %u underruns\n", audioStats.latency * 1000,
+			       audioStats.maxLatency * 1000, audioStats.periodFrames, audioStats.underruns);
+			printf("audio queue %u/%u, rate ratio %.4f, dropped %llu, silence %llu\n", audioStats.queued,
+			       audioStats.queueLimit, audioStats.rateRatio, (unsigned long long)audioStats.dropped,
+			       (unsigned long long)audioStats.silence);
+
 			frameTimeSum = 0;
 			frameTimeFrames = 0;
 		}
@@ -767,19 +950,20 @@ int main(int argc, char *argv[]) {
 	threadWaitForExit(&mainThread);
 	threadClose(&mainThread);
 
+	saveStateDeinit();
+	batteryDeinit();
+	rewindDeinit();
+	resamplerDeinit();
+	free(resampledWave);
+	free(runAheadState);
+
 	uiDeinit();
 
 	cheatListDeinit();
 	free(conversionBuffer);
 	free(videoTransferBuffer);
 
-	threadWaitForExit(&audio_thread);
-	threadClose(&audio_thread);
-
-	audoutStopAudioOut();
-	audoutExit();
-
-	free(audioTransferBuffer);
+	audioDeinit();
 
 	fontExit();
 
@@ -0,0 +1,282 @@
+#include "recorder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "ui.h"
+#include "xordelta.h"
+
+#define FRAME_WIDTH 240
+#define FRAME_HEIGHT 160
+#define FRAME_STRIDE 256
+// pixel pairs, the unit of the delta
+#define FRAME_WORDS (FRAME_STRIDE * FRAME_HEIGHT / 2)
+
+// 16.78 MHz over 280896 cycles per frame
+#define FRAME_RATE_NUM 16777216
+#define FRAME_RATE_DEN 280896
+
+// both powers of two so the free running ring indices can wrap
+// about 130 ms of video and 1.3 s of sound to ride out a stall of the SD card
+#define VIDEO_SLOTS 8
+#define SOUND_FRAMES 65536
+
+#define FILE_BUFFER_SIZE (256 * 1024)
+#define IDLE_NANOSECONDS 2000000ULL
+
+typedef struct {
+	char riff[4];
+	u32 riffSize;
+	char wave[4];
+	char fmt[4];
+	u32 fmtSize;
+	u16 format;
+	u16 channels;
+	u32 sampleRate;
+	u32 byteRate;
+	u16 blockAlign;
+	u16 bitsPerSample;
+	char data[4];
+	u32 dataSize;
+} wav_header_t;
+
+static Thread writerThread;
+static std::atomic<bool> writerQuit(false);
+
+// only changed with the emulation lock held, so the emulation thread sees it between frames
+static bool recording = false;
+
+static u32 *videoSlots = NULL;
+static u32 slotFrames[VIDEO_SLOTS];
+static std::atomic<unsigned> videoWrite(0);
+static std::atomic<unsigned> videoRead(0);
+static unsigned frameCounter = 0;
+
+static u32 *soundRing = NULL;
+static std::atomic<unsigned> soundWrite(0);
+static std::atomic<unsigned> soundRead(0);
+
+static std::atomic<unsigned> droppedFrames(0);
+static unsigned droppedSoundFrames = 0;
+static unsigned reportedDrops = 0;
+
+// owned by the writer thread while recording
+static FILE *videoFile = NULL;
+static FILE *soundFile = NULL;
+static char *videoFileBuffer = NULL;
+static char *soundFileBuffer = NULL;
+static u32 *previousFrame = NULL;
+static u8 *deltaBuffer = NULL;
+static unsigned framesWritten = 0;
+static u32 soundBytes = 0;
+static unsigned soundRate = 0;
+static bool writeFailed = false;
+
+static void writeData(FILE *f, const void *data, size_t size) {
+	if (!writeFailed && fwrite(data, 1, size, f) != size) writeFailed = true;
+}
+
+static void writeWavHeader() {
+	wav_header_t header = {{'R', 'I', 'F', 'F'}, 36 + soundBytes, {'W', 'A', 'V', 'E'}, {'f', 'm', 't', ' '}, 16, 1, 2,
+	                       soundRate, soundRate * 4, 4, 16, {'d', 'a', 't', 'a'}, soundBytes};
+	writeData(soundFile, &header, sizeof(header));
+}
+
+static bool writeFrame() {
+	unsigned read = videoRead.load(std::memory_order_relaxed);
+	if (read == videoWrite.load(std::memory_order_acquire)) return false;
+
+	unsigned slot = read % VIDEO_SLOTS;
+	const u32 *frame = videoSlots + slot * FRAME_WORDS;
+	recorder_frame_header_t header = {slotFrames[slot], (u32)xorDeltaEncode(previousFrame, frame, FRAME_WORDS, deltaBuffer)};
+	memcpy(previousFrame, frame, FRAME_WORDS * sizeof(u32));
+	videoRead.store(read + 1, std::memory_order_release);
+
+	writeData(videoFile, &header, sizeof(header));
+	writeData(videoFile, deltaBuffer, header.size);
+	framesWritten++;
+	return true;
+}
+
+static bool writeSound() {
+	unsigned read = soundRead.load(std::memory_order_relaxed);
+	unsigned available = soundWrite.load(std::memory_order_acquire) - read;
+	if (!available) return false;
+
+	// up to the end of the ring, the rest goes next time
+	unsigned start = read % SOUND_FRAMES;
+	if (available > SOUND_FRAMES - start) available = SOUND_FRAMES - start;
+
+	writeData(soundFile, soundRing + start, available * sizeof(u32));
+	soundBytes += available * sizeof(u32);
+	soundRead.store(read + available, std::memory_order_release);
+	return true;
+}
+
+static void writerMain(void *) {
+	while (true) {
+		// read before draining, so whatever was queued before the stop still gets written
+		bool quit = writerQuit.load(std::memory_order_acquire);
+
+		bool busy = writeFrame();
+		busy = writeSound() || busy;
+
+		if (!busy) {
+			if (quit) break;
+			svcSleepThread(IDLE_NANOSECONDS);
+		}
+	}
+}
+
+static void freeBuffers() {
+	free(videoSlots);
+	free(soundRing);
+	free(previousFrame);
+	free(deltaBuffer);
+	free(videoFileBuffer);
+	free(soundFileBuffer);
+	videoSlots = previousFrame = soundRing = NULL;
+	deltaBuffer = NULL;
+	videoFileBuffer = soundFileBuffer = NULL;
+}
+
+static void closeFiles() {
+	if (videoFile && fclose(videoFile) != 0) writeFailed = true;
+	if (soundFile && fclose(soundFile) != 0) writeFailed = true;
+	videoFile = soundFile = NULL;
+}
+
+bool recorderStart(const char *videoFilename, const char *soundFilename, unsigned sampleRate) {
+	if (recording) return false;
+
+	videoSlots = (u32 *)malloc(VIDEO_SLOTS * FRAME_WORDS * sizeof(u32));
+	soundRing = (u32 *)malloc(SOUND_FRAMES * sizeof(u32));
+	previousFrame = (u32 *)calloc(FRAME_WORDS, sizeof(u32));
+	deltaBuffer = (u8 *)malloc(xorDeltaBound(FRAME_WORDS));
+	videoFileBuffer = (char *)malloc(FILE_BUFFER_SIZE);
+	soundFileBuffer = (char *)malloc(FILE_BUFFER_SIZE);
+	if (!videoSlots || !soundRing || !previousFrame || !deltaBuffer || !videoFileBuffer || !soundFileBuffer) {
+		freeBuffers();
+		return false;
+	}
+
+	videoFile = fopen(videoFilename, "wb");
+	soundFile = fopen(soundFilename, "wb");
+	if (!videoFile || !soundFile) {
+		printf("Failed to open %s or %s for write\n", videoFilename, soundFilename);
+		closeFiles();
+		freeBuffers();
+		return false;
+	}
+	setvbuf(videoFile, videoFileBuffer, _IOFBF, FILE_BUFFER_SIZE);
+	setvbuf(soundFile, soundFileBuffer, _IOFBF, FILE_BUFFER_SIZE);
+
+	writeFailed = false;
+	framesWritten = 0;
+	soundBytes = 0;
+	soundRate = sampleRate;
+
+	recorder_video_header_t header = {RECORDER_VIDEO_MAGIC, FRAME_WIDTH, FRAME_HEIGHT, FRAME_STRIDE, 0, FRAME_RATE_NUM,
+	                                  FRAME_RATE_DEN};
+	writeData(videoFile, &header, sizeof(header));
+	// patched with the sizes when the recording stops
+	writeWavHeader();
+
+	videoWrite.store(0);
+	videoRead.store(0);
+	soundWrite.store(0);
+	soundRead.store(0);
+	frameCounter = 0;
+	droppedFrames.store(0);
+	droppedSoundFrames = 0;
+	reportedDrops = 0;
+
+	writerQuit.store(false);
+	Result rc = threadCreate(&writerThread, writerMain, NULL, 0x4000, 0x3B, -2);
+	if (R_SUCCEEDED(rc)) {
+		rc = threadStart(&writerThread);
+		if (R_FAILED(rc)) threadClose(&writerThread);
+	}
+	if (R_FAILED(rc)) {
+		printf("Failed to start the recording thread: %x\n", rc);
+		// nothing but the headers was written
+		closeFiles();
+		remove(videoFilename);
+		remove(soundFilename);
+		freeBuffers();
+		return false;
+	}
+
+	recording = true;
+	return true;
+}
+
+void recorderStop(RecorderStats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	if (!recording) return;
+
+	recording = false;
+	writerQuit.store(true, std::memory_order_release);
+	threadWaitForExit(&writerThread);
+	threadClose(&writerThread);
+
+	if (fseek(soundFile, 0, SEEK_SET) == 0)
+		writeWavHeader();
+	else
+		writeFailed = true;
+	closeFiles();
+	freeBuffers();
+
+	stats->frames = framesWritten;
+	stats->droppedFrames = droppedFrames.load();
+	stats->droppedSoundFrames = droppedSoundFrames;
+	stats->failed = writeFailed;
+}
+
+bool recorderActive() { return recording; }
+
+void recorderVideo(const u16 *pixels) {
+	if (!recording) return;
+
+	unsigned frame = frameCounter++;
+	unsigned write = videoWrite.load(std::memory_order_relaxed);
+	if (write - videoRead.load(std::memory_order_acquire) == VIDEO_SLOTS) {
+		droppedFrames.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	unsigned slot = write % VIDEO_SLOTS;
+	memcpy(videoSlots + slot * FRAME_WORDS, pixels, FRAME_WORDS * sizeof(u32));
+	slotFrames[slot] = frame;
+	videoWrite.store(write + 1, std::memory_order_release);
+}
+
+void recorderSound(const s16 *samples, unsigned frames) {
+	if (!recording) return;
+
+	unsigned write = soundWrite.load(std::memory_order_relaxed);
+	unsigned used = write - soundRead.load(std::memory_order_acquire);
+	if (frames > SOUND_FRAMES - used) {
+		droppedSoundFrames += frames;
+		return;
+	}
+
+	unsigned start = write % SOUND_FRAMES;
+	unsigned first = frames < SOUND_FRAMES - start ? frames : SOUND_FRAMES - start;
+	memcpy(soundRing + start, samples, first * sizeof(u32));
+	memcpy(soundRing, samples + first * 2, (frames - first) * sizeof(u32));
+	soundWrite.store(write + frames, std::memory_order_release);
+}
+
+void recorderPoll() {
+	if (!recording) return;
+
+	unsigned dropped = droppedFrames.load(std::memory_order_relaxed);
+	if (dropped != reportedDrops) {
+		uiStatusMsg("Recording can't keep up, %u frames dropped", dropped);
+		reportedDrops = dropped;
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <switch.h>
+
+/*
+    Records the shown video frames and the played sound to disk. The emulation
+    thread only copies into preallocated single producer, single consumer rings,
+    a writer thread compresses and writes them out. A frame or a block of sound
+    that finds its ring full is dropped and counted, the emulation never waits
+    for the SD card.
+
+    Video goes to a .gbv file: a recorder_video_header_t, then per frame a
+    recorder_frame_header_t and the frame as a delta against the previous
+    recorded one, in the format of xordelta.h with a word per pixel pair.
+    Dropped frames show up as gaps in the frame numbers.
+
+    Sound goes to a 16 bit stereo .wav file.
+
+    recorderStart/recorderStop expect the caller to hold the emulation lock.
+*/
+
+#define RECORDER_VIDEO_MAGIC 0x31564247  // "GBV1"
+
+typedef struct {
+	u32 magic;
+	u16 width, height;
+	// in pixels, BGR555
+	u16 stride;
+	u16 reserved;
+	// frames per second as a fraction
+	u32 rateNum, rateDen;
+} recorder_video_header_t;
+
+typedef struct {
+	u32 frame;
+	u32 size;
+} recorder_frame_header_t;
+
+struct RecorderStats {
+	unsigned frames;
+	unsigned droppedFrames;
+	unsigned droppedSoundFrames;
+	// a write to disk failed, everything after it is lost
+	bool failed;
+};
+
+bool recorderStart(const char *videoFilename, const char *soundFilename, unsigned sampleRate);
+// waits for the writer to catch up and closes the files
+void recorderStop(RecorderStats *stats);
+bool recorderActive();
+
+// from the emulation thread, 256x160 BGR555 and interleaved stereo frames
+void recorderVideo(const u16 *pixels);
+void recorderSound(const s16 *samples, unsigned frames);
+
+// reports newly dropped frames through uiStatusMsg, call from the UI thread only
+void recorderPoll();
@@ -0,0 +1,202 @@
+#include "resampler.h"
+
+#include <arm_neon.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// position in input frames, 32.32 fixed point
+#define POSITION_ONE (1ULL << 32)
+
+static const struct {
+	unsigned taps;  // multiple of 8
+	unsigned phaseBits;
+	double beta;     // Kaiser window shape, higher means more stopband attenuation
+	double passband;  // cutoff relative to the lower Nyquist frequency
+} qualities[resamplerQualityCount] = {
+    {16, 6, 6.0, 0.80},
+    {32, 8, 8.5, 0.90},
+};
+
+static unsigned inputRate = 0;
+static unsigned outputRate = 0;
+static unsigned taps = 0;
+static unsigned phaseBits = 0;
+static s16 *coefficients = NULL;  // one row of taps per phase
+
+static u64 position = 0;
+static u64 step = 0;
+
+// deinterleaved input, the oldest frame still needed first
+static s16 *history[2] = {NULL, NULL};
+static unsigned historyFrames = 0;
+static unsigned historyCapacity = 0;
+
+static double besselI0(double x) {
+	double sum = 1, term = 1;
+	for (int k = 1; k < 32; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void buildFilter(double beta, double passband) {
+	unsigned phases = 1 << phaseBits;
+	double cutoff = 0.5 * passband * (outputRate < inputRate ? (double)outputRate / inputRate : 1.0);
+	double half = taps / 2.0;
+	double windowScale = 1 / besselI0(beta);
+
+	double row[taps];
+	for (unsigned phase = 0; phase < phases; phase++) {
+		// output frame sits between taps taps / 2 - 1 and taps / 2, phase / phases past the first
+		double frac = (double)phase / phases;
+		double sum = 0;
+		for (unsigned k = 0; k < taps; k++) {
+			double x = k - (half - 1) - frac;
+			double sinc = x == 0 ? 1 : sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+			double w = x / half;
+			double window = fabs(w) < 1 ? besselI0(beta * sqrt(1 - w * w)) * windowScale : 0;
+			row[k] = 2 * cutoff * sinc * window;
+			sum += row[k];
+		}
+
+		// unity gain at DC for every phase, rounding error goes to the center tap
+		s16 *coef = coefficients + phase * taps;
+		int total = 0;
+		for (unsigned k = 0; k < taps; k++) {
+			coef[k] = (s16)lrint(row[k] / sum * 32768);
+			total += coef[k];
+		}
+		coef[taps / 2 - 1] += 32768 - total;
+	}
+}
+
+static void freeHistory() {
+	free(history[0]);
+	free(history[1]);
+	history[0] = history[1] = NULL;
+	historyFrames = historyCapacity = 0;
+}
+
+bool resamplerInit(unsigned inRate, unsigned outRate, ResamplerQuality quality) {
+	resamplerDeinit();
+
+	inputRate = inRate;
+	outputRate = outRate;
+	taps = qualities[quality].taps;
+	phaseBits = qualities[quality].phaseBits;
+
+	coefficients = (s16 *)malloc((taps << phaseBits) * sizeof(s16));
+	if (!coefficients) return false;
+
+	buildFilter(qualities[quality].beta, qualities[quality].passband);
+	resamplerSetRatio(1.0);
+	resamplerReset();
+	return true;
+}
+
+void resamplerDeinit() {
+	free(coefficients);
+	coefficients = NULL;
+	freeHistory();
+}
+
+void resamplerReset() {
+	historyFrames = 0;
+	position = 0;
+}
+
+void resamplerSetRatio(double adjust) {
+	if (adjust < 0.5) adjust = 0.5;
+	if (adjust > 2.0) adjust = 2.0;
+	step = (u64)((double)inputRate / outputRate * adjust * POSITION_ONE);
+}
+
+unsigned resamplerMaxOutput(unsigned inFrames) {
+	u64 end = (u64)(historyFrames + inFrames) << 32;
+	return end > position ? (end - position) / step + 1 : 0;
+}
+
+static bool reserveHistory(unsigned frames) {
+	if (frames <= historyCapacity) return true;
+
+	unsigned capacity = historyCapacity ? historyCapacity : 1024;
+	while (capacity < frames) capacity *= 2;
+
+	for (int ch = 0; ch < 2; ch++) {
+		s16 *grown = (s16 *)realloc(history[ch], capacity * sizeof(s16));
+		if (!grown) return false;
+		history[ch] = grown;
+	}
+	historyCapacity = capacity;
+	return true;
+}
+
+static void appendInput(const s16 *in, unsigned frames) {
+	s16 *left = history[0] + historyFrames;
+	s16 *right = history[1] + historyFrames;
+	unsigned i = 0;
+
+	for (; i + 8 <= frames; i += 8) {
+		int16x8x2_t stereo = vld2q_s16(in + i * 2);
+		vst1q_s16(left + i, stereo.val[0]);
+		vst1q_s16(right + i, stereo.val[1]);
+	}
+	for (; i < frames; i++) {
+		left[i] = in[i * 2];
+		right[i] = in[i * 2 + 1];
+	}
+
+	historyFrames += frames;
+}
+
+static inline void filterFrame(const s16 *left, const s16 *right, const s16 *coef, s16 *out) {
+	int32x4_t accLeft = vdupq_n_s32(0);
+	int32x4_t accRight = vdupq_n_s32(0);
+
+	for (unsigned k = 0; k < taps; k += 8) {
+		int16x8_t c = vld1q_s16(coef + k);
+		int16x8_t l = vld1q_s16(left + k);
+		int16x8_t r = vld1q_s16(right + k);
+		accLeft = vmlal_s16(accLeft, vget_low_s16(l), vget_low_s16(c));
+		accLeft = vmlal_s16(accLeft, vget_high_s16(l), vget_high_s16(c));
+		accRight = vmlal_s16(accRight, vget_low_s16(r), vget_low_s16(c));
+		accRight = vmlal_s16(accRight, vget_high_s16(r), vget_high_s16(c));
+	}
+
+	// {left, right, left, right}, rounded and saturated back to 16 bits
+	int32x4_t sums = vpaddq_s32(accLeft, accRight);
+	sums = vpaddq_s32(sums, sums);
+	int16x4_t pair = vqrshrn_n_s32(sums, 15);
+	vst1_lane_s32((int32_t *)out, vreinterpret_s32_s16(pair), 0);
+}
+
+unsigned resamplerProcess(const s16 *in, unsigned inFrames, s16 *out, unsigned outCapacity) {
+	if (!coefficients || !reserveHistory(historyFrames + inFrames)) return 0;
+
+	appendInput(in, inFrames);
+
+	unsigned produced = 0;
+	unsigned phaseShift = 32 - phaseBits;
+	while (produced < outCapacity) {
+		unsigned first = position >> 32;
+		if (first + taps > historyFrames) break;
+
+		const s16 *coef = coefficients + ((u32)position >> phaseShift) * taps;
+		filterFrame(history[0] + first, history[1] + first, coef, out + produced * 2);
+
+		position += step;
+		produced++;
+	}
+
+	// drop the frames no further output reaches back to
+	unsigned consumed = position >> 32;
+	if (consumed > historyFrames) consumed = historyFrames;
+	historyFrames -= consumed;
+	memmove(history[0], history[0] + consumed, historyFrames * sizeof(s16));
+	memmove(history[1], history[1] + consumed, historyFrames * sizeof(s16));
+	position -= (u64)consumed << 32;
+
+	return produced;
+}
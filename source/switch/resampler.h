@@ -0,0 +1,41 @@
+#pragma once
+
+#include <switch.h>
+
+/*
+    Polyphase FIR resampler for interleaved stereo s16, used to take the sound
+    core's output from a fixed internal rate to the audio device's rate.
+
+    The filter is a Kaiser windowed sinc with its cutoff below the lower of both
+    Nyquist frequencies. Each quality level trades taps and phase resolution
+    against CPU time, costing 2 * taps multiply-accumulates per output frame:
+
+	resamplerFast   16 taps,  64 phases
+	resamplerHigh   32 taps, 256 phases
+
+    All functions are meant to be called from the emulation thread.
+*/
+
+enum ResamplerQuality {
+	resamplerFast,
+	resamplerHigh,
+	resamplerQualityCount,
+};
+
+// builds the filter for the rates and drops any buffered input
+bool resamplerInit(unsigned inRate, unsigned outRate, ResamplerQuality quality);
+void resamplerDeinit();
+
+// drops buffered input, keeps the filter
+void resamplerReset();
+
+// scales the conversion ratio by adjust (clamped to 0.5-2), > 1 consumes input
+// faster. For rate control, the filter is designed for a ratio of 1
+void resamplerSetRatio(double adjust);
+
+// the most frames resamplerProcess can produce for inFrames more input
+unsigned resamplerMaxOutput(unsigned inFrames);
+
+// buffers inFrames stereo frames and writes up to outCapacity converted frames
+// to out, returns the number written. Input that doesn't fit in out stays buffered
+unsigned resamplerProcess(const s16 *in, unsigned inFrames, s16 *out, unsigned outCapacity);
@@ -0,0 +1,170 @@
+#include "rewind.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../gba.h"
+#include "../types.h"
+#include "xordelta.h"
+
+#define REWIND_MAX_ENTRIES 16384
+
+typedef struct {
+	u32 offset;
+	u32 size;
+} rewind_entry_t;
+
+static size_t budget = 0;
+static unsigned interval = 1;
+static unsigned framesUntilCapture = 0;
+
+static unsigned stateSize = 0;
+static unsigned stateWords = 0;
+static u32 *currentState = NULL;  // the newest capture
+static u32 *scratchState = NULL;
+// each image is refreshed incrementally against its own previous capture
+static state_checkpoint_t currentCheckpoint;
+static state_checkpoint_t scratchCheckpoint;
+static u8 *deltaBuffer = NULL;
+
+static u8 *ring = NULL;
+static size_t ringUsed = 0;
+static size_t ringWrite = 0;
+
+static rewind_entry_t entries[REWIND_MAX_ENTRIES];
+static unsigned entryFirst = 0;
+static unsigned entryCount = 0;
+
+static bool haveState = false;
+
+static void dropOldest() {
+	ringUsed -= entries[entryFirst].size;
+	entryFirst = (entryFirst + 1) % REWIND_MAX_ENTRIES;
+	entryCount--;
+}
+
+static void pushDelta(size_t size) {
+	if (size > budget) {
+		// a single delta doesn't fit, whatever is in the ring can't be reached anymore
+		entryFirst = entryCount = 0;
+		ringUsed = ringWrite = 0;
+		return;
+	}
+
+	while (entryCount > 0 && (budget - ringUsed < size || entryCount == REWIND_MAX_ENTRIES)) dropOldest();
+
+	rewind_entry_t *entry = &entries[(entryFirst + entryCount) % REWIND_MAX_ENTRIES];
+	entry->offset = ringWrite;
+	entry->size = size;
+	entryCount++;
+
+	size_t first = budget - ringWrite < size ? budget - ringWrite : size;
+	memcpy(ring + ringWrite, deltaBuffer, first);
+	memcpy(ring, deltaBuffer + first, size - first);
+
+	ringWrite = (ringWrite + size) % budget;
+	ringUsed += size;
+}
+
+static void popDelta(size_t *size) {
+	rewind_entry_t *entry = &entries[(entryFirst + entryCount - 1) % REWIND_MAX_ENTRIES];
+	*size = entry->size;
+
+	size_t first = budget - entry->offset < entry->size ? budget - entry->offset : entry->size;
+	memcpy(deltaBuffer, ring + entry->offset, first);
+	memcpy(deltaBuffer + first, ring, entry->size - first);
+
+	ringWrite = entry->offset;
+	ringUsed -= entry->size;
+	entryCount--;
+}
+
+static void freeBuffers() {
+	free(currentState);
+	free(scratchState);
+	free(deltaBuffer);
+	free(ring);
+	currentState = scratchState = NULL;
+	deltaBuffer = ring = NULL;
+}
+
+void rewindConfigure(size_t newBudget, unsigned newInterval) {
+	interval = newInterval > 0 ? newInterval : 1;
+	if (newBudget == budget) return;
+
+	budget = newBudget;
+	rewindReset(stateSize);
+}
+
+void rewindReset(unsigned size) {
+	freeBuffers();
+
+	stateSize = size;
+	stateWords = (size + 3) / 4;
+	entryFirst = entryCount = 0;
+	ringUsed = ringWrite = 0;
+	framesUntilCapture = 0;
+	haveState = false;
+	memset(&currentCheckpoint, 0, sizeof(currentCheckpoint));
+	memset(&scratchCheckpoint, 0, sizeof(scratchCheckpoint));
+
+	if (budget == 0 || size == 0) return;
+
+	// calloc so the padding words stay zero in both images
+	currentState = (u32 *)calloc(stateWords, 4);
+	scratchState = (u32 *)calloc(stateWords, 4);
+	deltaBuffer = (u8 *)malloc(xorDeltaBound(stateWords));
+	ring = (u8 *)malloc(budget);
+
+	if (!currentState || !scratchState || !deltaBuffer || !ring) {
+		printf("Failed to allocate %u bytes for rewind\n", (unsigned)budget);
+		freeBuffers();
+		budget = 0;
+	}
+}
+
+void rewindDeinit() {
+	freeBuffers();
+	budget = 0;
+	stateSize = stateWords = 0;
+	entryFirst = entryCount = 0;
+	haveState = false;
+}
+
+void rewindCapture() {
+	if (!ring || framesUntilCapture-- > 0) return;
+	framesUntilCapture = interval - 1;
+
+	if (!CPUWriteStateIncremental((u8 *)scratchState, stateSize, &scratchCheckpoint)) return;
+
+	if (haveState) pushDelta(xorDeltaEncode(currentState, scratchState, stateWords, deltaBuffer));
+
+	u32 *tmp = currentState;
+	currentState = scratchState;
+	scratchState = tmp;
+
+	state_checkpoint_t checkpoint = currentCheckpoint;
+	currentCheckpoint = scratchCheckpoint;
+	scratchCheckpoint = checkpoint;
+	haveState = true;
+}
+
+bool rewindStep() {
+	if (!ring || !haveState || entryCount == 0) return false;
+
+	size_t size;
+	popDelta(&size);
+	xorDeltaApply(currentState, deltaBuffer, size);
+
+	// capture again right after the player lets go of the button
+	framesUntilCapture = interval;
+
+	if (!CPUReadState((u8 *)currentState, stateSize)) {
+		// the image no longer matches what its checkpoint assumes
+		rewindReset(stateSize);
+		return false;
+	}
+
+	return true;
+}
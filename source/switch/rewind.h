@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    Rewind keeps the newest CPUWriteState image plus a ring of XOR+RLE deltas,
+    each one turning a capture back into the capture before it. The ring is a
+    fixed byte budget, the oldest deltas are dropped once it is full.
+
+    All functions expect the caller to hold the emulation lock.
+*/
+
+// budget 0 disables rewind, interval is the number of frames between captures
+void rewindConfigure(size_t budget, unsigned interval);
+
+// drops the history, stateSize is what CPUWriteState produces for the current game
+void rewindReset(unsigned stateSize);
+
+void rewindDeinit();
+
+// call once per emulated frame
+void rewindCapture();
+
+// restores the previous capture, returns false once the history is exhausted
+bool rewindStep();
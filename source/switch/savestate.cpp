@@ -0,0 +1,261 @@
+#include "savestate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <switch.h>
+
+#include "../gba.h"
+#include "lz4block.h"
+#include "ui.h"
+#include "util.h"
+
+#define SAVESTATE_MAGIC 0x5A534256  // "VBSZ"
+// states of older versions are somewhat larger than the current format, nothing valid comes close to this
+#define SAVESTATE_MAX_GROWTH 4
+
+typedef struct {
+	u32 magic;
+	u32 rawSize;
+	u32 packedSize;
+} savestate_header_t;
+
+static Thread workerThread;
+static Mutex workerLock;
+static CondVar workerCond;
+static bool workerQuit = false;
+// without the worker, saves are written on the calling thread
+static bool workerRunning = false;
+
+static unsigned stateSize = 0;
+static u8 *snapshotBuffers[2] = {NULL, NULL};
+static u8 *packBuffer = NULL;
+static size_t packBufferSize = 0;
+
+// indices into snapshotBuffers, -1 when unused
+static int pendingBuffer = -1;
+static int busyBuffer = -1;
+static char pendingFilename[PATH_LENGTH];
+
+static bool resultReady = false;
+static char resultMsg[PATH_LENGTH + 64];
+
+static void postResult(const char *fmt, const char *filename) {
+	mutexLock(&workerLock);
+	snprintf(resultMsg, sizeof(resultMsg), fmt, filename);
+	resultReady = true;
+	mutexUnlock(&workerLock);
+}
+
+static bool writeStateFile(const char *filename, const u8 *state) {
+	size_t packedSize = lz4BlockCompress(state, stateSize, packBuffer, packBufferSize);
+	if (packedSize == 0) return false;
+
+	savestate_header_t header = {SAVESTATE_MAGIC, stateSize, (u32)packedSize};
+
+	char tmpFilename[PATH_LENGTH + 4];
+	snprintf(tmpFilename, sizeof(tmpFilename), "%s.tmp", filename);
+
+	FILE *f = fopen(tmpFilename, "wb");
+	if (!f) {
+		printf("Failed to open %s for write\n", tmpFilename);
+		return false;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(packBuffer, 1, packedSize, f) == packedSize;
+	ok = fclose(f) == 0 && ok;
+
+	if (ok) {
+		// the target has to be gone before the rename on the SD card
+		remove(filename);
+		ok = rename(tmpFilename, filename) == 0;
+	}
+	if (!ok) {
+		printf("Failed to write to %s\n", tmpFilename);
+		remove(tmpFilename);
+	}
+
+	return ok;
+}
+
+static void workerMain(void *) {
+	char filename[PATH_LENGTH];
+
+	mutexLock(&workerLock);
+	while (true) {
+		while (pendingBuffer == -1 && !workerQuit) condvarWait(&workerCond);
+		if (pendingBuffer == -1) break;
+
+		busyBuffer = pendingBuffer;
+		pendingBuffer = -1;
+		strcpy(filename, pendingFilename);
+		mutexUnlock(&workerLock);
+
+		bool ok = writeStateFile(filename, snapshotBuffers[busyBuffer]);
+		postResult(ok ? "Wrote save state %s" : "Failed to write save state %s", filename);
+
+		mutexLock(&workerLock);
+		busyBuffer = -1;
+		condvarWakeAll(&workerCond);
+	}
+	mutexUnlock(&workerLock);
+}
+
+static void waitForWorker() {
+	mutexLock(&workerLock);
+	while (pendingBuffer != -1 || busyBuffer != -1) condvarWait(&workerCond);
+	mutexUnlock(&workerLock);
+}
+
+void saveStateInit() {
+	mutexInit(&workerLock);
+	condvarInit(&workerCond, &workerLock);
+	workerQuit = false;
+
+	Result rc = threadCreate(&workerThread, workerMain, NULL, 0x10000, 0x3B, -2);
+	if (R_SUCCEEDED(rc)) {
+		rc = threadStart(&workerThread);
+		if (R_FAILED(rc)) threadClose(&workerThread);
+	}
+	workerRunning = R_SUCCEEDED(rc);
+	if (!workerRunning) printf("Failed to start the save state thread: %x, writing synchronously\n", rc);
+}
+
+void saveStateDeinit() {
+	if (workerRunning) {
+		mutexLock(&workerLock);
+		workerQuit = true;
+		condvarWakeAll(&workerCond);
+		mutexUnlock(&workerLock);
+
+		// a queued save is still written before the worker exits
+		threadWaitForExit(&workerThread);
+		threadClose(&workerThread);
+		workerRunning = false;
+	}
+
+	free(snapshotBuffers[0]);
+	free(snapshotBuffers[1]);
+	free(packBuffer);
+	snapshotBuffers[0] = snapshotBuffers[1] = packBuffer = NULL;
+	stateSize = 0;
+}
+
+void saveStateSetSize(unsigned size) {
+	if (size <= stateSize) return;
+
+	waitForWorker();
+
+	free(snapshotBuffers[0]);
+	free(snapshotBuffers[1]);
+	free(packBuffer);
+
+	stateSize = size;
+	packBufferSize = lz4BlockBound(size);
+	snapshotBuffers[0] = (u8 *)malloc(size);
+	snapshotBuffers[1] = (u8 *)malloc(size);
+	packBuffer = (u8 *)malloc(packBufferSize);
+
+	if (!snapshotBuffers[0] || !snapshotBuffers[1] || !packBuffer) {
+		printf("Failed to allocate save state buffers\n");
+		free(snapshotBuffers[0]);
+		free(snapshotBuffers[1]);
+		free(packBuffer);
+		snapshotBuffers[0] = snapshotBuffers[1] = packBuffer = NULL;
+		stateSize = 0;
+	}
+}
+
+bool saveStateWrite(const char *filename) {
+	if (stateSize == 0) return false;
+
+	// drop a save the worker hasn't picked up yet, the newer one replaces it
+	mutexLock(&workerLock);
+	pendingBuffer = -1;
+	int buffer = busyBuffer == 0 ? 1 : 0;
+	mutexUnlock(&workerLock);
+
+	if (!CPUWriteState(snapshotBuffers[buffer], stateSize)) return false;
+
+	if (!workerRunning) {
+		bool ok = writeStateFile(filename, snapshotBuffers[buffer]);
+		postResult(ok ? "Wrote save state %s" : "Failed to write save state %s", filename);
+		return ok;
+	}
+
+	mutexLock(&workerLock);
+	strcpy_safe(pendingFilename, filename, PATH_LENGTH);
+	pendingBuffer = buffer;
+	condvarWakeAll(&workerCond);
+	mutexUnlock(&workerLock);
+
+	return true;
+}
+
+bool saveStateRead(const char *filename) {
+	if (stateSize == 0) return false;
+
+	waitForWorker();
+
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
+		printf("Failed to open %s for read\n", filename);
+		return false;
+	}
+
+	unsigned rawSize = 0;
+	bool packed = false;
+
+	savestate_header_t header;
+	if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == SAVESTATE_MAGIC) {
+		rawSize = header.rawSize;
+		packed = true;
+	} else {
+		// uncompressed states from older builds
+		fseek(f, 0, SEEK_END);
+		long fileSize = ftell(f);
+		rawSize = fileSize > 0 && fileSize <= (long)stateSize * SAVESTATE_MAX_GROWTH ? fileSize : 0;
+		fseek(f, 0, SEEK_SET);
+	}
+
+	if (rawSize == 0 || rawSize > stateSize * SAVESTATE_MAX_GROWTH) {
+		printf("Rejected %s, %u bytes of state\n", filename, rawSize);
+		fclose(f);
+		return false;
+	}
+
+	// the worker is idle and only this thread queues work, so its buffers are free.
+	// States written by older versions can be larger than the current format
+	u8 *state = rawSize <= stateSize ? snapshotBuffers[0] : (u8 *)malloc(rawSize);
+	bool ok = state != NULL;
+
+	if (ok && packed) {
+		u8 *packedData = NULL;
+		if (header.packedSize <= lz4BlockBound(rawSize))
+			packedData = header.packedSize <= packBufferSize ? packBuffer : (u8 *)malloc(header.packedSize);
+
+		ok = packedData && fread(packedData, 1, header.packedSize, f) == header.packedSize &&
+		     lz4BlockDecompress(packedData, header.packedSize, state, rawSize) == (long)rawSize;
+
+		if (packedData != packBuffer) free(packedData);
+	} else if (ok) {
+		ok = fread(state, 1, rawSize, f) == rawSize;
+	}
+	fclose(f);
+
+	ok = ok && CPUReadState(state, rawSize);
+
+	if (state != snapshotBuffers[0]) free(state);
+
+	return ok;
+}
+
+void saveStatePoll() {
+	mutexLock(&workerLock);
+	if (resultReady) {
+		uiStatusMsg("%s", resultMsg);
+		resultReady = false;
+	}
+	mutexUnlock(&workerLock);
+}
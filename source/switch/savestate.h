@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+    Save states are snapshotted into a preallocated buffer on the calling thread,
+    compressed and written to disk by a background worker. Loading waits for any
+    queued write of the same session so a quick-save/quick-load pair stays ordered.
+    If the worker can't be started, saveStateWrite writes the file itself.
+
+    saveStateWrite/saveStateRead expect the caller to hold the emulation lock.
+*/
+
+void saveStateInit();
+void saveStateDeinit();
+
+// (re)allocates the snapshot buffers, stateSize is what CPUWriteState produces
+void saveStateSetSize(unsigned stateSize);
+
+bool saveStateWrite(const char *filename);
+bool saveStateRead(const char *filename);
+
+// reports finished writes through uiStatusMsg, call from the UI thread only
+void saveStatePoll();
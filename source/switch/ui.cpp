@@ -26,19 +26,19 @@ extern "C" {
 #include "../types.h"
 #include "../GBACheats.h"
 #include "colors.h"
+#include "dirscan.h"
+#include "recorder.h"
 #include "ui.h"
 #include "util.h"
 
-#define FILENAMEBUFFER_SIZE (1024 * 32)  // 32kb
-#define FILENAMES_COUNT_MAX 2048
-
 #define SETTINGS_MAX (128)
 
-static char* filenameBuffer = NULL;
-static char* filenames[FILENAMES_COUNT_MAX];
-static int filenamesCount = 0;
+// ".." followed by the entries of currentDirectory found so far, filenames points into filenameStrings
+static std::vector<std::string> filenameStrings;
+static std::vector<const char*> filenames;
+static bool scanningDirectory = false;
 
-static char statusMessage[FILENAMES_COUNT_MAX];
+static char statusMessage[2048];
 static int statusMessageFadeout = 0;
 
 static char selectedPath[PATH_LENGTH] = {'\0'};
@@ -46,7 +46,8 @@ static char currentDirectory[PATH_LENGTH] = {'\0'};
 static int cursor = 0;
 static int scroll = 0;
 
-static const char* pauseMenuItems[] = {"Continue", "Load Savestate", "Write Savestate", "Cheats", "Settings", "Exit"};
+#define PAUSE_MENU_RECORDING 4
+static const char* pauseMenuItems[] = {"Continue", "Load Savestate", "Write Savestate", "Cheats", "Start Recording", "Settings", "Exit"};
 
 const char* themeOptions[] = {"Switch", "Dark", "Light"};
 
@@ -93,18 +94,51 @@ void uiStatusMsg(const char* format, ...) {
 	va_end(args);
 }
 
+// archives are unpacked by utilLoad, which picks the first image inside a zip
+static const char* romExtensions[] = {"gba", "zip", "gz", NULL};
+
 static void enterDirectory() {
-	filenamesCount = FILENAMES_COUNT_MAX;
-	getDirectoryContents(filenameBuffer, &filenames[0], &filenamesCount, currentDirectory, "gba");
+	filenameStrings.assign(1, "..");
+	filenames.assign(1, filenameStrings[0].c_str());
+	dirScanStart(currentDirectory, romExtensions);
+	scanningDirectory = true;
 
 	cursor = 0;
 	scroll = 0;
 }
 
+// merges what the directory scan found since the last frame, keeping the cursor on the same entry
+static void updateDirectory() {
+	if (!scanningDirectory) return;
+
+	std::vector<std::string> entries;
+	bool replace;
+	scanningDirectory = dirScanPoll(entries, &replace);
+	if (entries.empty() && !replace) return;
+
+	std::string selected = filenameStrings[cursor];
+	if (replace) filenameStrings.resize(1);
+	filenameStrings.insert(filenameStrings.end(), entries.begin(), entries.end());
+	// ".." should stay at the top
+	std::sort(filenameStrings.begin() + 1, filenameStrings.end(), dirScanLess);
+
+	filenames.resize(filenameStrings.size());
+	cursor = 0;
+	for (size_t i = 0; i < filenameStrings.size(); i++) {
+		filenames[i] = filenameStrings[i].c_str();
+		if (!cursor && filenameStrings[i] == selected) cursor = i;
+	}
+
+	if (cursor < scroll)
+		scroll = cursor;
+	else if (rowsVisible > 0 && cursor - scroll >= rowsVisible)
+		scroll = cursor - rowsVisible + 1;
+}
+
 void uiInit() {
 	setupLocalTimeOffset();
 
-	filenameBuffer = (char*)malloc(FILENAMEBUFFER_SIZE);
+	dirScanInit();
 	strcpy_safe(currentDirectory, "", PATH_LENGTH);
 	enterDirectory();
 
@@ -129,7 +163,7 @@ void uiDeinit() {
 	imageDeinit(&gbaImage);
 	imageDeinit(&logoSmall);
 
-	free(filenameBuffer);
+	dirScanDeinit();
 	free(settings);
 }
 
@@ -205,11 +239,13 @@ void uiDraw(u32 keysDown) {
 		menu = (const char**)cheatsStringList;
 		menuItemsCount = cheatsNumber + 1;
 	} else if (state == statePaused) {
+		pauseMenuItems[PAUSE_MENU_RECORDING] = recorderActive() ? "Stop Recording" : "Start Recording";
 		menu = pauseMenuItems;
 		menuItemsCount = sizeof(pauseMenuItems) / sizeof(pauseMenuItems[0]);
 	} else {
-		menu = (const char**)filenames;
-		menuItemsCount = filenamesCount;
+		updateDirectory();
+		menu = filenames.data();
+		menuItemsCount = filenames.size();
 	}
 
 	drawRect(0, 0, currentFBWidth, currentFBHeight, currentTheme.backgroundColor);
@@ -278,7 +314,8 @@ void uiDraw(u32 keysDown) {
 	// UI Buttom Bar Buttons Drawing routines
 	switch (state) {
 		case stateFileselect:
-			drawText(font16, 60, currentFBHeight - 43, currentTheme.textColor, currentDirectory);
+			drawText(font16, 60, currentFBHeight - 43, currentTheme.textColor, scanningDirectory ? "%s (scanning...)" : "%s",
+				 currentDirectory);
 			uiDrawTipButton(buttonB, 1, "Back");
 			uiDrawTipButton(buttonA, 2, "Open");
 			uiDrawTipButton(buttonX, 3, "Exit VBA Next");
@@ -395,9 +432,11 @@ UIResult uiLoop(u32 keysDown) {
 						return resultSaveState;
 					case 3:
 						return resultOpenCheats;
-					case 4:
-						return resultOpenSettings;
+					case PAUSE_MENU_RECORDING:
+						return resultToggleRecording;
 					case 5:
+						return resultOpenSettings;
+					case 6:
 						return resultClose;
 				}
 			}
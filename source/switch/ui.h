@@ -17,7 +17,8 @@ typedef enum {
 	resultCloseCheats,
 	resultOpenSettings,
 	resultSaveSettings,
-	resultCancelSettings
+	resultCancelSettings,
+	resultToggleRecording
 } UIResult;
 
 typedef enum { stateRunning, stateFileselect, statePaused, stateSettings, stateRemapButtons, stateCheats } UIState;
@@ -0,0 +1,39 @@
+#include "xordelta.h"
+
+#define XOR_DELTA_MAX_RUN 0xFFFF
+
+size_t xorDeltaBound(size_t words) { return words * 4 + (words / XOR_DELTA_MAX_RUN + 2) * 4; }
+
+size_t xorDeltaEncode(const uint32_t *older, const uint32_t *newer, size_t words, uint8_t *out) {
+	uint32_t *op = (uint32_t *)out;
+	size_t i = 0;
+
+	while (i < words) {
+		size_t skipStart = i;
+		while (i < words && older[i] == newer[i] && i - skipStart < XOR_DELTA_MAX_RUN) i++;
+		uint32_t skip = i - skipStart;
+
+		uint32_t *header = op++;
+		size_t xorStart = i;
+		while (i < words && older[i] != newer[i] && i - xorStart < XOR_DELTA_MAX_RUN) {
+			*op++ = older[i] ^ newer[i];
+			i++;
+		}
+
+		*header = skip | ((uint32_t)(i - xorStart) << 16);
+	}
+
+	return (uint8_t *)op - out;
+}
+
+void xorDeltaApply(uint32_t *image, const uint8_t *delta, size_t size) {
+	const uint32_t *ip = (const uint32_t *)delta;
+	const uint32_t *end = (const uint32_t *)(delta + size);
+	uint32_t *sp = image;
+
+	while (ip < end) {
+		uint32_t header = *ip++;
+		sp += header & 0xFFFF;
+		for (unsigned n = header >> 16; n > 0; n--) *sp++ ^= *ip++;
+	}
+}
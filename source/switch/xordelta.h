@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    XOR delta between two images of the same size, used for the rewind buffer
+    and recorded video.
+
+    A delta is a list of runs, each one a header word (skipped words in the low
+    half, XORed words in the high half) followed by the XORed words.
+    Equal words cost nothing, so the worst case is one header per 64K words.
+*/
+
+// worst case size in bytes of the delta between images of words words
+size_t xorDeltaBound(size_t words);
+
+// writes the delta turning older into newer to out, returns its size in bytes
+size_t xorDeltaEncode(const uint32_t *older, const uint32_t *newer, size_t words, uint8_t *out);
+
+// turns image into the other side of a delta of size bytes, in either direction
+void xorDeltaApply(uint32_t *image, const uint8_t *delta, size_t size);
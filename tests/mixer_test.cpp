@@ -0,0 +1,187 @@
+/* Checks the vector stereo mixer against the scalar one on the host. Built
+ * with SSE2 on x86-64 and NEON on ARM, see the Makefile. */
+
+#include "../source/sound.cpp"
+
+#include <stdio.h>
+
+uint8_t *ioMem = NULL;
+
+void systemOnWriteDataToSoundBuffer(int16_t *, int) {}
+void utilWriteDataMem(uint8_t *&, variable_desc *) {}
+void utilReadDataMem(const uint8_t *&, variable_desc *) {}
+unsigned utilDataMemSize(const variable_desc *) { return 0; }
+void CPUCheckDMA(int, int) {}
+
+#if !defined(STEREO_BUFFER_NEON) && !defined(STEREO_BUFFER_SSE2)
+#error "no vector mixer for this host"
+#endif
+
+#define SAMPLE_RATE 48000
+#define MAX_PAIRS 3000
+
+typedef struct
+{
+	int32_t *buffers [BUFS_SIZE];
+	uint32_t read_pos;
+	int32_t accum [BUFS_SIZE];
+} mixer_state_t;
+
+static uint32_t seed = 0x12345678;
+
+static uint32_t next_random(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/* uniform in [-range, range) */
+static int32_t random_in(int32_t range)
+{
+	return (int32_t) (next_random() % (2 * (uint32_t) range)) - range;
+}
+
+static void save_state(mixer_state_t *state)
+{
+	size_t size = (bufs_buffer[0].buffer_mask_ + 1) * sizeof(int32_t);
+	for (int i = 0; i < BUFS_SIZE; i++)
+	{
+		memcpy(state->buffers[i], bufs_buffer[i].buffer_, size);
+		state->accum[i] = bufs_buffer[i].reader_accum_;
+	}
+	state->read_pos = bufs_buffer[0].read_pos_;
+}
+
+static void load_state(const mixer_state_t *state)
+{
+	size_t size = (bufs_buffer[0].buffer_mask_ + 1) * sizeof(int32_t);
+	for (int i = 0; i < BUFS_SIZE; i++)
+	{
+		memcpy(bufs_buffer[i].buffer_, state->buffers[i], size);
+		bufs_buffer[i].reader_accum_ = state->accum[i];
+		bufs_buffer[i].read_pos_ = state->read_pos;
+	}
+}
+
+static bool states_equal(const mixer_state_t *a, const mixer_state_t *b)
+{
+	size_t size = (bufs_buffer[0].buffer_mask_ + 1) * sizeof(int32_t);
+	for (int i = 0; i < BUFS_SIZE; i++)
+		if (memcmp(a->buffers[i], b->buffers[i], size) || a->accum[i] != b->accum[i])
+			return false;
+	return a->read_pos == b->read_pos;
+}
+
+static mixer_state_t before, expected, actual;
+static int16_t expected_out [MAX_PAIRS * STEREO];
+static int16_t actual_out [MAX_PAIRS * STEREO];
+
+/* runs both mixers from the current buffers, returns false on a mismatch */
+static bool check(const char *name, int count)
+{
+	save_state(&before);
+
+	memset(expected_out, 0x55, sizeof(expected_out));
+	stereo_buffer_mixer_read_pairs_ref(expected_out, count);
+	save_state(&expected);
+
+	load_state(&before);
+	memset(actual_out, 0x55, sizeof(actual_out));
+	stereo_buffer_mixer_read_pairs(actual_out, count);
+	save_state(&actual);
+
+	if (memcmp(expected_out, actual_out, sizeof(expected_out)))
+	{
+		for (int i = 0; i < count * STEREO; i++)
+			if (expected_out[i] != actual_out[i])
+			{
+				printf("%s: %d pairs from %u, sample %d is %d, expected %d\n", name, count,
+						before.read_pos, i, actual_out[i], expected_out[i]);
+				break;
+			}
+		return false;
+	}
+	if (!states_equal(&expected, &actual))
+	{
+		printf("%s: %d pairs from %u, buffers or accumulators differ\n", name, count, before.read_pos);
+		return false;
+	}
+	return true;
+}
+
+static void fill_random(int32_t range)
+{
+	for (int i = 0; i < BUFS_SIZE; i++)
+		for (uint32_t j = 0; j <= bufs_buffer[i].buffer_mask_; j++)
+			bufs_buffer[i].buffer_[j] = random_in(range);
+}
+
+static void set_read_pos(uint32_t pos)
+{
+	for (int i = 0; i < BUFS_SIZE; i++)
+		bufs_buffer[i].read_pos_ = pos;
+}
+
+/* makes the first pair come out as (left, right) before clamping */
+static void set_first_pair(int32_t left, int32_t right)
+{
+	int32_t center = random_in(1 << 20);
+	bufs_buffer[0].reader_accum_ = left * (1 << 14) - center;
+	bufs_buffer[1].reader_accum_ = right * (1 << 14) - center;
+	bufs_buffer[2].reader_accum_ = center;
+}
+
+int main(void)
+{
+	if (stereo_buffer_set_sample_rate(SAMPLE_RATE, BLIP_DEFAULT_LENGTH))
+	{
+		printf("Failed to allocate the buffers\n");
+		return 1;
+	}
+
+	size_t size = (bufs_buffer[0].buffer_mask_ + 1) * sizeof(int32_t);
+	for (int i = 0; i < BUFS_SIZE; i++)
+	{
+		before.buffers[i] = (int32_t *) malloc(size);
+		expected.buffers[i] = (int32_t *) malloc(size);
+		actual.buffers[i] = (int32_t *) malloc(size);
+	}
+
+	uint32_t mask = bufs_buffer[0].buffer_mask_;
+	int failures = 0;
+
+	/* ordinary sound, with reads that start anywhere and wrap around the ring */
+	for (int run = 0; run < 2000; run++)
+	{
+		fill_random(1 << 20);
+		for (int i = 0; i < BUFS_SIZE; i++)
+			bufs_buffer[i].reader_accum_ = random_in(1 << 28);
+
+		uint32_t pos = run & 1 ? mask - next_random() % 16 : next_random() & BLIP_BUFFER_POS_MASK;
+		set_read_pos(pos);
+		failures += !check("random", 1 + next_random() % MAX_PAIRS);
+	}
+
+	/* both sides of each clamping limit, and close to the largest a >> 14 can reach */
+	static const int32_t edges [] = {32766, 32767, 32768, 32769, -32767, -32768, -32769, -32770, 131000, -131000, 0};
+	int edge_count = sizeof(edges) / sizeof(edges[0]);
+	for (int l = 0; l < edge_count; l++)
+		for (int r = 0; r < edge_count; r++)
+			for (int count = 1; count <= 9; count++)
+			{
+				fill_random(1 << 8);
+				set_read_pos(mask - count / 2);
+				set_first_pair(edges[l], edges[r]);
+				failures += !check("clamp", count);
+			}
+
+	if (failures)
+	{
+		printf("%d mixer checks failed\n", failures);
+		return 1;
+	}
+	printf("Mixer checks passed\n");
+	return 0;
+}